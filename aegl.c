@@ -2,64 +2,175 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "aegl.h"
+#include "i2c.h"
+#include "lcd.h"
 #include "pic.h"
+#include "trace.h"
 
-static uint8_t lcd_trace_porta = 0;
-static uint8_t lcd_trace_portb = 0;
-static uint8_t lcd_trace_portc = 0;
-static uint8_t i2c_trace_trisc = 0;
-static int uart_delay = 0;
+#define AEGL_CYCLES_PER_SECOND 1000000 /* 4 MHz oscillator. */
+#define AEGL_IDLE_POLLS 100
 
+struct aegl_script_s {
+  uint8_t *data;
+  size_t size;
+  size_t pos;
+  uint32_t commands;
+  uint32_t replies;
+  uint32_t start_cycle;
+  struct timespec start_time;
+};
 
 
-static void lcd_trace(uint32_t cycle)
+
+static void lcd_update(aegl_t *aegl, pic_t *pic)
 {
-  bool cs1    = lcd_trace_porta & 0x08;
-  bool cs2    = lcd_trace_porta & 0x20;
-  bool rw     = lcd_trace_portc & 0x01;
-  bool type   = lcd_trace_portc & 0x02;
-  bool reset  = lcd_trace_portc & 0x04;
-  bool enable = lcd_trace_portc & 0x20;
+  char filename[256];
+  int drive;
+
+  drive = lcd_bus(&aegl->lcd,
+    ((aegl->lcd_trace_porta & 0x08) ? 0 : 1) |
+    ((aegl->lcd_trace_porta & 0x20) ? 0 : 2),
+    aegl->lcd_trace_portc & 0x20,
+    aegl->lcd_trace_portc & 0x01,
+    aegl->lcd_trace_portc & 0x02,
+    aegl->lcd_trace_portc & 0x04,
+    aegl->lcd_trace_portb);
+  if (drive >= 0 && drive != pic->in_portb) {
+    /* Controller drives the data bus on reads. */
+    pic_port_input_set(pic, PIC_INPUT_PORTB, drive);
+  }
+
+  if (lcd_frame(&aegl->lcd, pic->cycle) && aegl->lcd_dump_prefix != NULL) {
+    if (aegl->lcd.frame % aegl->lcd_dump_every == 0) {
+      snprintf(filename, sizeof(filename), "%s%06u.pbm",
+        aegl->lcd_dump_prefix, aegl->lcd.frame);
+      lcd_dump_pbm(&aegl->lcd, filename);
+    }
+  }
 
-  fprintf(stdout, "LCD | %08x %s %s %s %s %s %s %02x\n",
-    cycle,
-    cs1    ? "-  "   : "CS1",
-    cs2    ? "-  "   : "CS2",
-    reset  ? "Rst"   : "-  ",
-    enable ? "En"    : "- ",
-    rw     ? "Read " : "Write",
-    type   ? "Data"  : "Cmd ",
-    lcd_trace_portb);
+  if (aegl->lcd_trace_enabled) {
+    trace_event(pic->cycle, TRACE_SOURCE_LCD, aegl->lcd_trace_porta,
+      aegl->lcd_trace_portc, aegl->lcd_trace_portb);
+  }
 }
 
 
 
-static void i2c_trace(uint8_t value, uint32_t cycle)
+static void i2c_trace(aegl_t *aegl, uint8_t value, uint32_t cycle)
 {
   value &= 0x18;
-  if (value != i2c_trace_trisc) {
-    i2c_trace_trisc = value;
-    bool scl = value & 0x08;
-    bool sda = value & 0x10;
-    fprintf(stdout, "I2C | %08x %s %s\n",
-      cycle,
-      scl ? "SCL" : "-  ",
-      sda ? "SDA" : "-  ");
+  if (value != aegl->i2c_trace_trisc) {
+    aegl->i2c_trace_trisc = value;
+    trace_event(cycle, TRACE_SOURCE_I2C, value, 0, 0);
+  }
+}
+
+
+
+static void i2c_bus_update(aegl_t *aegl, pic_t *pic)
+{
+  uint8_t trisc = pic->r[PIC_REG_TRISC];
+  uint8_t portc = pic->r[PIC_REG_PORTC];
+  uint8_t value;
+  bool scl;
+  bool sda;
+
+  /* Open-drain lines, only driven when the TRIS bit is cleared. */
+  scl = (trisc & 0x08) ? true : (portc & 0x08);
+  sda = (trisc & 0x10) ? true : (portc & 0x10);
+  sda = i2c_update(&aegl->i2c, &aegl->i2c_eeprom, scl, sda);
+
+  /* SCL is pulled up and SDA may be held low by the slave. */
+  value = (pic->in_portc & ~0x18) | 0x08 | (sda ? 0x10 : 0);
+  if (value != pic->in_portc) {
+    pic_port_input_set(pic, PIC_INPUT_PORTC, value);
+  }
+}
+
+
+
+static void script_report(aegl_script_t *script, pic_t *pic)
+{
+  struct timespec now;
+  uint32_t cycles;
+  double emulated;
+  double host;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  host = (now.tv_sec - script->start_time.tv_sec) +
+    ((now.tv_nsec - script->start_time.tv_nsec) / 1e9);
+  cycles = pic->cycle - script->start_cycle;
+  emulated = (double)cycles / AEGL_CYCLES_PER_SECOND;
+
+  fflush(stdout);
+  fprintf(stderr, "Script | %u commands, %zu bytes, %u reply bytes\n",
+    script->commands, script->size, script->replies);
+  fprintf(stderr, "Script | %u cycles, %.1f cycles/command\n", cycles,
+    script->commands > 0 ? (double)cycles / script->commands : 0.0);
+  fprintf(stderr, "Script | %.6f s emulated, %.1f commands/s emulated\n",
+    emulated, emulated > 0 ? script->commands / emulated : 0.0);
+  fprintf(stderr, "Script | %.6f s host, %.1f commands/s host, %.1fx real time\n",
+    host, host > 0 ? script->commands / host : 0.0,
+    host > 0 ? emulated / host : 0.0);
+}
+
+
+
+static void script_poll(aegl_t *aegl, pic_t *pic)
+{
+  aegl_script_t *script = aegl->script;
+  int c;
+
+  if (pic->r[PIC_REG_PIR1] & 0x20) {
+    return; /* Previous byte not taken yet. */
+  }
+
+  if (script->pos < script->size) {
+    if (script->pos == 0) {
+      script->start_cycle = pic->cycle;
+      clock_gettime(CLOCK_MONOTONIC, &script->start_time);
+    }
+    c = script->data[script->pos++];
+    if (c == '\n') {
+      c = '\r';
+      script->commands++;
+    } else if (c == '.') {
+      c = 0x1B;
+    }
+    pic_uart_rx_write(pic, c);
+    aegl->uart_delay = 0;
+    return;
+  }
+
+  /* Script done, wait for the firmware to settle in its idle loop. */
+  aegl->uart_delay++;
+  if (aegl->uart_delay > AEGL_IDLE_POLLS) {
+    script_report(script, pic);
+    exit(EXIT_SUCCESS);
   }
 }
 
 
 
-static void aegl_reg_read(pic_t *pic, uint16_t f)
+static void aegl_reg_read(pic_t *pic, void *user, uint16_t f)
 {
+  aegl_t *aegl = user;
   int c;
 
-  if (f == PIC_REG_PIR1) {
-    uart_delay++;
-    if (uart_delay > 100) {
+  if (f == PIC_REG_PIR1 && aegl->script != NULL) {
+    /* Boot is over once the firmware polls for UART input. */
+    if (aegl->script->pos > 0 || ++aegl->uart_delay > AEGL_IDLE_POLLS) {
+      script_poll(aegl, pic);
+    }
+  } else if (f == PIC_REG_PIR1 && aegl->uart_input != NULL) {
+    aegl->uart_delay++;
+    if (aegl->uart_delay > AEGL_IDLE_POLLS) {
+      trace_sync(); /* Keep the prompt after any pending trace output. */
       fprintf(stdout, "> ");
-      c = fgetc(stdin);
+      c = fgetc(aegl->uart_input);
       if (c == EOF) {
         exit(EXIT_SUCCESS);
       } else if (c == '\n') {
@@ -67,61 +178,181 @@ static void aegl_reg_read(pic_t *pic, uint16_t f)
       } else if (c == '.') {
         c = 0x1B; /* Convenient way to write the starting escape character. */
       }
-      pic->r[PIC_REG_RCREG] = c;
-      pic->r[PIC_REG_PIR1] |= 0x20; /* Set RCIF to indicate new data. */
-      uart_delay = 0;
+      pic_uart_rx_write(pic, c);
+      aegl->uart_delay = 0;
     }
   }
 }
 
 
 
-static void aegl_reg_write(pic_t *pic, uint16_t f)
+static void aegl_reg_write(pic_t *pic, void *user, uint16_t f)
 {
+  aegl_t *aegl = user;
   uint8_t value;
 
   switch (f) {
   case PIC_REG_TXREG:
-    fprintf(stdout, "TXREG | 0x%02x\n", pic->r[f]);
+    if (aegl->script != NULL) {
+      fputc(pic->r[f], stdout);
+      aegl->script->replies++;
+    } else {
+      trace_event(pic->cycle, TRACE_SOURCE_TXREG, pic->r[f], 0, 0);
+    }
     break;
 
   case PIC_REG_PORTA:
     value = pic->r[f] & 0x28;
-    if (value != lcd_trace_porta) {
-      lcd_trace_porta = value;
-      lcd_trace(pic->cycle);
+    if (value != aegl->lcd_trace_porta) {
+      aegl->lcd_trace_porta = value;
+      lcd_update(aegl, pic);
     }
     break;
 
   case PIC_REG_PORTB:
     value = pic->r[f];
-    if (value != lcd_trace_portb) {
-      lcd_trace_portb = value;
-      lcd_trace(pic->cycle);
+    if (value != aegl->lcd_trace_portb) {
+      aegl->lcd_trace_portb = value;
+      lcd_update(aegl, pic);
     }
     break;
 
   case PIC_REG_PORTC:
     value = pic->r[f] & 0x27;
-    if (value != lcd_trace_portc) {
-      lcd_trace_portc = value;
-      lcd_trace(pic->cycle);
+    if (value != aegl->lcd_trace_portc) {
+      aegl->lcd_trace_portc = value;
+      lcd_update(aegl, pic);
     }
+    i2c_bus_update(aegl, pic);
     break;
 
   case PIC_REG_TRISC:
-    i2c_trace(pic->r[f], pic->cycle);
+    if (aegl->script == NULL) {
+      i2c_trace(aegl, pic->r[f], pic->cycle);
+    }
+    i2c_bus_update(aegl, pic);
     break;
   }
 }
 
 
 
-void aegl_init(pic_t *pic)
+void aegl_state_get(aegl_t *aegl, aegl_state_t *state)
+{
+  state->lcd_trace_porta = aegl->lcd_trace_porta;
+  state->lcd_trace_portb = aegl->lcd_trace_portb;
+  state->lcd_trace_portc = aegl->lcd_trace_portc;
+  state->i2c_trace_trisc = aegl->i2c_trace_trisc;
+  state->uart_delay = aegl->uart_delay;
+  state->lcd = aegl->lcd;
+  state->i2c = aegl->i2c;
+}
+
+
+
+void aegl_state_set(aegl_t *aegl, const aegl_state_t *state)
+{
+  aegl->lcd_trace_porta = state->lcd_trace_porta;
+  aegl->lcd_trace_portb = state->lcd_trace_portb;
+  aegl->lcd_trace_portc = state->lcd_trace_portc;
+  aegl->i2c_trace_trisc = state->i2c_trace_trisc;
+  aegl->uart_delay = state->uart_delay;
+  aegl->lcd = state->lcd;
+  aegl->i2c = state->i2c;
+}
+
+
+
+void aegl_lcd_trace(aegl_t *aegl, bool enable)
+{
+  aegl->lcd_trace_enabled = enable;
+}
+
+
+
+void aegl_lcd_dump_frames(aegl_t *aegl, const char *prefix, uint32_t every)
+{
+  aegl->lcd_dump_prefix = prefix;
+  aegl->lcd_dump_every = (every > 0) ? every : 1;
+}
+
+
+
+int aegl_lcd_dump(aegl_t *aegl, const char *filename)
+{
+  return lcd_dump_pbm(&aegl->lcd, filename);
+}
+
+
+
+int aegl_i2c_eeprom(aegl_t *aegl, const char *filename, size_t size)
+{
+  i2c_eeprom_close(&aegl->i2c_eeprom);
+  return i2c_eeprom_open(&aegl->i2c_eeprom, filename, size);
+}
+
+
+
+void aegl_uart_input(aegl_t *aegl, FILE *fh)
+{
+  aegl->uart_input = fh;
+}
+
+
+
+int aegl_script(aegl_t *aegl, const char *filename)
+{
+  aegl_script_t *script;
+  FILE *fh;
+  long size;
+
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    return -1;
+  }
+
+  script = calloc(1, sizeof(aegl_script_t));
+  if (script == NULL) {
+    fclose(fh);
+    return -1;
+  }
+
+  /* Read it all up front to keep file access out of the measurement. */
+  fseek(fh, 0, SEEK_END);
+  size = ftell(fh);
+  rewind(fh);
+  script->data = malloc(size > 0 ? size : 1);
+  if (script->data == NULL ||
+      fread(script->data, 1, size, fh) != (size_t)size) {
+    fclose(fh);
+    free(script->data);
+    free(script);
+    return -1;
+  }
+  script->size = size;
+  aegl->script = script;
+
+  fclose(fh);
+  return 0;
+}
+
+
+
+void aegl_init(aegl_t *aegl, pic_t *pic)
 {
+  aegl->uart_input = stdin;
+  aegl->lcd_dump_every = 1;
+  lcd_init(&aegl->lcd);
+  i2c_init(&aegl->i2c);
+  if (aegl->i2c_eeprom.data == NULL) {
+    i2c_eeprom_open(&aegl->i2c_eeprom, NULL, I2C_EEPROM_DEFAULT_SIZE);
+  }
   pic->in_porta = 0x10; /* Set JP1 input to disable DEMO mode. */
+  pic->in_portc = 0x18; /* Pull-ups on the I2C lines. */
   pic->reg_read_hook = aegl_reg_read;
+  pic->reg_read_user = aegl;
   pic->reg_write_hook = aegl_reg_write;
+  pic->reg_write_user = aegl;
 }
 
 
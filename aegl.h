@@ -1,8 +1,51 @@
 #ifndef _AEGL_H
 #define _AEGL_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "i2c.h"
+#include "lcd.h"
 #include "pic.h"
 
-void aegl_init(pic_t *pic);
+typedef struct aegl_state_s {
+  uint8_t lcd_trace_porta;
+  uint8_t lcd_trace_portb;
+  uint8_t lcd_trace_portc;
+  uint8_t i2c_trace_trisc;
+  int32_t uart_delay;
+  lcd_t lcd;
+  i2c_t i2c;
+} aegl_state_t;
+
+typedef struct aegl_script_s aegl_script_t;
+
+/* One AE-GraphicLCD board, passed to the PIC hooks as their user pointer. */
+typedef struct aegl_s {
+  uint8_t lcd_trace_porta;
+  uint8_t lcd_trace_portb;
+  uint8_t lcd_trace_portc;
+  uint8_t i2c_trace_trisc;
+  int32_t uart_delay;
+  FILE *uart_input;
+  lcd_t lcd;
+  bool lcd_trace_enabled;
+  const char *lcd_dump_prefix;
+  uint32_t lcd_dump_every;
+  i2c_t i2c;
+  i2c_eeprom_t i2c_eeprom;
+  aegl_script_t *script;
+} aegl_t;
+
+void aegl_state_get(aegl_t *aegl, aegl_state_t *state);
+void aegl_state_set(aegl_t *aegl, const aegl_state_t *state);
+void aegl_lcd_trace(aegl_t *aegl, bool enable);
+void aegl_lcd_dump_frames(aegl_t *aegl, const char *prefix, uint32_t every);
+int aegl_lcd_dump(aegl_t *aegl, const char *filename);
+int aegl_i2c_eeprom(aegl_t *aegl, const char *filename, size_t size);
+void aegl_uart_input(aegl_t *aegl, FILE *fh);
+int aegl_script(aegl_t *aegl, const char *filename);
+void aegl_init(aegl_t *aegl, pic_t *pic);
 
 #endif /* _AEGL_H */
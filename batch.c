@@ -0,0 +1,574 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lockstep.h"
+#include "mem.h"
+#include "pic.h"
+#include "stimulus.h"
+
+/* Batch runner, executing the jobs of a manifest on a pool of worker
+ * threads with one emulator instance per job. Manifest format, one job
+ * per line:
+ *
+ *   <hex-file> <stimulus-file> <cycles>
+ *
+ * The stimulus file is "-" for none. Empty lines and lines starting with
+ * '#' are ignored. Every HEX and stimulus file is loaded once up front
+ * and shared by all jobs using it.
+ *
+ * Jobs are dealt out round robin into one deque per worker. A worker
+ * takes jobs from the back of its own deque, and when that is empty
+ * steals from the front of the others, so a few long jobs do not leave
+ * the other cores idle. Each job runs until its cycle budget is used up
+ * or the core panics.
+ *
+ * With -l, runs of up to LOCKSTEP_LANES consecutive jobs using the same
+ * HEX file are run together as one lockstep group instead, which is
+ * dealt out and stolen as a whole.
+ *
+ * The report has one tab separated line per job in manifest order, with
+ * the result, the cycles executed, the number of bytes written to TXREG
+ * and FNV-1a hashes of those bytes and of the final EEPROM contents.
+ */
+
+#define BATCH_LINE_MAX 1024
+
+typedef struct batch_image_s {
+  char *filename;
+  mem_t mem;
+} batch_image_t;
+
+typedef struct batch_stimulus_s {
+  char *filename;
+  stimulus_t stimulus;
+} batch_stimulus_t;
+
+typedef struct batch_job_s {
+  uint32_t line;
+  batch_image_t *image;
+  batch_stimulus_t *stimulus;
+  uint32_t budget;
+  /* Results. */
+  bool done;
+  bool panic;
+  char panic_msg[PIC_PANIC_MAX];
+  uint32_t cycles;
+  uint32_t uart_bytes;
+  uint64_t uart_hash;
+  uint64_t eeprom_hash;
+} batch_job_t;
+
+typedef struct batch_group_s {
+  size_t first;
+  size_t count;
+} batch_group_t;
+
+typedef struct batch_queue_s {
+  pthread_mutex_t lock;
+  size_t *group;
+  size_t head;
+  size_t tail;
+} batch_queue_t;
+
+static batch_image_t **batch_images = NULL;
+static size_t batch_image_count = 0;
+static batch_stimulus_t **batch_stimuli = NULL;
+static size_t batch_stimulus_count = 0;
+static batch_job_t *batch_jobs = NULL;
+static size_t batch_job_count = 0;
+static batch_group_t *batch_groups = NULL;
+static size_t batch_group_count = 0;
+static int batch_lanes = 1;
+static batch_queue_t *batch_queues = NULL;
+static int batch_workers = 0;
+
+
+
+static batch_image_t *batch_image_get(const char *filename)
+{
+  batch_image_t *image;
+  batch_image_t **p;
+
+  for (size_t i = 0; i < batch_image_count; i++) {
+    if (strcmp(batch_images[i]->filename, filename) == 0) {
+      return batch_images[i];
+    }
+  }
+
+  image = calloc(1, sizeof(batch_image_t));
+  p = realloc(batch_images, (batch_image_count + 1) * sizeof(*p));
+  if (image == NULL || p == NULL) {
+    free(image);
+    return NULL;
+  }
+  batch_images = p;
+
+  if (mem_init(&image->mem) != 0) {
+    free(image);
+    return NULL;
+  }
+  image->filename = strdup(filename);
+  if (image->filename == NULL || mem_load(&image->mem, filename) != 0) {
+    fprintf(stderr, "Unable to load HEX file: %s\n", filename);
+    mem_free(&image->mem);
+    free(image->filename);
+    free(image);
+    return NULL;
+  }
+  /* Decoded once up front, as jobs share the program between threads. */
+  pic_predecode(&image->mem);
+
+  batch_images[batch_image_count++] = image;
+  return image;
+}
+
+
+
+static batch_stimulus_t *batch_stimulus_get(const char *filename)
+{
+  batch_stimulus_t *stimulus;
+  batch_stimulus_t **p;
+
+  for (size_t i = 0; i < batch_stimulus_count; i++) {
+    if (strcmp(batch_stimuli[i]->filename, filename) == 0) {
+      return batch_stimuli[i];
+    }
+  }
+
+  stimulus = calloc(1, sizeof(batch_stimulus_t));
+  p = realloc(batch_stimuli, (batch_stimulus_count + 1) * sizeof(*p));
+  if (stimulus == NULL || p == NULL) {
+    free(stimulus);
+    return NULL;
+  }
+  batch_stimuli = p;
+
+  stimulus->filename = strdup(filename);
+  if (stimulus->filename == NULL ||
+    stimulus_load(&stimulus->stimulus, filename) != 0) {
+    fprintf(stderr, "Unable to load stimulus file: %s\n", filename);
+    free(stimulus->filename);
+    free(stimulus);
+    return NULL;
+  }
+
+  batch_stimuli[batch_stimulus_count++] = stimulus;
+  return stimulus;
+}
+
+
+
+static int batch_manifest_load(const char *filename)
+{
+  char line[BATCH_LINE_MAX];
+  char hex[BATCH_LINE_MAX];
+  char stimulus[BATCH_LINE_MAX];
+  unsigned long budget;
+  uint32_t line_no = 0;
+  size_t size = 0;
+  batch_job_t *job;
+  batch_job_t *p;
+  FILE *fh;
+
+  fh = fopen(filename, "r");
+  if (fh == NULL) {
+    fprintf(stderr, "Unable to open manifest: %s\n", filename);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fh) != NULL) {
+    line_no++;
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+      continue;
+    }
+
+    if (batch_job_count == size) {
+      size = (size == 0) ? 64 : size * 2;
+      p = realloc(batch_jobs, size * sizeof(batch_job_t));
+      if (p == NULL) {
+        fclose(fh);
+        return -1;
+      }
+      batch_jobs = p;
+    }
+
+    job = &batch_jobs[batch_job_count];
+    memset(job, 0, sizeof(batch_job_t));
+    if (sscanf(line, "%s %s %lu", hex, stimulus, &budget) != 3) {
+      fprintf(stderr, "%s:%u: Invalid job\n", filename, line_no);
+      fclose(fh);
+      return -1;
+    }
+    job->line = line_no;
+    job->budget = budget;
+    job->image = batch_image_get(hex);
+    if (job->image == NULL) {
+      fclose(fh);
+      return -1;
+    }
+    if (strcmp(stimulus, "-") != 0) {
+      job->stimulus = batch_stimulus_get(stimulus);
+      if (job->stimulus == NULL) {
+        fclose(fh);
+        return -1;
+      }
+    }
+    batch_job_count++;
+  }
+
+  fclose(fh);
+  return 0;
+}
+
+
+
+static void batch_uart_hook(pic_t *pic, void *user, uint16_t f)
+{
+  batch_job_t *job = user;
+
+  if (f == PIC_REG_TXREG) {
+    job->uart_hash = mem_hash(job->uart_hash, &pic->r[f], 1);
+    job->uart_bytes++;
+  }
+}
+
+
+
+static void batch_panic_hook(pic_t *pic, void *user)
+{
+  batch_job_t *job = user;
+
+  (void)pic;
+  job->panic = true;
+}
+
+
+
+static void batch_job_start(batch_job_t *job, mem_t *mem, pic_t *pic,
+  stimulus_t *stimulus)
+{
+  mem_share(mem, &job->image->mem);
+  pic_init(pic, mem);
+  pic->reg_write_hook = batch_uart_hook;
+  pic->reg_write_user = job;
+  pic->panic_hook = batch_panic_hook;
+  pic->panic_user = job;
+  if (job->stimulus != NULL) {
+    *stimulus = job->stimulus->stimulus;
+    stimulus->index = 0;
+  } else {
+    memset(stimulus, 0, sizeof(stimulus_t));
+  }
+
+  job->uart_hash = MEM_HASH_INIT;
+}
+
+
+
+static void batch_job_finish(batch_job_t *job, mem_t *mem, pic_t *pic)
+{
+  job->cycles = pic->cycle;
+  job->eeprom_hash = mem_hash(MEM_HASH_INIT, mem->eeprom, MEM_EEPROM_MAX);
+  if (job->panic) {
+    strncpy(job->panic_msg, pic->panic_msg, sizeof(job->panic_msg) - 1);
+  }
+  mem_free(mem);
+  job->done = true;
+}
+
+
+
+static void batch_job_run(batch_job_t *job)
+{
+  stimulus_t stimulus;
+  uint32_t event_cycle = 0;
+  mem_t mem;
+  pic_t pic;
+
+  batch_job_start(job, &mem, &pic, &stimulus);
+  while (pic.cycle < job->budget && ! job->panic) {
+    if (pic.cycle >= event_cycle) {
+      event_cycle = stimulus_apply(&stimulus, &pic);
+    }
+    pic_execute(&pic, &mem);
+  }
+  batch_job_finish(job, &mem, &pic);
+}
+
+
+
+/* Same as batch_job_run() for each job, with the lanes stopping at their
+ * next stimulus change so it is applied at the same cycle. */
+static void batch_group_run(batch_group_t *group)
+{
+  stimulus_t stimulus[LOCKSTEP_LANES];
+  uint32_t event_cycle[LOCKSTEP_LANES];
+  mem_t mem[LOCKSTEP_LANES];
+  pic_t pic[LOCKSTEP_LANES];
+  batch_job_t *job;
+  lockstep_t ls;
+  bool running;
+
+  lockstep_init(&ls);
+  for (size_t i = 0; i < group->count; i++) {
+    batch_job_start(&batch_jobs[group->first + i], &mem[i], &pic[i],
+      &stimulus[i]);
+    event_cycle[i] = 0;
+    lockstep_add(&ls, &pic[i]);
+  }
+
+  do {
+    running = false;
+    for (size_t i = 0; i < group->count; i++) {
+      job = &batch_jobs[group->first + i];
+      ls.stop[i] = 0;
+      if (job->panic || pic[i].cycle >= job->budget) {
+        continue;
+      }
+      if (pic[i].cycle >= event_cycle[i]) {
+        event_cycle[i] = stimulus_apply(&stimulus[i], &pic[i]);
+      }
+      ls.stop[i] = (event_cycle[i] < job->budget) ?
+        event_cycle[i] : job->budget;
+      running = true;
+    }
+    lockstep_run(&ls);
+  } while (running);
+
+  for (size_t i = 0; i < group->count; i++) {
+    lockstep_sync(&ls, i);
+    batch_job_finish(&batch_jobs[group->first + i], &mem[i], &pic[i]);
+  }
+}
+
+
+
+static int batch_group_setup(void)
+{
+  batch_group_t *group = NULL;
+
+  batch_groups = calloc(batch_job_count, sizeof(batch_group_t));
+  if (batch_groups == NULL) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < batch_job_count; i++) {
+    if (group == NULL || (int)group->count == batch_lanes ||
+      batch_jobs[group->first].image != batch_jobs[i].image) {
+      group = &batch_groups[batch_group_count++];
+      group->first = i;
+    }
+    group->count++;
+  }
+  return 0;
+}
+
+
+
+static bool batch_group_take(int worker, size_t *index)
+{
+  batch_queue_t *q;
+
+  /* Own jobs from the back first, then steal from the front of others. */
+  q = &batch_queues[worker];
+  pthread_mutex_lock(&q->lock);
+  if (q->tail > q->head) {
+    *index = q->group[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+    return true;
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  for (int i = 1; i < batch_workers; i++) {
+    q = &batch_queues[(worker + i) % batch_workers];
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+      *index = q->group[q->head++];
+      pthread_mutex_unlock(&q->lock);
+      return true;
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+
+  return false;
+}
+
+
+
+static void *batch_worker(void *arg)
+{
+  int worker = (int)(intptr_t)arg;
+  size_t index;
+
+  while (batch_group_take(worker, &index)) {
+    if (batch_lanes == 1) {
+      batch_job_run(&batch_jobs[batch_groups[index].first]);
+    } else {
+      batch_group_run(&batch_groups[index]);
+    }
+  }
+  return NULL;
+}
+
+
+
+static int batch_run(void)
+{
+  pthread_t *threads;
+  batch_queue_t *q;
+  int started;
+
+  batch_queues = calloc(batch_workers, sizeof(batch_queue_t));
+  threads = calloc(batch_workers, sizeof(pthread_t));
+  if (batch_queues == NULL || threads == NULL || batch_group_setup() != 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < batch_workers; i++) {
+    q = &batch_queues[i];
+    pthread_mutex_init(&q->lock, NULL);
+    q->group = malloc(((batch_group_count / batch_workers) + 1) *
+      sizeof(size_t));
+    if (q->group == NULL) {
+      return -1;
+    }
+  }
+  for (size_t i = 0; i < batch_group_count; i++) {
+    q = &batch_queues[i % batch_workers];
+    q->group[q->tail++] = i;
+  }
+
+  /* Queues of workers that failed to start get stolen by the others, or
+   * run here if no worker started at all. */
+  for (started = 0; started < batch_workers; started++) {
+    if (pthread_create(&threads[started], NULL, batch_worker,
+      (void *)(intptr_t)started) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    batch_worker((void *)(intptr_t)0);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  return 0;
+}
+
+
+
+static void batch_report(FILE *fh)
+{
+  batch_job_t *job;
+  char *p;
+
+  fprintf(fh, "#line\thex\tresult\tcycles\tuart_bytes\tuart_hash\t"
+    "eeprom_hash\tmessage\n");
+  for (size_t i = 0; i < batch_job_count; i++) {
+    job = &batch_jobs[i];
+    p = strchr(job->panic_msg, '\n');
+    if (p != NULL) {
+      *p = '\0';
+    }
+    fprintf(fh, "%u\t%s\t%s\t%u\t%u\t%016llx\t%016llx\t%s\n",
+      job->line, job->image->filename,
+      ! job->done ? "error" : (job->panic ? "panic" : "budget"),
+      job->cycles, job->uart_bytes, (unsigned long long)job->uart_hash,
+      (unsigned long long)job->eeprom_hash, job->panic_msg);
+  }
+}
+
+
+
+static void display_help(const char *progname)
+{
+  fprintf(stdout, "Usage: %s <options> <manifest>\n", progname);
+  fprintf(stdout, "Options:\n"
+    "  -h                Display this help.\n"
+    "  -j N              Run N jobs in parallel, default is one per CPU.\n"
+    "  -l                Run jobs using the same HEX file in lockstep.\n"
+    "  -o FILE           Write the report to FILE instead of stdout.\n"
+    "\n");
+  fprintf(stdout,
+    "Manifest lines are \"<hex-file> <stimulus-file> <cycles>\", with \"-\"\n"
+    "for no stimulus.\n"
+    "\n");
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  char *report_filename = NULL;
+  FILE *fh;
+  int c;
+
+  batch_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while ((c = getopt(argc, argv, "hj:lo:")) != -1) {
+    switch (c) {
+    case 'h':
+      display_help(argv[0]);
+      return EXIT_SUCCESS;
+
+    case 'j':
+      batch_workers = strtol(optarg, NULL, 10);
+      break;
+
+    case 'l':
+      batch_lanes = LOCKSTEP_LANES;
+      break;
+
+    case 'o':
+      report_filename = optarg;
+      break;
+
+    case '?':
+    default:
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 1) {
+    display_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (batch_workers < 1) {
+    batch_workers = 1;
+  }
+
+  if (batch_manifest_load(argv[optind]) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  if (batch_run() != 0) {
+    fprintf(stderr, "Unable to start workers\n");
+    return EXIT_FAILURE;
+  }
+
+  if (report_filename != NULL) {
+    fh = fopen(report_filename, "w");
+    if (fh == NULL) {
+      fprintf(stderr, "Unable to write report: %s\n", report_filename);
+      return EXIT_FAILURE;
+    }
+    batch_report(fh);
+    fclose(fh);
+  } else {
+    batch_report(stdout);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+
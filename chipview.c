@@ -3,164 +3,518 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
 #include <curses.h>
 
 #include "pic.h"
 
+/* The emulator only publishes the pin levels and TRIS values through a
+ * seqlock when they change. A separate UI thread picks up a consistent
+ * copy at a fixed frame rate and redraws just the pins that changed, so
+ * port heavy firmware is not slowed down to the speed of the terminal.
+ *
+ * Every pin level change is also appended to a transition ring, which the
+ * UI thread copies into its own history and renders as a logic analyzer
+ * style waveform of one port next to the chip. The emulator never waits
+ * for the UI, so if the UI thread falls too far behind the oldest
+ * transitions are lost. Ring entries are single atomic words holding the
+ * level before and after the change, and the head is read again after
+ * copying to drop entries that were overwritten meanwhile. The level at
+ * the start of the history is then the one before the first transition
+ * kept, or the current level for ports without any.
+ *
+ * Keys toggling input pins are read by the UI thread as well, and handed
+ * to the emulator through a mailbox of per port XOR masks, which is picked
+ * up from the event scheduler without stopping the emulation.
+ *
+ * All curses calls are made with chipview_curses_mutex held, since the
+ * debugger pauses and resumes curses from the emulator thread.
+ */
+
+#define CHIPVIEW_PORTS 5
+#define CHIPVIEW_FRAME_NS (1000000000 / 30)
+
+#define CHIPVIEW_WAVE_RING 65536 /* Must be a power of two. */
+#define CHIPVIEW_WAVE_COLUMN 36
+#define CHIPVIEW_WAVE_LABEL 5
+#define CHIPVIEW_WAVE_MAX_WIDTH 256
+
+#define CHIPVIEW_STATUS_ROW 23
+#define CHIPVIEW_INPUT_CYCLES 1000 /* Mailbox poll interval. */
+
+typedef struct chipview_pin_s {
+  int row;
+  bool right;
+  int port;
+  int bit;
+} chipview_pin_t;
+
+typedef struct chipview_transition_s {
+  uint32_t cycle;
+  uint8_t port;
+  uint8_t prev; /* Level before the change. */
+  uint8_t pins;
+} chipview_transition_t;
+
+typedef struct chipview_snapshot_s {
+  uint8_t pins[CHIPVIEW_PORTS];
+  uint8_t tris[CHIPVIEW_PORTS];
+} chipview_snapshot_t;
+
+static const char *chipview_frame[] = {
+  "       +------|__|------+",
+  "       |             RB7|",
+  "       |RA0          RB6|",
+  "       |RA1          RB5|",
+  "       |RA2          RB4|",
+  "       |RA3          RB3|",
+  "       |RA4          RB2|",
+  "       |RA5          RB1|",
+  "       |RE0          RB0|",
+  "       |RE1             |",
+  "       |RE2             |",
+  "       |             RD7|",
+  "       |             RD6|",
+  "       |             RD5|",
+  "       |             RD4|",
+  "       |RC0       RX/RC7|",
+  "       |RC1       TX/RC6|",
+  "       |RC2          RC5|",
+  "       |RC3/SCL  SDA/RC4|",
+  "       |RD0          RD3|",
+  "       |RD1          RD2|",
+  "       +----------------+",
+};
+
+static const chipview_pin_t chipview_pins[] = {
+  { 1, true,  1, 7},
+  { 2, false, 0, 0}, { 2, true,  1, 6},
+  { 3, false, 0, 1}, { 3, true,  1, 5},
+  { 4, false, 0, 2}, { 4, true,  1, 4},
+  { 5, false, 0, 3}, { 5, true,  1, 3},
+  { 6, false, 0, 4}, { 6, true,  1, 2},
+  { 7, false, 0, 5}, { 7, true,  1, 1},
+  { 8, false, 4, 0}, { 8, true,  1, 0},
+  { 9, false, 4, 1},
+  {10, false, 4, 2},
+  {11, true,  3, 7},
+  {12, true,  3, 6},
+  {13, true,  3, 5},
+  {14, true,  3, 4},
+  {15, false, 2, 0}, {15, true,  2, 7},
+  {16, false, 2, 1}, {16, true,  2, 6},
+  {17, false, 2, 2}, {17, true,  2, 5},
+  {18, false, 2, 3}, {18, true,  2, 4},
+  {19, false, 3, 0}, {19, true,  3, 3},
+  {20, false, 3, 1}, {20, true,  3, 2},
+};
+
+#define CHIPVIEW_PIN_COUNT (sizeof(chipview_pins) / sizeof(chipview_pin_t))
+
+static const uint32_t chipview_zoom_levels[] = {
+  1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000,
+  100000, 200000, 500000, 1000000,
+};
+
+#define CHIPVIEW_ZOOM_COUNT \
+  (sizeof(chipview_zoom_levels) / sizeof(uint32_t))
+
+/* Seqlock protected state, written by the emulator thread only. */
+static atomic_uint chipview_seq = 0;
+static _Atomic uint8_t chipview_pub_pins[CHIPVIEW_PORTS];
+static _Atomic uint8_t chipview_pub_tris[CHIPVIEW_PORTS];
+static atomic_uint chipview_pub_cycle = 0;
+
+/* Emulator side copy, to only publish actual changes. */
+static chipview_snapshot_t chipview_last;
+
+/* Transition ring of packed entries, written by the emulator thread only. */
+static _Atomic uint64_t chipview_wave_ring[CHIPVIEW_WAVE_RING];
+static atomic_uint chipview_wave_head = 0;
+
+/* UI thread copy of the transition history, valid from first to pos. */
+static chipview_transition_t chipview_wave_history[CHIPVIEW_WAVE_RING];
+static unsigned int chipview_wave_first = 0;
+static unsigned int chipview_wave_pos = 0;
+static int chipview_wave_port = 2;
+static int chipview_wave_zoom = 6;
+
+/* Pending input pin toggles, set by the UI thread, taken by the emulator. */
+static atomic_uint chipview_mailbox[CHIPVIEW_PORTS];
+static int chipview_input_port = 0;
+
+static pthread_t chipview_thread;
+static pthread_mutex_t chipview_curses_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool chipview_paused = false;
+static bool chipview_redraw = true;
+static atomic_bool chipview_done = false;
+static bool chipview_thread_running = false;
+
+
+
+static void chipview_publish(const chipview_snapshot_t *s)
+{
+  unsigned int seq = atomic_load_explicit(&chipview_seq, memory_order_relaxed);
+
+  atomic_store_explicit(&chipview_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for (int i = 0; i < CHIPVIEW_PORTS; i++) {
+    atomic_store_explicit(&chipview_pub_pins[i], s->pins[i],
+      memory_order_relaxed);
+    atomic_store_explicit(&chipview_pub_tris[i], s->tris[i],
+      memory_order_relaxed);
+  }
+  atomic_store_explicit(&chipview_seq, seq + 2, memory_order_release);
+}
 
 
-static bool pic_port_direction(pic_t *pic, char port, int bit)
+
+static void chipview_snapshot(chipview_snapshot_t *s)
 {
-  switch (port) {
-  case 'A':
-    return (pic->r[PIC_REG_TRISA] >> bit) & 1;
-  case 'B':
-    return (pic->r[PIC_REG_TRISB] >> bit) & 1;
-  case 'C':
-    return (pic->r[PIC_REG_TRISC] >> bit) & 1;
-  case 'D':
-    return (pic->r[PIC_REG_TRISD] >> bit) & 1;
-  case 'E':
-    return (pic->r[PIC_REG_TRISE] >> bit) & 1;
-  default:
-    return false;
-  }
+  unsigned int seq;
+
+  do {
+    seq = atomic_load_explicit(&chipview_seq, memory_order_acquire);
+    for (int i = 0; i < CHIPVIEW_PORTS; i++) {
+      s->pins[i] = atomic_load_explicit(&chipview_pub_pins[i],
+        memory_order_relaxed);
+      s->tris[i] = atomic_load_explicit(&chipview_pub_tris[i],
+        memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) ||
+    seq != atomic_load_explicit(&chipview_seq, memory_order_relaxed));
 }
 
 
 
-static char *right_side_direction(pic_t *pic, char port, int bit)
+static void chipview_draw_pin(const chipview_pin_t *pin,
+  const chipview_snapshot_t *s)
 {
-  if (pic_port_direction(pic, port, bit)) {
-    return "<-- ";
+  bool input = (s->tris[pin->port] >> pin->bit) & 1;
+  int value = (s->pins[pin->port] >> pin->bit) & 1;
+
+  /* Arrows point into the chip for inputs and out of it for outputs. */
+  if (pin->right) {
+    mvprintw(pin->row, 26, " %s %d", input ? "<-- " : " -->", value);
   } else {
-    return " -->";
+    mvprintw(pin->row, 1, "%d %s ", value, input ? " -->" : "<-- ");
   }
 }
 
 
 
-static char *left_side_direction(pic_t *pic, char port, int bit)
+static void chipview_draw(const chipview_snapshot_t *s,
+  const chipview_snapshot_t *old, bool full)
 {
-  if (pic_port_direction(pic, port, bit)) {
-    return " -->";
-  } else {
-    return "<-- ";
+  const chipview_pin_t *pin;
+  uint8_t mask;
+
+  if (full) {
+    for (size_t i = 0; i < sizeof(chipview_frame) / sizeof(char *); i++) {
+      mvprintw(i, 1, "%s", chipview_frame[i]);
+    }
   }
+
+  for (size_t i = 0; i < CHIPVIEW_PIN_COUNT; i++) {
+    pin = &chipview_pins[i];
+    mask = 1 << pin->bit;
+    if (full || ((s->pins[pin->port] ^ old->pins[pin->port]) & mask) ||
+      ((s->tris[pin->port] ^ old->tris[pin->port]) & mask)) {
+      chipview_draw_pin(pin, s);
+    }
+  }
+
+  refresh();
 }
 
 
 
-static bool pic_port_value(pic_t *pic, char port, int bit)
+static void chipview_wave_append(uint32_t cycle, int port, uint8_t prev,
+  uint8_t pins)
 {
-  switch (port) {
-  case 'A':
-    return (((pic->r[PIC_REG_PORTA] & ~pic->r[PIC_REG_TRISA]) |
-             (pic->in_porta         &  pic->r[PIC_REG_TRISA])) >> bit) & 1;
-  case 'B':
-    return (((pic->r[PIC_REG_PORTB] & ~pic->r[PIC_REG_TRISB]) |
-             (pic->in_portb         &  pic->r[PIC_REG_TRISB])) >> bit) & 1;
-  case 'C':
-    return (((pic->r[PIC_REG_PORTC] & ~pic->r[PIC_REG_TRISC]) |
-             (pic->in_portc         &  pic->r[PIC_REG_TRISC])) >> bit) & 1;
-  case 'D':
-    return (((pic->r[PIC_REG_PORTD] & ~pic->r[PIC_REG_TRISD]) |
-             (pic->in_portd         &  pic->r[PIC_REG_TRISD])) >> bit) & 1;
-  case 'E':
-    return (((pic->r[PIC_REG_PORTE] & ~pic->r[PIC_REG_TRISE]) |
-             (pic->in_porte         &  pic->r[PIC_REG_TRISE])) >> bit) & 1;
-  default:
-    return false;
-  }
+  unsigned int head = atomic_load_explicit(&chipview_wave_head,
+    memory_order_relaxed);
+
+  atomic_store_explicit(&chipview_wave_ring[head & (CHIPVIEW_WAVE_RING - 1)],
+    cycle | ((uint64_t)port << 32) | ((uint64_t)prev << 40) |
+    ((uint64_t)pins << 48), memory_order_relaxed);
+  atomic_store_explicit(&chipview_wave_head, head + 1, memory_order_release);
 }
 
 
 
-void chipview_update(pic_t *pic)
+/* Entries older than this may have been overwritten since head was read. */
+static unsigned int chipview_wave_oldest(unsigned int head)
 {
-  mvprintw( 0, 1, "       +------|__|------+");
-  mvprintw( 1, 1, "       |             RB7| %s %d",
-    right_side_direction(pic, 'B', 7), pic_port_value(pic, 'B', 7));
+  return (head > CHIPVIEW_WAVE_RING) ? head - CHIPVIEW_WAVE_RING + 1 : 0;
+}
+
 
-  mvprintw( 2, 1, "%d %s |RA0          RB6| %s %d",
-    pic_port_value(pic, 'A', 0), left_side_direction(pic, 'A', 0),
-    right_side_direction(pic, 'B', 6), pic_port_value(pic, 'B', 6));
 
-  mvprintw( 3, 1, "%d %s |RA1          RB5| %s %d",
-    pic_port_value(pic, 'A', 1), left_side_direction(pic, 'A', 1),
-    right_side_direction(pic, 'B', 5), pic_port_value(pic, 'B', 5));
+static bool chipview_wave_before(unsigned int a, unsigned int b)
+{
+  return (int)(a - b) < 0;
+}
+
+
+
+static void chipview_wave_collect(void)
+{
+  unsigned int head = atomic_load_explicit(&chipview_wave_head,
+    memory_order_acquire);
+  chipview_transition_t *t;
+  unsigned int oldest;
+  uint64_t entry;
+  unsigned int i;
+
+  if (head - chipview_wave_pos > CHIPVIEW_WAVE_RING) {
+    chipview_wave_pos = head - CHIPVIEW_WAVE_RING; /* Fell behind. */
+  }
+
+  for (i = chipview_wave_pos; i != head; i++) {
+    entry = atomic_load_explicit(
+      &chipview_wave_ring[i & (CHIPVIEW_WAVE_RING - 1)],
+      memory_order_relaxed);
+    t = &chipview_wave_history[i & (CHIPVIEW_WAVE_RING - 1)];
+    t->cycle = entry;
+    t->port = entry >> 32;
+    t->prev = entry >> 40;
+    t->pins = entry >> 48;
+  }
+  chipview_wave_pos = head;
+
+  /* Anything the emulator got to while copying is not trusted. */
+  atomic_thread_fence(memory_order_acquire);
+  oldest = chipview_wave_oldest(atomic_load_explicit(&chipview_wave_head,
+    memory_order_relaxed));
+  if (chipview_wave_before(chipview_wave_first, oldest)) {
+    chipview_wave_first = oldest;
+  }
+  if (chipview_wave_before(chipview_wave_pos, chipview_wave_first)) {
+    chipview_wave_first = chipview_wave_pos;
+  }
+}
+
+
+
+static void chipview_wave_draw(uint32_t now, const chipview_snapshot_t *s)
+{
+  static uint8_t end[CHIPVIEW_WAVE_MAX_WIDTH];
+  static uint8_t toggle[CHIPVIEW_WAVE_MAX_WIDTH];
+  static bool has[CHIPVIEW_WAVE_MAX_WIDTH];
+  static char line[CHIPVIEW_WAVE_MAX_WIDTH + 1];
+  uint32_t zoom = chipview_zoom_levels[chipview_wave_zoom];
+  int port = chipview_wave_port;
+  chipview_transition_t *t;
+  bool seen = false;
+  uint32_t age;
+  uint8_t level;
+  uint8_t prev;
+  int width;
+  int c;
+
+  width = COLS - CHIPVIEW_WAVE_COLUMN - CHIPVIEW_WAVE_LABEL;
+  if (width <= 0) {
+    return;
+  }
+  if (width > CHIPVIEW_WAVE_MAX_WIDTH) {
+    width = CHIPVIEW_WAVE_MAX_WIDTH;
+  }
+
+  memset(toggle, 0, width);
+  memset(has, 0, width);
+
+  level = prev = s->pins[port];
+  for (unsigned int i = chipview_wave_first; i != chipview_wave_pos; i++) {
+    t = &chipview_wave_history[i & (CHIPVIEW_WAVE_RING - 1)];
+    if (t->port != port) {
+      continue;
+    }
+    if (! seen) {
+      level = prev = t->prev;
+      seen = true;
+    }
+    age = now - t->cycle;
+    if (age / zoom >= (uint32_t)width) {
+      level = t->pins; /* Level at the left edge of the pane. */
+    } else {
+      c = width - 1 - (age / zoom);
+      toggle[c] |= t->pins ^ prev;
+      end[c] = t->pins;
+      has[c] = true;
+    }
+    prev = t->pins;
+  }
 
-  mvprintw( 4, 1, "%d %s |RA2          RB4| %s %d",
-    pic_port_value(pic, 'A', 2), left_side_direction(pic, 'A', 2),
-    right_side_direction(pic, 'B', 4), pic_port_value(pic, 'B', 4));
+  /* Header is cut at the screen edge instead of wrapping onto the chip. */
+  snprintf(line, sizeof(line), "Port %c  %u cycles/column  "
+    "[Tab] port  [+/-] zoom", 'A' + port, zoom);
+  mvaddnstr(0, CHIPVIEW_WAVE_COLUMN, line, COLS - CHIPVIEW_WAVE_COLUMN);
+  clrtoeol();
+
+  for (int bit = 0; bit < 8; bit++) {
+    prev = level;
+    for (c = 0; c < width; c++) {
+      if (has[c]) {
+        prev = end[c];
+      }
+      if ((toggle[c] >> bit) & 1) {
+        line[c] = '|';
+      } else {
+        line[c] = ((prev >> bit) & 1) ? '-' : '_';
+      }
+    }
+    line[width] = '\0';
+    mvprintw(1 + bit, CHIPVIEW_WAVE_COLUMN, "R%c%d  %s", 'A' + port, bit,
+      line);
+  }
+}
 
-  mvprintw( 5, 1, "%d %s |RA3          RB3| %s %d",
-    pic_port_value(pic, 'A', 3), left_side_direction(pic, 'A', 3),
-    right_side_direction(pic, 'B', 3), pic_port_value(pic, 'B', 3));
 
-  mvprintw( 6, 1, "%d %s |RA4          RB2| %s %d",
-    pic_port_value(pic, 'A', 4), left_side_direction(pic, 'A', 4),
-    right_side_direction(pic, 'B', 2), pic_port_value(pic, 'B', 2));
 
-  mvprintw( 7, 1, "%d %s |RA5          RB1| %s %d",
-    pic_port_value(pic, 'A', 5), left_side_direction(pic, 'A', 5),
-    right_side_direction(pic, 'B', 1), pic_port_value(pic, 'B', 1));
+static void chipview_status(void)
+{
+  mvprintw(CHIPVIEW_STATUS_ROW, 1, "Input port %c  [a-e] port  "
+    "[0-7] toggle input pin", 'A' + chipview_input_port);
+  clrtoeol();
+}
 
-  mvprintw( 8, 1, "%d %s |RE0          RB0| %s %d",
-    pic_port_value(pic, 'E', 0), left_side_direction(pic, 'E', 0),
-    right_side_direction(pic, 'B', 0), pic_port_value(pic, 'B', 0));
 
-  mvprintw( 9, 1, "%d %s |RE1             |",
-    pic_port_value(pic, 'E', 1), left_side_direction(pic, 'E', 1));
 
-  mvprintw(10, 1, "%d %s |RE2             |",
-    pic_port_value(pic, 'E', 2), left_side_direction(pic, 'E', 2));
+static void chipview_key(int key)
+{
+  switch (key) {
+  case 'a':
+  case 'b':
+  case 'c':
+  case 'd':
+  case 'e':
+    chipview_input_port = key - 'a';
+    break;
+  case '0':
+  case '1':
+  case '2':
+  case '3':
+  case '4':
+  case '5':
+  case '6':
+  case '7':
+    atomic_fetch_xor(&chipview_mailbox[chipview_input_port],
+      1 << (key - '0'));
+    break;
+  case '\t':
+    chipview_wave_port = (chipview_wave_port + 1) % CHIPVIEW_PORTS;
+    break;
+  case '+':
+    if (chipview_wave_zoom > 0) {
+      chipview_wave_zoom--;
+    }
+    break;
+  case '-':
+    if (chipview_wave_zoom < (int)CHIPVIEW_ZOOM_COUNT - 1) {
+      chipview_wave_zoom++;
+    }
+    break;
+  default:
+    break;
+  }
+}
 
-  mvprintw(11, 1, "       |             RD7| %s %d",
-    right_side_direction(pic, 'D', 7), pic_port_value(pic, 'D', 7));
 
-  mvprintw(12, 1, "       |             RD6| %s %d",
-    right_side_direction(pic, 'D', 6), pic_port_value(pic, 'D', 6));
 
-  mvprintw(13, 1, "       |             RD5| %s %d",
-    right_side_direction(pic, 'D', 5), pic_port_value(pic, 'D', 5));
+static void *chipview_ui(void *arg)
+{
+  struct timespec frame = {0, CHIPVIEW_FRAME_NS};
+  chipview_snapshot_t drawn;
+  chipview_snapshot_t s;
+  int key;
+
+  (void)arg;
+
+  while (! atomic_load(&chipview_done)) {
+    pthread_mutex_lock(&chipview_curses_mutex);
+    if (! chipview_paused) {
+      while ((key = getch()) != ERR) {
+        chipview_key(key);
+      }
+      chipview_wave_collect();
+      chipview_snapshot(&s);
+      chipview_wave_draw(atomic_load_explicit(&chipview_pub_cycle,
+        memory_order_relaxed), &s);
+      chipview_status();
+      chipview_draw(&s, &drawn, chipview_redraw);
+      chipview_redraw = false;
+      drawn = s;
+    }
+    pthread_mutex_unlock(&chipview_curses_mutex);
+
+    nanosleep(&frame, NULL);
+  }
 
-  mvprintw(14, 1, "       |             RD4| %s %d",
-    right_side_direction(pic, 'D', 4), pic_port_value(pic, 'D', 4));
+  return NULL;
+}
 
-  mvprintw(15, 1, "%d %s |RC0       RX/RC7| %s %d",
-    pic_port_value(pic, 'C', 0), left_side_direction(pic, 'C', 0),
-    right_side_direction(pic, 'C', 7), pic_port_value(pic, 'C', 7));
 
-  mvprintw(16, 1, "%d %s |RC1       TX/RC6| %s %d",
-    pic_port_value(pic, 'C', 1), left_side_direction(pic, 'C', 1),
-    right_side_direction(pic, 'C', 6), pic_port_value(pic, 'C', 6));
 
-  mvprintw(17, 1, "%d %s |RC2          RC5| %s %d",
-    pic_port_value(pic, 'C', 2), left_side_direction(pic, 'C', 2),
-    right_side_direction(pic, 'C', 5), pic_port_value(pic, 'C', 5));
+void chipview_update(pic_t *pic)
+{
+  chipview_snapshot_t s;
+  bool changed = false;
+
+  atomic_store_explicit(&chipview_pub_cycle, pic->cycle,
+    memory_order_relaxed);
+  for (int i = 0; i < CHIPVIEW_PORTS; i++) {
+    s.pins[i] = pic_port_pins(pic, i);
+    s.tris[i] = pic->r[PIC_REG_TRISA + i];
+    if (s.pins[i] != chipview_last.pins[i]) {
+      chipview_wave_append(pic->cycle, i, chipview_last.pins[i], s.pins[i]);
+      changed = true;
+    } else if (s.tris[i] != chipview_last.tris[i]) {
+      changed = true;
+    }
+  }
 
-  mvprintw(18, 1, "%d %s |RC3/SCL  SDA/RC4| %s %d",
-    pic_port_value(pic, 'C', 3), left_side_direction(pic, 'C', 3),
-    right_side_direction(pic, 'C', 4), pic_port_value(pic, 'C', 4));
+  if (changed) {
+    chipview_last = s;
+    chipview_publish(&s);
+  }
+}
 
-  mvprintw(19, 1, "%d %s |RD0          RD3| %s %d",
-    pic_port_value(pic, 'D', 0), left_side_direction(pic, 'D', 0),
-    right_side_direction(pic, 'D', 3), pic_port_value(pic, 'D', 3));
 
-  mvprintw(20, 1, "%d %s |RD1          RD2| %s %d",
-    pic_port_value(pic, 'D', 1), left_side_direction(pic, 'D', 1),
-    right_side_direction(pic, 'D', 2), pic_port_value(pic, 'D', 2));
 
-  mvprintw(21, 1, "       +----------------+");
+uint32_t chipview_input_apply(pic_t *pic)
+{
+  uint8_t in[CHIPVIEW_PORTS];
+  unsigned int mask;
+
+  in[0] = pic->in_porta;
+  in[1] = pic->in_portb;
+  in[2] = pic->in_portc;
+  in[3] = pic->in_portd;
+  in[4] = pic->in_porte;
+
+  atomic_store_explicit(&chipview_pub_cycle, pic->cycle,
+    memory_order_relaxed);
+  for (int i = 0; i < CHIPVIEW_PORTS; i++) {
+    if (atomic_load_explicit(&chipview_mailbox[i], memory_order_relaxed)) {
+      mask = atomic_exchange(&chipview_mailbox[i], 0);
+      pic_port_input_set(pic, i, in[i] ^ mask);
+    }
+  }
 
-  refresh();
+  return pic->cycle + CHIPVIEW_INPUT_CYCLES;
 }
 
 
 
-static void chipview_reg_write(pic_t *pic, uint16_t f)
+static void chipview_reg_write(pic_t *pic, void *user, uint16_t f)
 {
+  (void)user;
+
   switch (f) {
   case PIC_REG_PORTA:
   case PIC_REG_PORTB:
@@ -183,22 +537,34 @@ static void chipview_reg_write(pic_t *pic, uint16_t f)
 
 void chipview_pause(void)
 {
+  pthread_mutex_lock(&chipview_curses_mutex);
+  chipview_paused = true;
   endwin();
   timeout(-1);
+  pthread_mutex_unlock(&chipview_curses_mutex);
 }
 
 
 
 void chipview_resume(void)
 {
+  pthread_mutex_lock(&chipview_curses_mutex);
   timeout(0);
+  chipview_paused = false;
+  chipview_redraw = true;
   refresh();
+  pthread_mutex_unlock(&chipview_curses_mutex);
 }
 
 
 
 void chipview_exit(void)
 {
+  if (chipview_thread_running) {
+    atomic_store(&chipview_done, true);
+    pthread_join(chipview_thread, NULL);
+    chipview_thread_running = false;
+  }
   endwin();
 }
 
@@ -207,13 +573,20 @@ void chipview_exit(void)
 void chipview_init(pic_t *pic)
 {
   initscr();
-  atexit(chipview_exit);
   noecho();
   keypad(stdscr, TRUE);
   timeout(0);
 
-  pic->reg_write_hook = chipview_reg_write;
-}
-
+  for (int i = 0; i < CHIPVIEW_PORTS; i++) {
+    chipview_last.pins[i] = pic_port_pins(pic, i);
+    chipview_last.tris[i] = pic->r[PIC_REG_TRISA + i];
+  }
+  chipview_publish(&chipview_last);
+  atomic_store(&chipview_pub_cycle, pic->cycle);
 
+  chipview_thread_running =
+    pthread_create(&chipview_thread, NULL, chipview_ui, NULL) == 0;
+  atexit(chipview_exit);
 
+  pic->reg_write_hook = chipview_reg_write;
+}
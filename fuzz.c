@@ -0,0 +1,575 @@
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "aegl.h"
+#include "i2c.h"
+#include "mem.h"
+#include "pic.h"
+
+/* Coverage guided fuzzer for the UART command parser of aegl.hex. The
+ * firmware is booted once, until it polls for UART input, and that state
+ * is kept as a snapshot. Every input restores the snapshot and is fed
+ * byte by byte whenever the firmware polls PIR1 with RCIF clear, until it
+ * has taken all bytes and polled FUZZ_IDLE_POLLS more times, panics, or
+ * uses up its cycle budget.
+ *
+ * Coverage is the set of PC edges where execution did not simply continue
+ * with the next word, hashed into a bitmap. Inputs reaching a new edge
+ * are added to the corpus. New inputs are made by a random number of
+ * mutations of a corpus entry. Any panic, which includes stack overflow
+ * and returning with an empty stack, is a crash. Crash inputs are saved
+ * once per PC and message.
+ */
+
+#define FUZZ_MAP_BITS 16
+#define FUZZ_MAP_WORDS ((1 << FUZZ_MAP_BITS) / 64)
+#define FUZZ_INPUT_MAX 256
+#define FUZZ_IDLE_POLLS 100
+#define FUZZ_CRASH_MAX 1024
+#define FUZZ_BOOT_CYCLES 50000000
+#define FUZZ_DEFAULT_CYCLES 200000
+#define FUZZ_STATUS_INTERVAL 5 /* Seconds. */
+
+typedef struct fuzz_input_s {
+  uint8_t *data;
+  size_t size;
+} fuzz_input_t;
+
+typedef struct fuzz_exec_s {
+  const uint8_t *data;
+  size_t size;
+  size_t pos;
+  uint32_t idle;
+  bool panic;
+} fuzz_exec_t;
+
+static const uint8_t fuzz_interesting[] = {
+  0x1B, '\r', '\n', 0x00, 0xFF, 0x7F, 0x80, ' ', ',', '0', '9', 'A', 'Z',
+  'a', 'z',
+};
+
+static aegl_t fuzz_aegl;
+static mem_t fuzz_mem;
+static pic_t fuzz_pic;
+static fuzz_exec_t fuzz_exec;
+
+static pic_t fuzz_snap_pic;
+static mem_t fuzz_snap_mem;
+static aegl_state_t fuzz_snap_aegl;
+static uint8_t *fuzz_snap_i2c;
+
+static uint64_t fuzz_bits[FUZZ_MAP_WORDS];
+static uint64_t fuzz_seen[FUZZ_MAP_WORDS];
+static uint32_t fuzz_edges = 0;
+
+static fuzz_input_t *fuzz_corpus = NULL;
+static size_t fuzz_corpus_count = 0;
+static uint64_t fuzz_crash[FUZZ_CRASH_MAX];
+static uint32_t fuzz_crash_count = 0;
+static uint32_t fuzz_timeouts = 0;
+
+static uint64_t fuzz_rng = 0x9E3779B97F4A7C15ULL;
+static const char *fuzz_dir = NULL;
+static volatile sig_atomic_t fuzz_stop = 0;
+
+
+
+static void sig_handler(int signo)
+{
+  (void)signo;
+  fuzz_stop = 1;
+}
+
+
+
+static uint32_t fuzz_random(uint32_t range)
+{
+  fuzz_rng ^= fuzz_rng << 13;
+  fuzz_rng ^= fuzz_rng >> 7;
+  fuzz_rng ^= fuzz_rng << 17;
+  return (uint32_t)(fuzz_rng >> 32) % range;
+}
+
+
+
+static void fuzz_reg_read(pic_t *pic, void *user, uint16_t f)
+{
+  fuzz_exec_t *exec = user;
+
+  if (f != PIC_REG_PIR1 || (pic->r[PIC_REG_PIR1] & 0x20)) {
+    return; /* Previous byte not taken yet. */
+  }
+
+  if (exec->pos < exec->size) {
+    pic_uart_rx_write(pic, exec->data[exec->pos++]);
+    exec->idle = 0;
+  } else {
+    exec->idle++;
+  }
+}
+
+
+
+static void fuzz_panic_hook(pic_t *pic, void *user)
+{
+  fuzz_exec_t *exec = user;
+
+  (void)pic;
+  exec->panic = true;
+}
+
+
+
+static int fuzz_boot(const char *filename)
+{
+  if (mem_init(&fuzz_mem) != 0 || mem_load(&fuzz_mem, filename) != 0) {
+    fprintf(stderr, "Unable to load HEX file: %s\n", filename);
+    return -1;
+  }
+  pic_predecode(&fuzz_mem);
+
+  pic_init(&fuzz_pic, &fuzz_mem);
+  aegl_init(&fuzz_aegl, &fuzz_pic);
+  aegl_uart_input(&fuzz_aegl, NULL);
+  fuzz_pic.reg_read_hook = fuzz_reg_read;
+  fuzz_pic.reg_read_user = &fuzz_exec;
+  fuzz_pic.panic_hook = fuzz_panic_hook;
+  fuzz_pic.panic_user = &fuzz_exec;
+
+  while (fuzz_exec.idle <= FUZZ_IDLE_POLLS) {
+    pic_execute(&fuzz_pic, &fuzz_mem);
+    if (fuzz_exec.panic || fuzz_pic.cycle >= FUZZ_BOOT_CYCLES) {
+      fprintf(stderr, "Firmware did not start polling the UART\n");
+      return -1;
+    }
+  }
+
+  fuzz_snap_pic = fuzz_pic;
+  mem_share(&fuzz_snap_mem, &fuzz_mem);
+  aegl_state_get(&fuzz_aegl, &fuzz_snap_aegl);
+  fuzz_snap_i2c = malloc(fuzz_aegl.i2c_eeprom.size);
+  if (fuzz_snap_i2c == NULL) {
+    return -1;
+  }
+  memcpy(fuzz_snap_i2c, fuzz_aegl.i2c_eeprom.data, fuzz_aegl.i2c_eeprom.size);
+  fuzz_aegl.i2c_eeprom.written = false;
+  return 0;
+}
+
+
+
+static void fuzz_restore(void)
+{
+  fuzz_pic = fuzz_snap_pic;
+  if (fuzz_mem.program != fuzz_snap_mem.program) {
+    mem_free(&fuzz_mem); /* Program memory was written. */
+    mem_share(&fuzz_mem, &fuzz_snap_mem);
+  } else {
+    memcpy(fuzz_mem.eeprom, fuzz_snap_mem.eeprom, MEM_EEPROM_MAX);
+  }
+  aegl_state_set(&fuzz_aegl, &fuzz_snap_aegl);
+  if (fuzz_aegl.i2c_eeprom.written) {
+    memcpy(fuzz_aegl.i2c_eeprom.data, fuzz_snap_i2c,
+      fuzz_aegl.i2c_eeprom.size);
+    fuzz_aegl.i2c_eeprom.written = false;
+  }
+}
+
+
+
+/* Returns true if the input finished without panic or timeout. */
+static bool fuzz_run(const uint8_t *data, size_t size, uint32_t budget)
+{
+  uint32_t end;
+  uint16_t pc;
+  uint32_t i;
+
+  fuzz_restore();
+  fuzz_exec.data = data;
+  fuzz_exec.size = size;
+  fuzz_exec.pos = 0;
+  fuzz_exec.idle = 0;
+  fuzz_exec.panic = false;
+  memset(fuzz_bits, 0, sizeof(fuzz_bits));
+
+  end = fuzz_pic.cycle + budget;
+  while (fuzz_exec.pos < size || fuzz_exec.idle <= FUZZ_IDLE_POLLS) {
+    pc = fuzz_pic.pc;
+    pic_execute(&fuzz_pic, &fuzz_mem);
+    if (fuzz_pic.pc != (uint16_t)(pc + 1)) {
+      i = ((pc << 3) ^ fuzz_pic.pc) & ((1 << FUZZ_MAP_BITS) - 1);
+      fuzz_bits[i / 64] |= 1ULL << (i % 64);
+    }
+    if (fuzz_exec.panic || fuzz_pic.cycle >= end) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+
+static bool fuzz_coverage_new(void)
+{
+  bool found = false;
+  uint64_t bits;
+
+  for (int i = 0; i < FUZZ_MAP_WORDS; i++) {
+    bits = fuzz_bits[i] & ~fuzz_seen[i];
+    if (bits != 0) {
+      fuzz_seen[i] |= bits;
+      fuzz_edges += __builtin_popcountll(bits);
+      found = true;
+    }
+  }
+  return found;
+}
+
+
+
+static void fuzz_save(const char *subdir, uint32_t id, const uint8_t *data,
+  size_t size)
+{
+  char filename[1024];
+  FILE *fh;
+
+  snprintf(filename, sizeof(filename), "%s/%s/id-%06u", fuzz_dir, subdir,
+    id);
+  fh = fopen(filename, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Unable to write %s\n", filename);
+    return;
+  }
+  fwrite(data, 1, size, fh);
+  fclose(fh);
+}
+
+
+
+static int fuzz_corpus_add(const uint8_t *data, size_t size)
+{
+  fuzz_input_t *p;
+  uint8_t *copy;
+
+  p = realloc(fuzz_corpus, (fuzz_corpus_count + 1) * sizeof(fuzz_input_t));
+  copy = malloc(size > 0 ? size : 1);
+  if (p == NULL || copy == NULL) {
+    free(copy);
+    return -1;
+  }
+  fuzz_corpus = p;
+  memcpy(copy, data, size);
+  fuzz_corpus[fuzz_corpus_count].data = copy;
+  fuzz_corpus[fuzz_corpus_count].size = size;
+  fuzz_corpus_count++;
+  return 0;
+}
+
+
+
+static void fuzz_crash_check(const uint8_t *data, size_t size)
+{
+  uint64_t key;
+  char *p;
+
+  key = mem_hash(MEM_HASH_INIT ^ fuzz_pic.pc, fuzz_pic.panic_msg,
+    strlen(fuzz_pic.panic_msg));
+  for (uint32_t i = 0; i < fuzz_crash_count; i++) {
+    if (fuzz_crash[i] == key) {
+      return;
+    }
+  }
+  if (fuzz_crash_count == FUZZ_CRASH_MAX) {
+    return;
+  }
+
+  p = strchr(fuzz_pic.panic_msg, '\n');
+  if (p != NULL) {
+    *p = '\0';
+  }
+  fprintf(stderr, "Crash | crashes/id-%06u: %s at 0x%04x\n",
+    fuzz_crash_count, fuzz_pic.panic_msg, fuzz_pic.pc);
+  fuzz_save("crashes", fuzz_crash_count, data, size);
+  fuzz_crash[fuzz_crash_count++] = key;
+}
+
+
+
+static size_t fuzz_mutate(uint8_t *data, size_t size)
+{
+  const fuzz_input_t *other;
+  uint32_t count;
+  uint32_t pos;
+  uint32_t len;
+  uint32_t op;
+
+  count = 1 << fuzz_random(4);
+  for (uint32_t n = 0; n < count; n++) {
+    op = fuzz_random(size > 0 ? 7 : 2);
+    switch (op) {
+    case 0: /* Insert a random byte. */
+    case 1: /* Insert an interesting byte. */
+      if (size == FUZZ_INPUT_MAX) {
+        break;
+      }
+      pos = fuzz_random(size + 1);
+      memmove(data + pos + 1, data + pos, size - pos);
+      data[pos] = (op == 0) ? fuzz_random(256) :
+        fuzz_interesting[fuzz_random(sizeof(fuzz_interesting))];
+      size++;
+      break;
+    case 2: /* Flip a bit. */
+      data[fuzz_random(size)] ^= 1 << fuzz_random(8);
+      break;
+    case 3: /* Replace with an interesting byte. */
+      data[fuzz_random(size)] =
+        fuzz_interesting[fuzz_random(sizeof(fuzz_interesting))];
+      break;
+    case 4: /* Delete a block. */
+      pos = fuzz_random(size);
+      len = 1 + fuzz_random(size - pos);
+      memmove(data + pos, data + pos + len, size - pos - len);
+      size -= len;
+      break;
+    case 5: /* Duplicate a block. */
+      pos = fuzz_random(size);
+      len = 1 + fuzz_random(size - pos);
+      if (size + len > FUZZ_INPUT_MAX) {
+        break;
+      }
+      memmove(data + pos + len, data + pos, size - pos);
+      size += len;
+      break;
+    default: /* Splice in the tail of another input. */
+      other = &fuzz_corpus[fuzz_random(fuzz_corpus_count)];
+      if (other->size == 0) {
+        break;
+      }
+      pos = fuzz_random(size);
+      len = other->size - fuzz_random(other->size);
+      if (pos + len > FUZZ_INPUT_MAX) {
+        len = FUZZ_INPUT_MAX - pos;
+      }
+      memcpy(data + pos, other->data + other->size - len, len);
+      if (pos + len > size) {
+        size = pos + len;
+      }
+      break;
+    }
+  }
+  return size;
+}
+
+
+
+static int fuzz_seeds_load(const char *dirname)
+{
+  uint8_t data[FUZZ_INPUT_MAX];
+  char filename[1024];
+  struct dirent *entry;
+  size_t size;
+  FILE *fh;
+  DIR *dir;
+
+  dir = opendir(dirname);
+  if (dir == NULL) {
+    fprintf(stderr, "Unable to open seed directory: %s\n", dirname);
+    return -1;
+  }
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(filename, sizeof(filename), "%s/%s", dirname, entry->d_name);
+    fh = fopen(filename, "rb");
+    if (fh == NULL) {
+      continue;
+    }
+    size = fread(data, 1, sizeof(data), fh);
+    fclose(fh);
+    if (fuzz_corpus_add(data, size) != 0) {
+      closedir(dir);
+      return -1;
+    }
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+
+
+static int fuzz_dir_create(const char *subdir)
+{
+  char dirname[1024];
+
+  snprintf(dirname, sizeof(dirname), "%s%s%s", fuzz_dir,
+    subdir != NULL ? "/" : "", subdir != NULL ? subdir : "");
+  if (mkdir(dirname, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Unable to create directory: %s\n", dirname);
+    return -1;
+  }
+  return 0;
+}
+
+
+
+static void fuzz_status(uint64_t execs, const struct timespec *start,
+  bool force)
+{
+  static time_t last = 0;
+  struct timespec now;
+  double host;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (! force && now.tv_sec < last + FUZZ_STATUS_INTERVAL) {
+    return;
+  }
+  last = now.tv_sec;
+  host = (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1e9);
+  fprintf(stderr, "Fuzz | %llu execs, %.0f execs/s, %zu inputs, %u edges, "
+    "%u crashes, %u timeouts\n", (unsigned long long)execs,
+    host > 0 ? execs / host : 0.0, fuzz_corpus_count, fuzz_edges,
+    fuzz_crash_count, fuzz_timeouts);
+}
+
+
+
+static void display_help(const char *progname)
+{
+  fprintf(stdout, "Usage: %s <options> <hex-file>\n", progname);
+  fprintf(stdout, "Options:\n"
+    "  -h                Display this help.\n"
+    "  -o DIR            Write new inputs and crashes to DIR, required.\n"
+    "  -i DIR            Start from the inputs in DIR.\n"
+    "  -c CYCLES         Cycle budget per input, default %u.\n"
+    "  -n N              Stop after N inputs, default is until interrupted.\n"
+    "  -s SEED           Seed for the random number generator.\n"
+    "\n", FUZZ_DEFAULT_CYCLES);
+  fprintf(stdout,
+    "Inputs are raw bytes fed to the UART. New inputs are written to\n"
+    "DIR/queue and crashing inputs to DIR/crashes.\n"
+    "\n");
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  uint8_t data[FUZZ_INPUT_MAX];
+  uint32_t budget = FUZZ_DEFAULT_CYCLES;
+  char *seed_dirname = NULL;
+  struct timespec start;
+  uint64_t limit = 0;
+  uint64_t execs = 0;
+  const fuzz_input_t *input;
+  uint32_t queued = 0;
+  size_t size;
+  int c;
+
+  while ((c = getopt(argc, argv, "ho:i:c:n:s:")) != -1) {
+    switch (c) {
+    case 'h':
+      display_help(argv[0]);
+      return EXIT_SUCCESS;
+
+    case 'o':
+      fuzz_dir = optarg;
+      break;
+
+    case 'i':
+      seed_dirname = optarg;
+      break;
+
+    case 'c':
+      budget = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'n':
+      limit = strtoull(optarg, NULL, 0);
+      break;
+
+    case 's':
+      fuzz_rng ^= strtoull(optarg, NULL, 0) * MEM_HASH_PRIME;
+      break;
+
+    case '?':
+    default:
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 1 || fuzz_dir == NULL) {
+    display_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (fuzz_dir_create(NULL) != 0 || fuzz_dir_create("queue") != 0 ||
+    fuzz_dir_create("crashes") != 0) {
+    return EXIT_FAILURE;
+  }
+  if (seed_dirname != NULL && fuzz_seeds_load(seed_dirname) != 0) {
+    return EXIT_FAILURE;
+  }
+  if (fuzz_corpus_count == 0 && fuzz_corpus_add(data, 0) != 0) {
+    return EXIT_FAILURE;
+  }
+  if (fuzz_boot(argv[optind]) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGINT, sig_handler);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /* Seeds first, so their coverage counts as known. */
+  for (size_t i = 0; i < fuzz_corpus_count; i++) {
+    if (! fuzz_run(fuzz_corpus[i].data, fuzz_corpus[i].size, budget) &&
+      fuzz_exec.panic) {
+      fuzz_crash_check(fuzz_corpus[i].data, fuzz_corpus[i].size);
+    }
+    fuzz_coverage_new();
+    execs++;
+  }
+
+  while (! fuzz_stop && (limit == 0 || execs < limit)) {
+    input = &fuzz_corpus[fuzz_random(fuzz_corpus_count)];
+    memcpy(data, input->data, input->size);
+    size = fuzz_mutate(data, input->size);
+
+    if (! fuzz_run(data, size, budget)) {
+      if (fuzz_exec.panic) {
+        fuzz_crash_check(data, size);
+      } else {
+        fuzz_timeouts++;
+      }
+    } else if (fuzz_coverage_new()) {
+      if (fuzz_corpus_add(data, size) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+      }
+      fuzz_save("queue", queued++, data, size);
+    }
+
+    execs++;
+    if ((execs & 0xFF) == 0) {
+      fuzz_status(execs, &start, false);
+    }
+  }
+
+  fuzz_status(execs, &start, true);
+  return EXIT_SUCCESS;
+}
+
+
+
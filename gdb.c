@@ -0,0 +1,760 @@
+#include "gdb.h"
+#include <ctype.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mem.h"
+#include "pic.h"
+
+/* GDB remote serial protocol stub, listening on a local TCP port or Unix
+ * socket. Breakpoints and watchpoints are kept in lookup tables that are
+ * checked by the emulator loop after every instruction, so a continue runs
+ * at full speed and the socket is only polled for a break request every
+ * GDB_POLL_CYCLES cycles.
+ *
+ * The PIC memories are mapped into a single address space:
+ *
+ *   0x000000 Program memory, two bytes per word, little endian.
+ *   0x800000 Register file, at the unbanked addresses.
+ *   0x810000 EEPROM data.
+ *   0x820000 Hardware stack, two bytes per entry, little endian.
+ *
+ * The "g" packet holds W, STATUS and SP as one byte each, followed by the
+ * PC as two bytes little endian, which are also registers 0 to 3 for the
+ * "p" and "P" packets. Like every other address the stub deals in, the PC
+ * is a byte address in program memory, twice the word address. SP counts
+ * the used stack entries, from 0 to PIC_STACK_SIZE. Watchpoints can only be set on the register file.
+ * Registers with mirrors in several banks are watched at the address the
+ * emulator stores them at, e.g. STATUS at 0x800003.
+ *
+ * A core panic while GDB is attached stops the target with a S05 reply
+ * instead of dropping into the stdin debugger.
+ */
+
+#define GDB_PACKET_MAX 4096
+#define GDB_POLL_CYCLES 10000
+
+#define GDB_SPACE_PROGRAM  0x000000
+#define GDB_SPACE_REGISTER 0x800000
+#define GDB_SPACE_EEPROM   0x810000
+#define GDB_SPACE_STACK    0x820000
+
+#define GDB_REGISTER_W      0
+#define GDB_REGISTER_STATUS 1
+#define GDB_REGISTER_SP     2
+#define GDB_REGISTER_PC     3
+
+static int gdb_fd = -1;
+static uint8_t gdb_input[GDB_PACKET_MAX];
+static size_t gdb_input_len = 0;
+static size_t gdb_input_pos = 0;
+
+static uint8_t gdb_breakpoints[MEM_PROGRAM_MAX];
+static uint8_t gdb_watch[PIC_REGISTER_MAX];
+static bool gdb_stepping = false;
+static bool gdb_interrupt = false;
+static bool gdb_panic = false;
+static pic_panic_hook_t gdb_next_panic_hook = NULL;
+
+static const char gdb_hex[] = "0123456789abcdef";
+
+
+
+static int gdb_getc(void)
+{
+  ssize_t n;
+
+  if (gdb_input_pos >= gdb_input_len) {
+    n = recv(gdb_fd, gdb_input, sizeof(gdb_input), 0);
+    if (n <= 0) {
+      return -1;
+    }
+    gdb_input_len = n;
+    gdb_input_pos = 0;
+  }
+
+  return gdb_input[gdb_input_pos++];
+}
+
+
+
+static int gdb_hex_value(int c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+
+
+static int gdb_packet_read(char *packet, size_t size)
+{
+  uint8_t checksum;
+  size_t len;
+  int hi, lo;
+  int c;
+
+  while (1) {
+    do {
+      c = gdb_getc();
+      if (c == -1) {
+        return -1;
+      }
+    } while (c != '$'); /* Skips acks and break requests while stopped. */
+
+    len = 0;
+    checksum = 0;
+    while ((c = gdb_getc()) != '#') {
+      if (c == -1) {
+        return -1;
+      }
+      if (len < size - 1) {
+        packet[len++] = c;
+      }
+      checksum += c;
+    }
+    packet[len] = '\0';
+
+    hi = gdb_hex_value(gdb_getc());
+    lo = gdb_hex_value(gdb_getc());
+    if (hi >= 0 && lo >= 0 && ((hi << 4) | lo) == checksum) {
+      send(gdb_fd, "+", 1, MSG_NOSIGNAL);
+      return len;
+    }
+    send(gdb_fd, "-", 1, MSG_NOSIGNAL);
+  }
+}
+
+
+
+static void gdb_packet_send(const char *data)
+{
+  char buffer[GDB_PACKET_MAX + 4];
+  uint8_t checksum = 0;
+  size_t len = 0;
+  int c;
+
+  buffer[len++] = '$';
+  for (const char *p = data; *p != '\0' && len < GDB_PACKET_MAX; p++) {
+    buffer[len++] = *p;
+    checksum += *p;
+  }
+  buffer[len++] = '#';
+  buffer[len++] = gdb_hex[checksum >> 4];
+  buffer[len++] = gdb_hex[checksum & 0xF];
+
+  do {
+    send(gdb_fd, buffer, len, MSG_NOSIGNAL);
+    c = gdb_getc();
+  } while (c == '-');
+}
+
+
+
+static uint32_t gdb_parse_hex(const char **p)
+{
+  uint32_t value = 0;
+  int digit;
+
+  while ((digit = gdb_hex_value(**p)) >= 0) {
+    value = (value << 4) | digit;
+    (*p)++;
+  }
+  return value;
+}
+
+
+
+static int gdb_mem_read(pic_t *pic, uint32_t addr)
+{
+  if (addr < GDB_SPACE_PROGRAM + (MEM_PROGRAM_MAX * 2)) {
+    addr -= GDB_SPACE_PROGRAM;
+    return (pic->mem->program[addr / 2] >> ((addr % 2) * 8)) & 0xFF;
+  } else if (addr >= GDB_SPACE_REGISTER &&
+    addr < GDB_SPACE_REGISTER + PIC_REGISTER_MAX) {
+    return pic->r[addr - GDB_SPACE_REGISTER];
+  } else if (addr >= GDB_SPACE_EEPROM &&
+    addr < GDB_SPACE_EEPROM + MEM_EEPROM_MAX) {
+    return pic->mem->eeprom[addr - GDB_SPACE_EEPROM];
+  } else if (addr >= GDB_SPACE_STACK &&
+    addr < GDB_SPACE_STACK + (PIC_STACK_SIZE * 2)) {
+    addr -= GDB_SPACE_STACK;
+    return (pic->stack[addr / 2] >> ((addr % 2) * 8)) & 0xFF;
+  }
+  return -1;
+}
+
+
+
+static bool gdb_mem_write(pic_t *pic, uint32_t addr, uint8_t value)
+{
+  uint16_t program;
+  uint16_t *word;
+
+  if (addr < GDB_SPACE_PROGRAM + (MEM_PROGRAM_MAX * 2)) {
+    addr -= GDB_SPACE_PROGRAM;
+    program = pic->mem->program[addr / 2];
+    if (addr % 2) {
+      program = (program & 0x00FF) | (value << 8);
+    } else {
+      program = (program & 0xFF00) | value;
+    }
+    return mem_program_set(pic->mem, addr / 2, program) == 0;
+  } else if (addr >= GDB_SPACE_REGISTER &&
+    addr < GDB_SPACE_REGISTER + PIC_REGISTER_MAX) {
+    pic_reg_set(pic, addr - GDB_SPACE_REGISTER, value);
+    return true;
+  } else if (addr >= GDB_SPACE_EEPROM &&
+    addr < GDB_SPACE_EEPROM + MEM_EEPROM_MAX) {
+    mem_eeprom_write(pic->mem, addr - GDB_SPACE_EEPROM, value);
+    return true;
+  } else if (addr >= GDB_SPACE_STACK &&
+    addr < GDB_SPACE_STACK + (PIC_STACK_SIZE * 2)) {
+    addr -= GDB_SPACE_STACK;
+    word = &pic->stack[addr / 2];
+  } else {
+    return false;
+  }
+
+  if (addr % 2) {
+    *word = (*word & 0x00FF) | (value << 8);
+  } else {
+    *word = (*word & 0xFF00) | value;
+  }
+  return true;
+}
+
+
+
+static void gdb_read_memory(pic_t *pic, const char *args, char *reply)
+{
+  uint32_t addr;
+  uint32_t len;
+  int value;
+
+  addr = gdb_parse_hex(&args);
+  if (*args++ != ',') {
+    strcpy(reply, "E01");
+    return;
+  }
+  len = gdb_parse_hex(&args);
+  if (len > (GDB_PACKET_MAX / 2) - 1) {
+    len = (GDB_PACKET_MAX / 2) - 1;
+  }
+
+  for (uint32_t i = 0; i < len; i++) {
+    value = gdb_mem_read(pic, addr + i);
+    if (value < 0) {
+      if (i == 0) {
+        strcpy(reply, "E02");
+        return;
+      }
+      break;
+    }
+    *reply++ = gdb_hex[value >> 4];
+    *reply++ = gdb_hex[value & 0xF];
+  }
+  *reply = '\0';
+}
+
+
+
+static void gdb_write_memory(pic_t *pic, const char *args, char *reply)
+{
+  uint32_t addr;
+  uint32_t len;
+  int hi, lo;
+
+  addr = gdb_parse_hex(&args);
+  if (*args++ != ',') {
+    strcpy(reply, "E01");
+    return;
+  }
+  len = gdb_parse_hex(&args);
+  if (*args++ != ':') {
+    strcpy(reply, "E01");
+    return;
+  }
+
+  for (uint32_t i = 0; i < len; i++) {
+    hi = gdb_hex_value(*args++);
+    lo = gdb_hex_value(*args++);
+    if (hi < 0 || lo < 0 || ! gdb_mem_write(pic, addr + i, (hi << 4) | lo)) {
+      strcpy(reply, "E02");
+      return;
+    }
+  }
+  strcpy(reply, "OK");
+}
+
+
+
+static int gdb_register_get(pic_t *pic, int n)
+{
+  switch (n) {
+  case GDB_REGISTER_W:
+    return pic->w;
+  case GDB_REGISTER_STATUS:
+    return pic->r[PIC_REG_STATUS];
+  case GDB_REGISTER_SP:
+    return pic->sp;
+  case GDB_REGISTER_PC:
+    return pic->pc * 2;
+  default:
+    return -1;
+  }
+}
+
+
+
+static bool gdb_register_valid(int n, uint16_t value)
+{
+  switch (n) {
+  case GDB_REGISTER_W:
+  case GDB_REGISTER_STATUS:
+  case GDB_REGISTER_PC:
+    return true;
+  case GDB_REGISTER_SP:
+    return value <= PIC_STACK_SIZE;
+  default:
+    return false;
+  }
+}
+
+
+
+static void gdb_register_set(pic_t *pic, int n, uint16_t value)
+{
+  switch (n) {
+  case GDB_REGISTER_W:
+    pic->w = value;
+    break;
+  case GDB_REGISTER_STATUS:
+    pic_reg_set(pic, PIC_REG_STATUS, value);
+    break;
+  case GDB_REGISTER_SP:
+    pic->sp = value;
+    break;
+  case GDB_REGISTER_PC:
+    pic->pc = (value / 2) % MEM_PROGRAM_MAX;
+    break;
+  default:
+    break;
+  }
+}
+
+
+
+static void gdb_format_register(char *reply, int n, int value)
+{
+  int bytes = (n == GDB_REGISTER_PC) ? 2 : 1;
+
+  for (int i = 0; i < bytes; i++) {
+    *reply++ = gdb_hex[(value >> ((i * 8) + 4)) & 0xF];
+    *reply++ = gdb_hex[(value >> (i * 8)) & 0xF];
+  }
+  *reply = '\0';
+}
+
+
+
+static uint16_t gdb_parse_register(const char *args, int n)
+{
+  int bytes = (n == GDB_REGISTER_PC) ? 2 : 1;
+  uint16_t value = 0;
+  int hi, lo;
+
+  for (int i = 0; i < bytes; i++) {
+    hi = gdb_hex_value(*args++);
+    lo = gdb_hex_value(*args++);
+    if (hi < 0 || lo < 0) {
+      break;
+    }
+    value |= ((hi << 4) | lo) << (i * 8);
+  }
+  return value;
+}
+
+
+
+static void gdb_point(const char *args, bool insert, char *reply)
+{
+  uint32_t addr;
+  uint32_t len;
+  uint8_t flags;
+  char type;
+
+  type = *args++;
+  if (*args++ != ',') {
+    strcpy(reply, "E01");
+    return;
+  }
+  addr = gdb_parse_hex(&args);
+  len = 1;
+  if (*args == ',') {
+    args++;
+    len = gdb_parse_hex(&args);
+  }
+
+  switch (type) {
+  case '0':
+  case '1':
+    if (addr >= MEM_PROGRAM_MAX * 2) {
+      strcpy(reply, "E02");
+      return;
+    }
+    gdb_breakpoints[addr / 2] = insert;
+    strcpy(reply, "OK");
+    return;
+
+  case '2':
+    flags = PIC_WATCH_WRITE;
+    break;
+  case '3':
+    flags = PIC_WATCH_READ;
+    break;
+  case '4':
+    flags = PIC_WATCH_READ | PIC_WATCH_WRITE;
+    break;
+  default:
+    reply[0] = '\0'; /* Not supported. */
+    return;
+  }
+
+  if (addr < GDB_SPACE_REGISTER ||
+    addr + len > GDB_SPACE_REGISTER + PIC_REGISTER_MAX) {
+    strcpy(reply, "E02");
+    return;
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    if (insert) {
+      gdb_watch[addr - GDB_SPACE_REGISTER + i] |= flags;
+    } else {
+      gdb_watch[addr - GDB_SPACE_REGISTER + i] &= ~flags;
+    }
+  }
+  strcpy(reply, "OK");
+}
+
+
+
+static void gdb_stop_reply(pic_t *pic, char *reply)
+{
+  const char *kind;
+
+  if (pic->watch_hit != 0) {
+    if ((gdb_watch[pic->watch_addr] & PIC_WATCH_READ) &&
+      (gdb_watch[pic->watch_addr] & PIC_WATCH_WRITE)) {
+      kind = "awatch";
+    } else if (pic->watch_hit == PIC_WATCH_READ) {
+      kind = "rwatch";
+    } else {
+      kind = "watch";
+    }
+    sprintf(reply, "T05%s:%x;", kind, GDB_SPACE_REGISTER + pic->watch_addr);
+  } else if (gdb_interrupt) {
+    strcpy(reply, "S02");
+  } else {
+    strcpy(reply, "S05");
+  }
+}
+
+
+
+static void gdb_detach(pic_t *pic)
+{
+  close(gdb_fd);
+  gdb_fd = -1;
+  gdb_stepping = false;
+  gdb_interrupt = false;
+  gdb_panic = false;
+  pic->watch = NULL;
+  pic->watch_hit = 0;
+  fprintf(stderr, "GDB detached\n");
+}
+
+
+
+static void gdb_session(pic_t *pic, bool stopped)
+{
+  static char packet[GDB_PACKET_MAX];
+  static char reply[GDB_PACKET_MAX];
+  uint16_t value[GDB_REGISTER_PC + 1];
+  const char *args;
+  bool valid;
+  int n;
+
+  if (stopped) {
+    gdb_stop_reply(pic, reply);
+    gdb_packet_send(reply);
+  }
+  pic->watch_hit = 0;
+  gdb_stepping = false;
+  gdb_interrupt = false;
+  gdb_panic = false;
+
+  while (gdb_packet_read(packet, sizeof(packet)) >= 0) {
+    args = &packet[1];
+    reply[0] = '\0';
+
+    switch (packet[0]) {
+    case '?':
+      strcpy(reply, "S05");
+      break;
+
+    case 'g':
+      for (n = 0; n <= GDB_REGISTER_PC; n++) {
+        gdb_format_register(reply + strlen(reply), n, gdb_register_get(pic, n));
+      }
+      break;
+
+    case 'G':
+      /* Nothing is changed unless every register given is valid. */
+      valid = true;
+      for (n = 0; n <= GDB_REGISTER_PC && strlen(args) >= 2; n++) {
+        value[n] = gdb_parse_register(args, n);
+        valid = valid && gdb_register_valid(n, value[n]);
+        args += (n == GDB_REGISTER_PC) ? 4 : 2;
+      }
+      if (! valid) {
+        strcpy(reply, "E01");
+        break;
+      }
+      for (int i = 0; i < n; i++) {
+        gdb_register_set(pic, i, value[i]);
+      }
+      strcpy(reply, "OK");
+      break;
+
+    case 'p':
+      n = gdb_parse_hex(&args);
+      if (gdb_register_get(pic, n) < 0) {
+        strcpy(reply, "E01");
+      } else {
+        gdb_format_register(reply, n, gdb_register_get(pic, n));
+      }
+      break;
+
+    case 'P':
+      n = gdb_parse_hex(&args);
+      if (*args++ == '=' &&
+        gdb_register_valid(n, gdb_parse_register(args, n))) {
+        gdb_register_set(pic, n, gdb_parse_register(args, n));
+        strcpy(reply, "OK");
+      } else {
+        strcpy(reply, "E01");
+      }
+      break;
+
+    case 'm':
+      gdb_read_memory(pic, args, reply);
+      break;
+
+    case 'M':
+      gdb_write_memory(pic, args, reply);
+      break;
+
+    case 'Z':
+    case 'z':
+      gdb_point(args, packet[0] == 'Z', reply);
+      break;
+
+    case 'c':
+    case 's':
+      if (isxdigit((unsigned char)*args)) {
+        pic->pc = (gdb_parse_hex(&args) / 2) % MEM_PROGRAM_MAX;
+      }
+      gdb_stepping = (packet[0] == 's');
+      return;
+
+    case 'H':
+    case 'T':
+      strcpy(reply, "OK");
+      break;
+
+    case 'q':
+      if (strncmp(args, "Supported", 9) == 0) {
+        sprintf(reply, "PacketSize=%x", GDB_PACKET_MAX);
+      } else if (strcmp(args, "Attached") == 0) {
+        strcpy(reply, "1");
+      } else if (strcmp(args, "C") == 0) {
+        strcpy(reply, "QC1");
+      } else if (strcmp(args, "fThreadInfo") == 0) {
+        strcpy(reply, "m1");
+      } else if (strcmp(args, "sThreadInfo") == 0) {
+        strcpy(reply, "l");
+      }
+      break;
+
+    case 'D':
+      gdb_packet_send("OK");
+      gdb_detach(pic);
+      return;
+
+    case 'k':
+      exit(EXIT_SUCCESS);
+      break;
+
+    case 'v':
+      if (strcmp(args, "Kill;1") == 0 || strncmp(args, "Kill", 4) == 0) {
+        gdb_packet_send("OK");
+        exit(EXIT_SUCCESS);
+      }
+      break;
+
+    default:
+      break;
+    }
+
+    gdb_packet_send(reply);
+  }
+
+  gdb_detach(pic); /* Connection closed. */
+}
+
+
+
+void gdb_step(pic_t *pic)
+{
+  if (gdb_fd == -1) {
+    return;
+  }
+
+  if (gdb_panic) {
+    pic->panic_msg[strcspn(pic->panic_msg, "\n")] = '\0';
+    fprintf(stderr, "Panic: %s\n", pic->panic_msg);
+    pic->panic_msg[0] = '\0';
+  }
+
+  if (gdb_breakpoints[pic->pc & (MEM_PROGRAM_MAX - 1)] || pic->watch_hit ||
+    gdb_stepping || gdb_interrupt || gdb_panic) {
+    gdb_session(pic, true);
+  }
+}
+
+
+
+uint32_t gdb_poll(pic_t *pic)
+{
+  uint8_t c;
+  ssize_t n;
+
+  if (gdb_fd == -1) {
+    return UINT32_MAX;
+  }
+
+  /* Only a break request is expected from GDB while running. */
+  n = recv(gdb_fd, &c, 1, MSG_DONTWAIT);
+  if (n == 0) {
+    gdb_detach(pic);
+    return UINT32_MAX;
+  } else if (n == 1 && c == 0x03) {
+    gdb_interrupt = true;
+  }
+
+  return pic->cycle + GDB_POLL_CYCLES;
+}
+
+
+
+static int gdb_listen(const char *address)
+{
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+  bool tcp = true;
+  int one = 1;
+  int fd;
+
+  for (const char *p = address; *p != '\0'; p++) {
+    if (! isdigit((unsigned char)*p)) {
+      tcp = false;
+    }
+  }
+
+  if (tcp) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+      return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in.sin_port = htons(atoi(address));
+    if (bind(fd, (struct sockaddr *)&in, sizeof(in)) == -1) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+      return -1;
+    }
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, address, sizeof(un.sun_path) - 1);
+    unlink(un.sun_path);
+    if (bind(fd, (struct sockaddr *)&un, sizeof(un)) == -1) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  if (listen(fd, 1) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+
+/* Panics go to GDB while it is attached, and to the previous hook after. */
+static void gdb_panic_hook(pic_t *pic, void *user)
+{
+  if (gdb_fd != -1) {
+    gdb_panic = true;
+  } else if (gdb_next_panic_hook != NULL) {
+    (gdb_next_panic_hook)(pic, user);
+  }
+}
+
+
+
+int gdb_init(pic_t *pic, const char *address)
+{
+  int one = 1;
+  int fd;
+
+  fd = gdb_listen(address);
+  if (fd == -1) {
+    return -1;
+  }
+
+  fprintf(stderr, "Waiting for GDB connection on %s\n", address);
+  gdb_fd = accept(fd, NULL, NULL);
+  close(fd);
+  if (gdb_fd == -1) {
+    return -1;
+  }
+  setsockopt(gdb_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  pic->watch = gdb_watch;
+  gdb_next_panic_hook = pic->panic_hook;
+  pic->panic_hook = gdb_panic_hook;
+  gdb_session(pic, false);
+  return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef _GDB_H
+#define _GDB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pic.h"
+
+int gdb_init(pic_t *pic, const char *address);
+void gdb_step(pic_t *pic);
+uint32_t gdb_poll(pic_t *pic);
+
+#endif /* _GDB_H */
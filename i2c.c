@@ -0,0 +1,275 @@
+#include "i2c.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Bit level I2C slave decoding the bus from SCL and SDA line levels, with
+ * a 24LC series serial EEPROM behind it. Devices of up to 2K use a single
+ * word address byte with the upper address bits taken from the block
+ * select bits in the control byte. Larger devices use two word address
+ * bytes, with any address bits above 16 taken from the control byte.
+ *
+ * Page writes wrap within the page like on the real device, but are
+ * stored immediately, so there is no write cycle time to poll for.
+ */
+
+#define I2C_IDLE    0
+#define I2C_ADDRESS 1
+#define I2C_WORD    2
+#define I2C_WRITE   3
+#define I2C_READ    4
+
+#define I2C_CONTROL_CODE 0xA0
+
+
+
+static size_t i2c_eeprom_page_size(size_t size)
+{
+  if (size <= 0x800) {
+    return 16;
+  } else if (size <= 0x2000) {
+    return 32;
+  } else if (size <= 0x8000) {
+    return 64;
+  } else {
+    return 128;
+  }
+}
+
+
+
+int i2c_eeprom_open(i2c_eeprom_t *eeprom, const char *filename, size_t size)
+{
+  struct stat st;
+  bool fresh = false;
+  void *data;
+  int fd;
+
+  memset(eeprom, 0, sizeof(i2c_eeprom_t));
+
+  if (filename == NULL) {
+    eeprom->data = malloc(size);
+    if (eeprom->data == NULL) {
+      return -1;
+    }
+    memset(eeprom->data, 0xFF, size); /* Erased state. */
+    eeprom->size = size;
+    eeprom->page = i2c_eeprom_page_size(size);
+    return 0;
+  }
+
+  fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  if (st.st_size == 0) {
+    if (ftruncate(fd, size) == -1) {
+      close(fd);
+      return -1;
+    }
+    fresh = true;
+  } else {
+    size = st.st_size; /* Existing image decides the device size. */
+  }
+
+  data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+
+  if (fresh) {
+    memset(data, 0xFF, size);
+  }
+
+  eeprom->data = data;
+  eeprom->size = size;
+  eeprom->page = i2c_eeprom_page_size(size);
+  eeprom->mapped = true;
+  return 0;
+}
+
+
+
+void i2c_eeprom_close(i2c_eeprom_t *eeprom)
+{
+  if (eeprom->data == NULL) {
+    return;
+  }
+
+  if (eeprom->mapped) {
+    munmap(eeprom->data, eeprom->size);
+  } else {
+    free(eeprom->data);
+  }
+  eeprom->data = NULL;
+}
+
+
+
+void i2c_init(i2c_t *i2c)
+{
+  memset(i2c, 0, sizeof(i2c_t));
+  i2c->scl = true;
+  i2c->sda = true;
+  i2c->state = I2C_IDLE;
+}
+
+
+
+static bool i2c_byte(i2c_t *i2c, i2c_eeprom_t *eeprom, uint8_t byte)
+{
+  uint32_t block;
+
+  switch (i2c->state) {
+  case I2C_ADDRESS:
+    if ((byte & 0xF0) != I2C_CONTROL_CODE || eeprom->data == NULL) {
+      i2c->state = I2C_IDLE; /* Not for us, wait for next start. */
+      return false;
+    }
+    block = (byte >> 1) & 0x7;
+    i2c->address_bytes = (eeprom->size <= 0x800) ? 1 : 2;
+    if (i2c->address_bytes == 1) {
+      i2c->address = (block << 8) | (i2c->address & 0xFF);
+    } else {
+      i2c->address = (block << 16) | (i2c->address & 0xFFFF);
+    }
+    i2c->address %= eeprom->size;
+    i2c->read = byte & 1; /* Switched to reading after the ACK clock. */
+    if (! i2c->read) {
+      i2c->state = I2C_WORD;
+    }
+    return true;
+
+  case I2C_WORD:
+    i2c->address_bytes--;
+    if (i2c->address_bytes == 1) {
+      i2c->address = (i2c->address & ~0xFF00) | (byte << 8);
+    } else {
+      i2c->address = (i2c->address & ~0xFF) | byte;
+      i2c->state = I2C_WRITE;
+    }
+    i2c->address %= eeprom->size;
+    return true;
+
+  case I2C_WRITE:
+    eeprom->data[i2c->address] = byte;
+    eeprom->written = true;
+    i2c->address = (i2c->address & ~(eeprom->page - 1)) |
+      ((i2c->address + 1) & (eeprom->page - 1));
+    i2c->address %= eeprom->size;
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+
+
+static void i2c_rising(i2c_t *i2c, bool line)
+{
+  if (i2c->state == I2C_IDLE) {
+    return;
+  }
+
+  i2c->bit++;
+  if (i2c->state == I2C_READ) {
+    if (i2c->bit == 9) {
+      i2c->master_ack = ! line;
+    }
+  } else if (i2c->bit <= 8) {
+    i2c->shift = (i2c->shift << 1) | line;
+  }
+}
+
+
+
+static void i2c_read_load(i2c_t *i2c, i2c_eeprom_t *eeprom)
+{
+  i2c->shift = eeprom->data[i2c->address];
+  i2c->address = (i2c->address + 1) % eeprom->size;
+  i2c->sda_slave_low = ! (i2c->shift & 0x80);
+}
+
+
+
+static void i2c_falling(i2c_t *i2c, i2c_eeprom_t *eeprom)
+{
+  if (i2c->state == I2C_IDLE) {
+    return;
+  }
+
+  if (i2c->state == I2C_READ) {
+    if (i2c->bit < 8) {
+      i2c->sda_slave_low = ! ((i2c->shift >> (7 - i2c->bit)) & 1);
+    } else if (i2c->bit == 8) {
+      i2c->sda_slave_low = false; /* Release for the master ACK. */
+    } else {
+      i2c->bit = 0;
+      if (i2c->master_ack) {
+        i2c_read_load(i2c, eeprom);
+      } else {
+        i2c->state = I2C_IDLE;
+      }
+    }
+    return;
+  }
+
+  if (i2c->bit == 8) {
+    i2c->sda_slave_low = i2c_byte(i2c, eeprom, i2c->shift);
+    if (! i2c->sda_slave_low) {
+      i2c->state = I2C_IDLE;
+    }
+  } else if (i2c->bit == 9) {
+    i2c->sda_slave_low = false;
+    i2c->bit = 0;
+    i2c->shift = 0;
+    if (i2c->state == I2C_ADDRESS && i2c->read) {
+      i2c->state = I2C_READ;
+      i2c_read_load(i2c, eeprom);
+    }
+  }
+}
+
+
+
+bool i2c_update(i2c_t *i2c, i2c_eeprom_t *eeprom, bool scl, bool sda)
+{
+  if (scl && i2c->scl && sda != i2c->sda) {
+    if (! sda) {
+      /* Start condition, also used as repeated start. */
+      i2c->state = I2C_ADDRESS;
+      i2c->read = false;
+      i2c->bit = 0;
+      i2c->shift = 0;
+    } else {
+      /* Stop condition. */
+      i2c->state = I2C_IDLE;
+    }
+    i2c->sda_slave_low = false;
+  } else if (scl && ! i2c->scl) {
+    i2c_rising(i2c, sda && ! i2c->sda_slave_low);
+  } else if (! scl && i2c->scl) {
+    i2c_falling(i2c, eeprom);
+  }
+
+  i2c->scl = scl;
+  i2c->sda = sda;
+  return sda && ! i2c->sda_slave_low;
+}
+
+
+
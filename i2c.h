@@ -0,0 +1,36 @@
+#ifndef _I2C_H
+#define _I2C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define I2C_EEPROM_DEFAULT_SIZE 0x10000 /* 24LC512 */
+
+typedef struct i2c_eeprom_s {
+  uint8_t *data;
+  size_t size;
+  size_t page;
+  bool mapped;
+  bool written; /* Set on every write, for the user to clear. */
+} i2c_eeprom_t;
+
+typedef struct i2c_s {
+  bool scl;
+  bool sda;
+  bool sda_slave_low;
+  uint8_t state;
+  uint8_t bit;
+  uint8_t shift;
+  uint8_t address_bytes;
+  bool read;
+  bool master_ack;
+  uint32_t address;
+} i2c_t;
+
+int i2c_eeprom_open(i2c_eeprom_t *eeprom, const char *filename, size_t size);
+void i2c_eeprom_close(i2c_eeprom_t *eeprom);
+void i2c_init(i2c_t *i2c);
+bool i2c_update(i2c_t *i2c, i2c_eeprom_t *eeprom, bool scl, bool sda);
+
+#endif /* _I2C_H */
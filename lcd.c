@@ -0,0 +1,209 @@
+#include "lcd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Model of a dual controller graphic LCD as used on the AE-GraphicLCD
+ * board, with two SED1520 style controllers each driving one half of the
+ * panel. A bus cycle is in progress for a controller while it is selected
+ * and E is high, and a write is latched when the cycle ends, which is
+ * either on the falling edge of E, the chip select being released or R/W
+ * going back high.
+ *
+ * The firmware leaves the bus in the read state while idle, so reads do
+ * not auto-increment the column address like on the real controller,
+ * otherwise every idle period would be counted as a dummy read.
+ */
+
+#define LCD_FRAME_CYCLES 16667 /* 60 Hz refresh at 1 MHz instruction rate. */
+
+#define LCD_STATUS_ADC   0x40
+#define LCD_STATUS_OFF   0x20
+#define LCD_STATUS_RESET 0x10
+
+
+
+static void lcd_controller_reset(lcd_controller_t *c)
+{
+  c->page = 3;
+  c->column = 0;
+  c->start_line = 0;
+  c->on = false;
+  c->adc = false;
+  c->rmw = false;
+  c->rmw_column = 0;
+}
+
+
+
+static void lcd_command(lcd_t *lcd, lcd_controller_t *c, uint8_t cmd)
+{
+  if (cmd < LCD_COLUMNS) {
+    c->column = cmd;
+  } else if ((cmd & 0xFE) == 0xAE) {
+    c->on = cmd & 1;
+    lcd->dirty = true;
+  } else if ((cmd & 0xE0) == 0xC0) {
+    c->start_line = cmd & 0x1F;
+    lcd->dirty = true;
+  } else if ((cmd & 0xFC) == 0xB8) {
+    c->page = cmd & 0x03;
+  } else if ((cmd & 0xFE) == 0xA0) {
+    c->adc = cmd & 1;
+    lcd->dirty = true;
+  } else if (cmd == 0xE0) {
+    c->rmw = true;
+    c->rmw_column = c->column;
+  } else if (cmd == 0xEE) {
+    if (c->rmw) {
+      c->column = c->rmw_column;
+    }
+    c->rmw = false;
+  } else if (cmd == 0xE2) {
+    lcd_controller_reset(c);
+    lcd->dirty = true;
+  }
+  /* Static drive (0xA4/0xA5) and duty (0xA8/0xA9) do not affect the model. */
+}
+
+
+
+static void lcd_data_write(lcd_t *lcd, lcd_controller_t *c, uint8_t data)
+{
+  if (c->column < LCD_COLUMNS) {
+    c->ram[c->page][c->column] = data;
+    c->column++;
+    lcd->dirty = true;
+  }
+}
+
+
+
+static uint8_t lcd_read(lcd_t *lcd, lcd_controller_t *c, bool rs)
+{
+  if (rs) {
+    return (c->column < LCD_COLUMNS) ? c->ram[c->page][c->column] : 0;
+  }
+  return (c->adc ? LCD_STATUS_ADC : 0) | (c->on ? 0 : LCD_STATUS_OFF) |
+    (lcd->reset ? LCD_STATUS_RESET : 0);
+}
+
+
+
+void lcd_init(lcd_t *lcd)
+{
+  memset(lcd, 0, sizeof(lcd_t));
+  for (int i = 0; i < LCD_CONTROLLERS; i++) {
+    lcd_controller_reset(&lcd->controller[i]);
+  }
+}
+
+
+
+int lcd_bus(lcd_t *lcd, uint8_t cs, bool e, bool rw, bool rs, bool rst,
+  uint8_t data)
+{
+  lcd_controller_t *c;
+  bool selected;
+  int drive = -1;
+
+  lcd->reset = rst;
+  if (rst) {
+    for (int i = 0; i < LCD_CONTROLLERS; i++) {
+      lcd_controller_reset(&lcd->controller[i]);
+      lcd->controller[i].busy_read = false;
+      lcd->controller[i].busy_write = false;
+    }
+    lcd->dirty = true;
+    lcd->data = data;
+    return -1;
+  }
+
+  for (int i = 0; i < LCD_CONTROLLERS; i++) {
+    c = &lcd->controller[i];
+    selected = ((cs >> i) & 1) && e;
+
+    if (c->busy_write && ! (selected && ! rw)) {
+      if (rs) {
+        lcd_data_write(lcd, c, data);
+      } else {
+        lcd_command(lcd, c, data);
+      }
+    }
+    c->busy_write = selected && ! rw;
+    c->busy_read = selected && rw;
+    if (c->busy_read && drive == -1) {
+      drive = lcd_read(lcd, c, rs);
+    }
+  }
+
+  lcd->data = data;
+  return drive;
+}
+
+
+
+bool lcd_frame(lcd_t *lcd, uint32_t cycle)
+{
+  if (lcd->dirty && cycle - lcd->frame_cycle >= LCD_FRAME_CYCLES) {
+    lcd->dirty = false;
+    lcd->frame++;
+    lcd->frame_cycle = cycle;
+    return true;
+  }
+  return false;
+}
+
+
+
+void lcd_render(lcd_t *lcd, uint8_t fb[LCD_HEIGHT][LCD_WIDTH])
+{
+  lcd_controller_t *c;
+  int column;
+  int line;
+
+  for (int i = 0; i < LCD_CONTROLLERS; i++) {
+    c = &lcd->controller[i];
+    for (int y = 0; y < LCD_HEIGHT; y++) {
+      line = (y + c->start_line) % LCD_HEIGHT;
+      for (int x = 0; x < LCD_VISIBLE_COLUMNS; x++) {
+        column = c->adc ? (LCD_COLUMNS - 1 - x) : x;
+        fb[y][(i * LCD_VISIBLE_COLUMNS) + x] = c->on &&
+          ((c->ram[line / 8][column] >> (line % 8)) & 1);
+      }
+    }
+  }
+}
+
+
+
+int lcd_dump_pbm(lcd_t *lcd, const char *filename)
+{
+  uint8_t fb[LCD_HEIGHT][LCD_WIDTH];
+  uint8_t row[(LCD_WIDTH + 7) / 8];
+  FILE *fh;
+
+  fh = fopen(filename, "wb");
+  if (fh == NULL) {
+    return -1;
+  }
+
+  lcd_render(lcd, fb);
+
+  fprintf(fh, "P4\n%d %d\n", LCD_WIDTH, LCD_HEIGHT);
+  for (int y = 0; y < LCD_HEIGHT; y++) {
+    memset(row, 0, sizeof(row));
+    for (int x = 0; x < LCD_WIDTH; x++) {
+      if (fb[y][x]) {
+        row[x / 8] |= 0x80 >> (x % 8);
+      }
+    }
+    fwrite(row, 1, sizeof(row), fh);
+  }
+
+  return fclose(fh) == 0 ? 0 : -1;
+}
+
+
+
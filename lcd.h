@@ -0,0 +1,43 @@
+#ifndef _LCD_H
+#define _LCD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LCD_CONTROLLERS 2
+#define LCD_PAGES 4
+#define LCD_COLUMNS 80 /* Display RAM columns per controller. */
+#define LCD_VISIBLE_COLUMNS 61 /* Columns wired to the panel. */
+#define LCD_WIDTH (LCD_CONTROLLERS * LCD_VISIBLE_COLUMNS)
+#define LCD_HEIGHT (LCD_PAGES * 8)
+
+typedef struct lcd_controller_s {
+  uint8_t ram[LCD_PAGES][LCD_COLUMNS];
+  uint8_t page;
+  uint8_t column;
+  uint8_t start_line;
+  bool on;
+  bool adc;
+  bool rmw;
+  uint8_t rmw_column;
+  bool busy_read; /* Read strobe active. */
+  bool busy_write; /* Write strobe active. */
+} lcd_controller_t;
+
+typedef struct lcd_s {
+  lcd_controller_t controller[LCD_CONTROLLERS];
+  uint8_t data; /* Last value on the data bus. */
+  bool reset;
+  bool dirty;
+  uint32_t frame;
+  uint32_t frame_cycle;
+} lcd_t;
+
+void lcd_init(lcd_t *lcd);
+int lcd_bus(lcd_t *lcd, uint8_t cs, bool e, bool rw, bool rs, bool rst,
+  uint8_t data);
+bool lcd_frame(lcd_t *lcd, uint32_t cycle);
+void lcd_render(lcd_t *lcd, uint8_t fb[LCD_HEIGHT][LCD_WIDTH]);
+int lcd_dump_pbm(lcd_t *lcd, const char *filename);
+
+#endif /* _LCD_H */
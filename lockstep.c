@@ -0,0 +1,681 @@
+#include "lockstep.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mem.h"
+#include "pic.h"
+
+/* Lockstep execution of many instances of the same program, for sweeps
+ * where only the inputs differ. Each step takes the lane deepest in the
+ * call stack, with the lowest PC among those, and executes its
+ * instruction for every lane at the same PC together, on arrays indexed
+ * by lane that the arithmetic works on as GCC vectors. Lanes that branch
+ * differently drop out of the group and join it again once they reach the
+ * same PC, usually at the end of the loop or subroutine they diverged in.
+ *
+ * Selecting a group costs more than running one instruction for it, so
+ * a group keeps running straight-line code without being selected again,
+ * until it branches, skips, drops a lane, reaches the PC of another lane
+ * it could join, or a lane runs out of cycles.
+ *
+ * W, STATUS, FSR, PCLATH, the stack and the general purpose registers are
+ * kept here, the general purpose registers with all lanes of a register
+ * next to each other. An instruction accessing any other special function
+ * register, directly or through INDF, is run by pic_execute() on the
+ * lane's own pic_t instead, so peripherals and hooks work as usual. This
+ * also covers TRIS, invalid opcodes and stack panics. Accesses to general
+ * purpose registers do not call the register hooks, and the journal and
+ * watch points are not supported.
+ *
+ * Outside of lockstep_run() the pc, W, cycle, STATUS, FSR and PCLATH of
+ * each pic_t are up to date, and may be changed along with its special
+ * function registers and inputs. The general purpose registers and the
+ * stack are only copied back by lockstep_sync().
+ */
+
+#define LOCKSTEP_GPR    0
+#define LOCKSTEP_STATUS 1
+#define LOCKSTEP_FSR    2
+#define LOCKSTEP_PCLATH 3
+#define LOCKSTEP_SCALAR 4
+
+#define LOCKSTEP_DEST_NONE 0
+#define LOCKSTEP_DEST_W    1
+#define LOCKSTEP_DEST_F    2
+
+#define LOCKSTEP_FLAG_C 0x01
+#define LOCKSTEP_FLAG_Z 0x04
+
+/* One value for each lane, in the vector registers of the host. */
+typedef uint8_t lockstep_vec_t
+  __attribute__((vector_size(LOCKSTEP_LANES)));
+
+
+
+void lockstep_init(lockstep_t *ls)
+{
+  memset(ls, 0, sizeof(lockstep_t));
+}
+
+
+
+static void lockstep_core_load(lockstep_t *ls, int l)
+{
+  pic_t *pic = ls->pic[l];
+
+  ls->pc[l] = pic->pc;
+  ls->cycle[l] = pic->cycle;
+  ls->w[l] = pic->w;
+  ls->status[l] = pic->r[PIC_REG_STATUS];
+  ls->fsr[l] = pic->r[PIC_REG_FSR];
+  ls->pclath[l] = pic->r[PIC_REG_PCLATH];
+  ls->program[l] = pic->mem->program;
+}
+
+
+
+static void lockstep_core_store(lockstep_t *ls, int l)
+{
+  pic_t *pic = ls->pic[l];
+
+  pic->pc = ls->pc[l];
+  pic->cycle = ls->cycle[l];
+  pic->w = ls->w[l];
+  pic->r[PIC_REG_STATUS] = ls->status[l];
+  pic->r[PIC_REG_FSR] = ls->fsr[l];
+  pic->r[PIC_REG_PCLATH] = ls->pclath[l];
+}
+
+
+
+static inline lockstep_vec_t lockstep_vec_load(const uint8_t *p)
+{
+  lockstep_vec_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+
+static inline void lockstep_vec_store(uint8_t *p, lockstep_vec_t v)
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+
+
+static inline bool lockstep_gpr(uint16_t e)
+{
+  return (e & 0x7F) >= 0x20;
+}
+
+
+
+int lockstep_add(lockstep_t *ls, pic_t *pic)
+{
+  int l = ls->lanes;
+
+  if (l == LOCKSTEP_LANES) {
+    return -1;
+  }
+
+  ls->pic[l] = pic;
+  lockstep_core_load(ls, l);
+  ls->stop[l] = UINT32_MAX;
+  ls->sp[l] = pic->sp;
+  ls->panic[l] = 0;
+  for (int i = 0; i < PIC_STACK_SIZE; i++) {
+    ls->stack[i][l] = pic->stack[i];
+  }
+  for (int i = 0; i < PIC_REGISTER_MAX; i++) {
+    ls->r[i][l] = pic->r[i];
+  }
+  ls->lanes++;
+  return l;
+}
+
+
+
+void lockstep_sync(lockstep_t *ls, int lane)
+{
+  pic_t *pic = ls->pic[lane];
+
+  lockstep_core_store(ls, lane);
+  pic->sp = ls->sp[lane];
+  for (int i = 0; i < PIC_STACK_SIZE; i++) {
+    pic->stack[i] = ls->stack[i][lane];
+  }
+  for (int i = 0; i < PIC_REGISTER_MAX; i++) {
+    if (lockstep_gpr(i)) {
+      pic->r[i] = ls->r[i][lane];
+    }
+  }
+}
+
+
+
+/* Runs the instruction at the PC of one lane through its pic_t. */
+static void lockstep_scalar(lockstep_t *ls, int l)
+{
+  pic_t *pic = ls->pic[l];
+
+  lockstep_core_store(ls, l);
+  pic->panic_msg[0] = '\0';
+  pic_execute(pic, pic->mem);
+  lockstep_core_load(ls, l);
+  if (pic->panic_msg[0] != '\0') {
+    ls->panic[l] = 1;
+  }
+}
+
+
+
+static void lockstep_scalar_all(lockstep_t *ls, const uint8_t *mask)
+{
+  for (int l = 0; l < ls->lanes; l++) {
+    if (mask[l]) {
+      lockstep_scalar(ls, l);
+    }
+  }
+}
+
+
+
+/* Picks the next group into mask. Returns its leader, with the number of
+ * cycles all of it can still run in run, and the nearest PC further on
+ * where another lane of the same stack depth waits in until. */
+static int lockstep_select(lockstep_t *ls, uint8_t *mask, uint32_t *run,
+  uint16_t *until)
+{
+  uint8_t live[LOCKSTEP_LANES];
+  int leader = -1;
+  uint16_t pc;
+
+  for (int l = 0; l < ls->lanes; l++) {
+    live[l] = ! ls->panic[l] && ls->cycle[l] < ls->stop[l];
+    if (! live[l]) {
+      continue;
+    }
+    if (leader == -1 || ls->sp[l] > ls->sp[leader] ||
+      (ls->sp[l] == ls->sp[leader] && ls->pc[l] < ls->pc[leader])) {
+      leader = l;
+    }
+  }
+  if (leader == -1) {
+    return -1;
+  }
+
+  /* A lane that wrote its program memory has its own copy of it. */
+  pc = ls->pc[leader];
+  *run = UINT32_MAX;
+  *until = UINT16_MAX;
+  memset(mask, 0, LOCKSTEP_LANES);
+  for (int l = 0; l < ls->lanes; l++) {
+    if (! live[l]) {
+      continue;
+    }
+    if (ls->pc[l] == pc && ls->program[l] == ls->program[leader]) {
+      mask[l] = 1;
+      if (ls->stop[l] - ls->cycle[l] < *run) {
+        *run = ls->stop[l] - ls->cycle[l];
+      }
+    } else if (ls->sp[l] == ls->sp[leader] && ls->pc[l] > pc &&
+      ls->pc[l] < *until) {
+      *until = ls->pc[l];
+    }
+  }
+  return leader;
+}
+
+
+
+/* Finds the register each lane accesses, and runs the lanes accessing a
+ * special function register through pic_execute() right away. Returns
+ * the number of lanes left, with row pointing at the register if they
+ * all access the same general purpose register. */
+static int lockstep_resolve(lockstep_t *ls, uint8_t *mask, uint8_t f,
+  bool status_ok, uint16_t *e, uint8_t *kind, uint8_t **row)
+{
+  bool uniform = true;
+  int first = -1;
+  int count = 0;
+
+  for (int l = 0; l < ls->lanes; l++) {
+    if (! mask[l]) {
+      continue;
+    }
+
+    if (f == PIC_REG_INDF) {
+      e[l] = ls->fsr[l] | ((ls->status[l] & 0x80) << 1);
+      kind[l] = lockstep_gpr(e[l]) ? LOCKSTEP_GPR : LOCKSTEP_SCALAR;
+    } else {
+      e[l] = f | ((ls->status[l] & 0x60) << 2);
+      if (lockstep_gpr(e[l])) {
+        kind[l] = LOCKSTEP_GPR;
+      } else if (f == PIC_REG_STATUS && status_ok) {
+        kind[l] = LOCKSTEP_STATUS;
+      } else if (f == PIC_REG_FSR) {
+        kind[l] = LOCKSTEP_FSR;
+      } else if (f == PIC_REG_PCLATH) {
+        kind[l] = LOCKSTEP_PCLATH;
+      } else {
+        kind[l] = LOCKSTEP_SCALAR;
+      }
+    }
+
+    if (kind[l] == LOCKSTEP_SCALAR) {
+      lockstep_scalar(ls, l);
+      mask[l] = 0;
+      continue;
+    }
+
+    if (first == -1) {
+      first = l;
+    }
+    if (kind[l] != LOCKSTEP_GPR || e[l] != e[first]) {
+      uniform = false;
+    }
+    count++;
+  }
+
+  *row = (count > 0 && uniform) ? ls->r[e[first]] : NULL;
+  return count;
+}
+
+
+
+static lockstep_vec_t lockstep_load(lockstep_t *ls, const uint8_t *mask,
+  const uint8_t *row, const uint16_t *e, const uint8_t *kind)
+{
+  lockstep_vec_t v = { 0 };
+
+  if (row != NULL) {
+    return lockstep_vec_load(row);
+  }
+
+  for (int l = 0; l < ls->lanes; l++) {
+    if (! mask[l]) {
+      continue;
+    }
+    switch (kind[l]) {
+    case LOCKSTEP_STATUS:
+      v[l] = ls->status[l];
+      break;
+    case LOCKSTEP_FSR:
+      v[l] = ls->fsr[l];
+      break;
+    case LOCKSTEP_PCLATH:
+      v[l] = ls->pclath[l];
+      break;
+    default:
+      v[l] = ls->r[e[l]][l];
+      break;
+    }
+  }
+  return v;
+}
+
+
+
+/* Stores v, which is zero outside the mask, to the registers in e. */
+static void lockstep_store(lockstep_t *ls, const uint8_t *mask,
+  uint8_t *row, const uint16_t *e, const uint8_t *kind, lockstep_vec_t v)
+{
+  if (row != NULL) {
+    lockstep_vec_store(row, v |
+      (lockstep_vec_load(row) & ~-lockstep_vec_load(mask)));
+    return;
+  }
+
+  for (int l = 0; l < ls->lanes; l++) {
+    if (! mask[l]) {
+      continue;
+    }
+    switch (kind[l]) {
+    case LOCKSTEP_STATUS:
+      ls->status[l] = v[l];
+      break;
+    case LOCKSTEP_FSR:
+      ls->fsr[l] = v[l];
+      break;
+    case LOCKSTEP_PCLATH:
+      ls->pclath[l] = v[l];
+      break;
+    default:
+      ls->r[e[l]][l] = v[l];
+      break;
+    }
+  }
+}
+
+
+
+static void lockstep_branch(lockstep_t *ls, const uint8_t *mask, uint8_t op,
+  uint16_t opcode)
+{
+  uint16_t k = opcode & 0x7FF;
+  uint8_t sp;
+
+  for (int l = 0; l < ls->lanes; l++) {
+    if (! mask[l]) {
+      continue;
+    }
+
+    sp = ls->sp[l];
+    if ((op == PIC_OP_CALL && sp == PIC_STACK_SIZE) ||
+      (op != PIC_OP_CALL && op != PIC_OP_GOTO && sp == 0)) {
+      /* Panics on the stack, reported by pic_execute() with all state. */
+      lockstep_sync(ls, l);
+      lockstep_scalar(ls, l);
+      continue;
+    }
+
+    switch (op) {
+    case PIC_OP_CALL:
+      ls->stack[sp][l] = ls->pc[l] + 1;
+      ls->sp[l] = sp + 1;
+      /* Fall through. */
+    case PIC_OP_GOTO:
+      ls->pc[l] = k + (((ls->pclath[l] >> 3) & 0x3) << 11);
+      break;
+    case PIC_OP_RETLW:
+      ls->w[l] = opcode & 0xFF;
+      /* Fall through. */
+    default:
+      ls->sp[l] = sp - 1;
+      ls->pc[l] = ls->stack[sp - 1][l];
+      break;
+    }
+    ls->cycle[l] += 2;
+  }
+}
+
+
+
+/* Returns true if every lane of the group ran the instruction here and
+ * went on to the next one in a single cycle. */
+static bool lockstep_step(lockstep_t *ls, int leader, uint8_t *mask)
+{
+  mem_t *mem = ls->pic[leader]->mem;
+  uint8_t kind[LOCKSTEP_LANES];
+  uint16_t e[LOCKSTEP_LANES];
+  uint8_t *row = NULL;
+  lockstep_vec_t v = { 0 };
+  lockstep_vec_t res = { 0 };
+  lockstep_vec_t c = { 0 };
+  lockstep_vec_t skip = { 0 };
+  lockstep_vec_t step;
+  lockstep_vec_t w;
+  lockstep_vec_t m;
+  int lanes = 0;
+  uint8_t dest = LOCKSTEP_DEST_W;
+  uint8_t flags = 0;
+  uint16_t opcode;
+  uint16_t addr;
+  uint8_t op;
+  uint8_t b;
+  uint8_t f;
+  uint8_t k;
+  bool d;
+
+  addr = ls->pc[leader] & 0x1FFF;
+  opcode = mem->program[addr];
+  op = mem->decoded[addr];
+  if (op == PIC_OP_NONE) {
+    op = pic_decode(opcode);
+    mem->decoded[addr] = op;
+  }
+
+  f = opcode & 0x7F;
+  d = (opcode >> 7) & 1;
+  b = (opcode >> 7) & 0x7;
+  k = opcode & 0xFF;
+  w = lockstep_vec_load(ls->w);
+
+  switch (op) {
+  case PIC_OP_CALL:
+  case PIC_OP_GOTO:
+  case PIC_OP_RETLW:
+  case PIC_OP_RETURN:
+    lockstep_branch(ls, mask, op, opcode);
+    return false;
+
+  case PIC_OP_NOP:
+    dest = LOCKSTEP_DEST_NONE;
+    break;
+
+  case PIC_OP_ADDLW:
+    res = w + k;
+    c = (lockstep_vec_t)(res < w) & 1;
+    flags = LOCKSTEP_FLAG_C | LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_ANDLW:
+    res = w & k;
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_CLRW:
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_IORLW:
+    res = w | k;
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_MOVLW:
+    res += k;
+    break;
+
+  case PIC_OP_SUBLW:
+    res = k - w;
+    c = (lockstep_vec_t)(w <= k) & 1;
+    flags = LOCKSTEP_FLAG_C | LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_XORLW:
+    res = w ^ k;
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_ADDWF:
+  case PIC_OP_ANDWF:
+  case PIC_OP_BCF:
+  case PIC_OP_BSF:
+  case PIC_OP_BTFSC:
+  case PIC_OP_BTFSS:
+  case PIC_OP_CLRF:
+  case PIC_OP_COMF:
+  case PIC_OP_DECF:
+  case PIC_OP_DECFSZ:
+  case PIC_OP_INCF:
+  case PIC_OP_INCFSZ:
+  case PIC_OP_IORWF:
+  case PIC_OP_MOVF:
+  case PIC_OP_MOVWF:
+  case PIC_OP_RLF:
+  case PIC_OP_RRF:
+  case PIC_OP_SUBWF:
+  case PIC_OP_SWAPF:
+  case PIC_OP_XORWF:
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+      lanes += mask[l];
+    }
+    /* pic_execute() sets flags in STATUS around writing the result, so
+     * only instructions without flags use STATUS here. */
+    if (lockstep_resolve(ls, mask, f, op == PIC_OP_BCF || op == PIC_OP_BSF ||
+      op == PIC_OP_BTFSC || op == PIC_OP_BTFSS || op == PIC_OP_MOVWF ||
+      op == PIC_OP_SWAPF, e, kind, &row) != lanes) {
+      return false;
+    }
+    v = lockstep_load(ls, mask, row, e, kind);
+    dest = d ? LOCKSTEP_DEST_F : LOCKSTEP_DEST_W;
+    break;
+
+  default:
+    lockstep_scalar_all(ls, mask);
+    return false;
+  }
+
+  switch (op) {
+  case PIC_OP_ADDWF:
+    res = v + w;
+    c = (lockstep_vec_t)(res < v) & 1;
+    flags = LOCKSTEP_FLAG_C | LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_ANDWF:
+    res = v & w;
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_BCF:
+    res = v & (uint8_t)~(1 << b);
+    dest = LOCKSTEP_DEST_F;
+    break;
+
+  case PIC_OP_BSF:
+    res = v | (uint8_t)(1 << b);
+    dest = LOCKSTEP_DEST_F;
+    break;
+
+  case PIC_OP_BTFSC:
+    skip = ((v >> b) & 1) ^ 1;
+    dest = LOCKSTEP_DEST_NONE;
+    break;
+
+  case PIC_OP_BTFSS:
+    skip = (v >> b) & 1;
+    dest = LOCKSTEP_DEST_NONE;
+    break;
+
+  case PIC_OP_CLRF:
+    dest = LOCKSTEP_DEST_F;
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_COMF:
+    res = ~v;
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_DECF:
+  case PIC_OP_DECFSZ:
+    res = v - 1;
+    if (op == PIC_OP_DECF) {
+      flags = LOCKSTEP_FLAG_Z;
+    } else {
+      skip = (lockstep_vec_t)(res == 0) & 1;
+    }
+    break;
+
+  case PIC_OP_INCF:
+  case PIC_OP_INCFSZ:
+    res = v + 1;
+    if (op == PIC_OP_INCF) {
+      flags = LOCKSTEP_FLAG_Z;
+    } else {
+      skip = (lockstep_vec_t)(res == 0) & 1;
+    }
+    break;
+
+  case PIC_OP_IORWF:
+    res = v | w;
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_MOVF:
+    /* With d set W is written to f, same as in pic_execute(). */
+    res = d ? w : v;
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_MOVWF:
+    res = w;
+    dest = LOCKSTEP_DEST_F;
+    break;
+
+  case PIC_OP_RLF:
+    res = (v << 1) | (lockstep_vec_load(ls->status) & LOCKSTEP_FLAG_C);
+    c = v >> 7;
+    flags = LOCKSTEP_FLAG_C;
+    break;
+
+  case PIC_OP_RRF:
+    res = (v >> 1) | ((lockstep_vec_load(ls->status) & LOCKSTEP_FLAG_C) << 7);
+    c = v & 1;
+    flags = LOCKSTEP_FLAG_C;
+    break;
+
+  case PIC_OP_SUBWF:
+    res = v - w;
+    c = (lockstep_vec_t)(v >= w) & 1;
+    flags = LOCKSTEP_FLAG_C | LOCKSTEP_FLAG_Z;
+    break;
+
+  case PIC_OP_SWAPF:
+    res = (v >> 4) | (v << 4);
+    break;
+
+  case PIC_OP_XORWF:
+    res = v ^ w;
+    flags = LOCKSTEP_FLAG_Z;
+    break;
+
+  default:
+    break;
+  }
+
+  /* The mask as all ones or all zeros in each lane. */
+  m = -lockstep_vec_load(mask);
+  if (dest == LOCKSTEP_DEST_F) {
+    lockstep_store(ls, mask, row, e, kind, res & m);
+  } else if (dest == LOCKSTEP_DEST_W) {
+    lockstep_vec_store(ls->w, (res & m) | (w & ~m));
+  }
+
+  if (flags != 0) {
+    m &= flags;
+    lockstep_vec_store(ls->status, (lockstep_vec_load(ls->status) & ~m) |
+      ((c | ((lockstep_vec_t)(res == 0) & LOCKSTEP_FLAG_Z)) & m));
+  }
+
+  step = -lockstep_vec_load(mask) & (1 + skip);
+  for (int l = 0; l < LOCKSTEP_LANES; l++) {
+    ls->pc[l] += step[l];
+    ls->cycle[l] += step[l];
+  }
+  return op != PIC_OP_BTFSC && op != PIC_OP_BTFSS &&
+    op != PIC_OP_DECFSZ && op != PIC_OP_INCFSZ;
+}
+
+
+
+void lockstep_run(lockstep_t *ls)
+{
+  uint8_t mask[LOCKSTEP_LANES];
+  uint32_t run;
+  uint16_t until;
+  int leader;
+
+  for (int l = 0; l < ls->lanes; l++) {
+    lockstep_core_load(ls, l);
+  }
+
+  while ((leader = lockstep_select(ls, mask, &run, &until)) != -1) {
+    while (lockstep_step(ls, leader, mask) && --run > 0 &&
+      ls->pc[leader] != until) {
+      /* Straight on with the same group. */
+    }
+  }
+
+  for (int l = 0; l < ls->lanes; l++) {
+    lockstep_core_store(ls, l);
+  }
+}
+
+
+
@@ -0,0 +1,35 @@
+#ifndef _LOCKSTEP_H
+#define _LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pic.h"
+
+#define LOCKSTEP_LANES 16
+
+/* Core state of up to LOCKSTEP_LANES instances running the same program,
+ * laid out with the lanes innermost. The special function registers,
+ * hooks and memories stay in each lane's own pic_t. */
+typedef struct lockstep_s {
+  uint16_t pc[LOCKSTEP_LANES];
+  uint32_t cycle[LOCKSTEP_LANES];
+  uint32_t stop[LOCKSTEP_LANES]; /* Lane stops once cycle reaches this. */
+  uint8_t w[LOCKSTEP_LANES];
+  uint8_t status[LOCKSTEP_LANES];
+  uint8_t fsr[LOCKSTEP_LANES];
+  uint8_t pclath[LOCKSTEP_LANES];
+  uint8_t sp[LOCKSTEP_LANES];
+  uint8_t panic[LOCKSTEP_LANES];
+  uint16_t stack[PIC_STACK_SIZE][LOCKSTEP_LANES];
+  uint8_t r[PIC_REGISTER_MAX][LOCKSTEP_LANES];
+  const uint16_t *program[LOCKSTEP_LANES]; /* Changes on a program write. */
+  pic_t *pic[LOCKSTEP_LANES];
+  int lanes;
+} lockstep_t;
+
+void lockstep_init(lockstep_t *ls);
+int lockstep_add(lockstep_t *ls, pic_t *pic);
+void lockstep_sync(lockstep_t *ls, int lane);
+void lockstep_run(lockstep_t *ls);
+
+#endif /* _LOCKSTEP_H */
@@ -1,5 +1,5 @@
+#include <getopt.h>
 #include <signal.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -10,30 +10,123 @@
 #include "pic.h"
 #include "mem.h"
 #include "chipview.h"
+#include "gdb.h"
 #include "aegl.h"
+#include "shm.h"
+#include "state.h"
+#include "rewind.h"
+#include "replay.h"
+#include "stimulus.h"
+#include "trace.h"
+#include "vcd.h"
+
+#define EVENTS_HORIZON INT32_MAX
 
 static pic_t pic;
 static mem_t mem;
+static aegl_t aegl;
 
 static int32_t debugger_breakpoint = -1;
 static bool debugger_break = false;
-static char panic_msg[80];
+static char *save_state_filename = NULL;
+static bool aegl_mode = false;
+static bool rewind_enabled = false;
+static bool replay_enabled = false;
+static stimulus_t stimulus;
+static bool stimulus_enabled = false;
+static bool shm_enabled = false;
+static bool gdb_enabled = false;
+static uint32_t eeprom_sync_interval = 0;
+static uint32_t eeprom_sync_next = 0;
 
 
 
-void panic(const char *format, ...)
+static void panic_break(pic_t *pic, void *user)
 {
-  va_list args;
-
-  va_start(args, format);
-  vsnprintf(panic_msg, sizeof(panic_msg), format, args);
-  va_end(args);
+  (void)pic;
+  (void)user;
 
   debugger_break = true;
 }
 
 
 
+/* Event deadlines are absolute cycles that wrap around with pic.cycle.
+ * Every source returns one at or after the current cycle, so the nearest
+ * is the one with the smallest distance from it, and anything further
+ * out than EVENTS_HORIZON waits for the next pass. */
+static void events_next(uint32_t *next, uint32_t cycle)
+{
+  if (cycle - pic.cycle < *next - pic.cycle) {
+    *next = cycle;
+  }
+}
+
+
+
+static bool events_due(uint32_t cycle)
+{
+  return (int32_t)(pic.cycle - cycle) >= 0;
+}
+
+
+
+static uint32_t events_run(void)
+{
+  uint32_t next = pic.cycle + EVENTS_HORIZON;
+
+  if (replay_enabled) {
+    events_next(&next, replay_apply(&pic));
+  }
+
+  if (stimulus_enabled) {
+    events_next(&next, stimulus_apply(&stimulus, &pic));
+  }
+
+  if (shm_enabled) {
+    events_next(&next, shm_update(&pic));
+  }
+
+  if (gdb_enabled) {
+    events_next(&next, gdb_poll(&pic));
+  }
+
+  if (eeprom_sync_interval > 0) {
+    if (events_due(eeprom_sync_next)) {
+      if (mem_eeprom_sync(&mem) != 0) {
+        fprintf(stderr, "Unable to write back EEPROM file\n");
+      }
+      eeprom_sync_next = pic.cycle + eeprom_sync_interval;
+    }
+    events_next(&next, eeprom_sync_next);
+  }
+
+  if (! aegl_mode) {
+    events_next(&next, chipview_input_apply(&pic));
+  }
+
+  return next;
+}
+
+
+
+static void save_state(void)
+{
+  if (state_save(&pic, &mem, aegl_mode ? &aegl : NULL,
+    save_state_filename) != 0) {
+    fprintf(stderr, "Unable to save state file: %s\n", save_state_filename);
+  }
+}
+
+
+
+static void eeprom_close(void)
+{
+  mem_eeprom_close(&mem);
+}
+
+
+
 static void sig_handler(int sig)
 {
   switch (sig) {
@@ -48,6 +141,7 @@ static void sig_handler(int sig)
 static bool debugger(void)
 {
   char cmd[16];
+  char filename[16];
   int value;
 
   fprintf(stdout, "\n");
@@ -72,8 +166,11 @@ static bool debugger(void)
       fprintf(stdout, "  b <addr> - Breakpoint\n");
       fprintf(stdout, "  t        - Dump PIC Trace\n");
       fprintf(stdout, "  r        - Dump PIC Registers\n");
+      fprintf(stdout, "  rs       - Reverse step\n");
+      fprintf(stdout, "  rc       - Reverse continue\n");
       fprintf(stdout, "  p        - Dump PIC Ports\n");
       fprintf(stdout, "  e        - Dump PIC EEPROM\n");
+      fprintf(stdout, "  l <file> - Dump LCD as PBM (AE-GraphicLCD mode)\n");
       fprintf(stdout, "  A <hex>  - Set input on port A\n");
       fprintf(stdout, "  B <hex>  - Set input on port B\n");
       fprintf(stdout, "  C <hex>  - Set input on port C\n");
@@ -104,11 +201,22 @@ static bool debugger(void)
       break;
 
     case 't':
-      pic_trace_dump(stdout);
+      pic_trace_dump(&pic, stdout);
       break;
 
     case 'r':
-      pic_reg_dump(&pic, stdout);
+      if (cmd[1] == 's' || cmd[1] == 'c') {
+        if (! rewind_enabled) {
+          fprintf(stdout, "Reverse execution not enabled\n");
+        } else if (cmd[1] == 's' && ! rewind_step_back(&pic)) {
+          fprintf(stdout, "No more history\n");
+        } else if (cmd[1] == 'c' &&
+          ! rewind_continue_back(&pic, debugger_breakpoint)) {
+          fprintf(stdout, "No more history\n");
+        }
+      } else {
+        pic_reg_dump(&pic, stdout);
+      }
       break;
 
     case 'p':
@@ -119,37 +227,50 @@ static bool debugger(void)
       mem_eeprom_dump(&mem, stdout);
       break;
 
+    case 'l':
+      if (aegl_mode) {
+        if (sscanf(&cmd[1], "%15s", filename) != 1) {
+          strncpy(filename, "lcd.pbm", sizeof(filename));
+        }
+        if (aegl_lcd_dump(&aegl, filename) == 0) {
+          fprintf(stdout, "LCD dumped to: %s\n", filename);
+        } else {
+          fprintf(stdout, "Unable to dump LCD to: %s\n", filename);
+        }
+      }
+      break;
+
     case 'A':
       if (sscanf(&cmd[1], "%2x", &value) == 1) {
-        pic.in_porta = value;
+        pic_port_input_set(&pic, 0, value);
         fprintf(stdout, "Port A input set to 0x%02x\n", value);
       }
       break;
 
     case 'B':
       if (sscanf(&cmd[1], "%2x", &value) == 1) {
-        pic.in_portb = value;
+        pic_port_input_set(&pic, 1, value);
         fprintf(stdout, "Port B input set to 0x%02x\n", value);
       }
       break;
 
     case 'C':
       if (sscanf(&cmd[1], "%2x", &value) == 1) {
-        pic.in_portc = value;
+        pic_port_input_set(&pic, 2, value);
         fprintf(stdout, "Port C input set to 0x%02x\n", value);
       }
       break;
 
     case 'D':
       if (sscanf(&cmd[1], "%2x", &value) == 1) {
-        pic.in_portd = value;
+        pic_port_input_set(&pic, 3, value);
         fprintf(stdout, "Port D input set to 0x%02x\n", value);
       }
       break;
 
     case 'E':
       if (sscanf(&cmd[1], "%2x", &value) == 1) {
-        pic.in_porte = value;
+        pic_port_input_set(&pic, 4, value);
         fprintf(stdout, "Port E input set to 0x%02x\n", value);
       }
       break;
@@ -165,28 +286,122 @@ static bool debugger(void)
 static void display_help(const char *progname)
 {
   fprintf(stdout, "Usage: %s <options> [hex-file]\n", progname);
+  fprintf(stdout, "       %s --compile-image <hex-file> <image-file>\n",
+    progname);
   fprintf(stdout, "Options:\n"
-    "  -h        Display this help.\n"
-    "  -d        Break into debugger on start.\n"
-    "  -a        AE-GraphicLCD trace and command mode.\n"
+    "  -h                Display this help.\n"
+    "  -d                Break into debugger on start.\n"
+    "  -a                AE-GraphicLCD trace and command mode.\n"
+    "  --save-state FILE Save checkpoint to FILE on exit.\n"
+    "  --load-state FILE Start from checkpoint in FILE instead of HEX file.\n"
+    "  --rewind KB       Keep KB kilobytes of history for reverse execution.\n"
+    "  --record FILE     Record all external inputs to FILE.\n"
+    "  --replay FILE     Replay external inputs from FILE.\n"
+    "  --stimulus FILE   Apply cycle stamped port input changes from FILE.\n"
+    "  --vcd FILE        Write port pin and TRIS waveforms to VCD FILE.\n"
+    "  --shm NAME        Publish live state in POSIX shared memory NAME.\n"
+    "  --shm-interval N  Update the shared memory every N cycles.\n"
+    "  --gdb PORT|PATH   Wait for GDB on local TCP PORT or Unix socket PATH.\n"
+    "  --lcd-trace       Print LCD pin changes (AE-GraphicLCD mode).\n"
+    "  --trace FILE      Write AE-GraphicLCD traces to binary FILE.\n"
+    "  --lcd-dump PREFIX Dump LCD frames as PBM files named PREFIX<n>.pbm.\n"
+    "  --lcd-dump-every N  Only dump every N frames.\n"
+    "  --eeprom FILE     Keep the data EEPROM in FILE across runs.\n"
+    "  --eeprom-sync N   Also write EEPROM changes back every N cycles.\n"
+    "  --i2c-eeprom FILE Back the I2C serial EEPROM with image FILE.\n"
+    "  --i2c-size BYTES  Size of a new I2C serial EEPROM image.\n"
+    "  --script FILE     Feed UART commands from FILE and report throughput.\n"
+    "  --compile-image   Convert HEX file to a predecoded binary image.\n"
+    "  --no-predecode    Leave the decoded section out of the image.\n"
     "\n");
   fprintf(stdout,
-    "HEX file should be in Intel format with PIC program and EEPROM data.\n"
+    "HEX file should be in Intel format with PIC program, EEPROM data and\n"
+    "config words. Files with bad checksums or records are rejected.\n"
+    "A binary image from --compile-image can be given instead, which is\n"
+    "mapped directly without any parsing.\n"
     "\n");
 }
 
 
 
+enum {
+  OPT_SAVE_STATE = 256,
+  OPT_LOAD_STATE,
+  OPT_REWIND,
+  OPT_RECORD,
+  OPT_REPLAY,
+  OPT_STIMULUS,
+  OPT_VCD,
+  OPT_SHM,
+  OPT_SHM_INTERVAL,
+  OPT_GDB,
+  OPT_LCD_TRACE,
+  OPT_LCD_DUMP,
+  OPT_LCD_DUMP_EVERY,
+  OPT_I2C_EEPROM,
+  OPT_I2C_SIZE,
+  OPT_SCRIPT,
+  OPT_TRACE,
+  OPT_COMPILE_IMAGE,
+  OPT_EEPROM,
+  OPT_EEPROM_SYNC,
+  OPT_NO_PREDECODE,
+};
+
+static const struct option long_options[] = {
+  {"save-state", required_argument, NULL, OPT_SAVE_STATE},
+  {"load-state", required_argument, NULL, OPT_LOAD_STATE},
+  {"rewind", required_argument, NULL, OPT_REWIND},
+  {"record", required_argument, NULL, OPT_RECORD},
+  {"replay", required_argument, NULL, OPT_REPLAY},
+  {"stimulus", required_argument, NULL, OPT_STIMULUS},
+  {"vcd", required_argument, NULL, OPT_VCD},
+  {"shm", required_argument, NULL, OPT_SHM},
+  {"shm-interval", required_argument, NULL, OPT_SHM_INTERVAL},
+  {"gdb", required_argument, NULL, OPT_GDB},
+  {"lcd-trace", no_argument, NULL, OPT_LCD_TRACE},
+  {"lcd-dump", required_argument, NULL, OPT_LCD_DUMP},
+  {"lcd-dump-every", required_argument, NULL, OPT_LCD_DUMP_EVERY},
+  {"i2c-eeprom", required_argument, NULL, OPT_I2C_EEPROM},
+  {"i2c-size", required_argument, NULL, OPT_I2C_SIZE},
+  {"script", required_argument, NULL, OPT_SCRIPT},
+  {"trace", required_argument, NULL, OPT_TRACE},
+  {"eeprom", required_argument, NULL, OPT_EEPROM},
+  {"eeprom-sync", required_argument, NULL, OPT_EEPROM_SYNC},
+  {"compile-image", no_argument, NULL, OPT_COMPILE_IMAGE},
+  {"no-predecode", no_argument, NULL, OPT_NO_PREDECODE},
+  {NULL, 0, NULL, 0},
+};
+
+
+
 int main(int argc, char *argv[])
 {
   int c;
   char *hex_filename = NULL;
-  bool aegl_mode = false;
+  char *load_state_filename = NULL;
+  size_t rewind_budget = 0;
+  char *record_filename = NULL;
+  char *replay_filename = NULL;
+  char *vcd_filename = NULL;
+  bool lcd_trace = false;
+  char *lcd_dump_prefix = NULL;
+  uint32_t lcd_dump_every = 1;
+  char *i2c_eeprom_filename = NULL;
+  size_t i2c_size = I2C_EEPROM_DEFAULT_SIZE;
+  char *script_filename = NULL;
+  char *trace_filename = NULL;
+  char *shm_name = NULL;
+  uint32_t shm_interval = SHM_DEFAULT_INTERVAL;
+  char *gdb_address = NULL;
+  char *eeprom_filename = NULL;
+  uint32_t event_cycle = 0;
+  bool compile_image = false;
+  bool predecode = true;
 
-  panic_msg[0] = '\0';
   signal(SIGINT, sig_handler);
 
-  while ((c = getopt(argc, argv, "hda")) != -1) {
+  while ((c = getopt_long(argc, argv, "hda", long_options, NULL)) != -1) {
     switch (c) {
     case 'h':
       display_help(argv[0]);
@@ -200,6 +415,95 @@ int main(int argc, char *argv[])
       aegl_mode = true;
       break;
 
+    case OPT_SAVE_STATE:
+      save_state_filename = optarg;
+      break;
+
+    case OPT_LOAD_STATE:
+      load_state_filename = optarg;
+      break;
+
+    case OPT_REWIND:
+      rewind_budget = strtoul(optarg, NULL, 10) * 1024;
+      break;
+
+    case OPT_RECORD:
+      record_filename = optarg;
+      break;
+
+    case OPT_REPLAY:
+      replay_filename = optarg;
+      break;
+
+    case OPT_VCD:
+      vcd_filename = optarg;
+      break;
+
+    case OPT_LCD_TRACE:
+      lcd_trace = true;
+      break;
+
+    case OPT_LCD_DUMP:
+      lcd_dump_prefix = optarg;
+      break;
+
+    case OPT_LCD_DUMP_EVERY:
+      lcd_dump_every = strtoul(optarg, NULL, 10);
+      break;
+
+    case OPT_I2C_EEPROM:
+      i2c_eeprom_filename = optarg;
+      break;
+
+    case OPT_I2C_SIZE:
+      i2c_size = strtoul(optarg, NULL, 0);
+      break;
+
+    case OPT_SCRIPT:
+      script_filename = optarg;
+      aegl_mode = true; /* Script commands only make sense for aegl.hex. */
+      break;
+
+    case OPT_SHM:
+      shm_name = optarg;
+      break;
+
+    case OPT_SHM_INTERVAL:
+      shm_interval = strtoul(optarg, NULL, 0);
+      break;
+
+    case OPT_GDB:
+      gdb_address = optarg;
+      break;
+
+    case OPT_TRACE:
+      trace_filename = optarg;
+      break;
+
+    case OPT_EEPROM:
+      eeprom_filename = optarg;
+      break;
+
+    case OPT_EEPROM_SYNC:
+      eeprom_sync_interval = strtoul(optarg, NULL, 0);
+      break;
+
+    case OPT_COMPILE_IMAGE:
+      compile_image = true;
+      break;
+
+    case OPT_NO_PREDECODE:
+      predecode = false;
+      break;
+
+    case OPT_STIMULUS:
+      if (stimulus_load(&stimulus, optarg) != 0) {
+        fprintf(stderr, "Unable to load stimulus file: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      stimulus_enabled = true;
+      break;
+
     case '?':
     default:
       display_help(argv[0]);
@@ -207,42 +511,189 @@ int main(int argc, char *argv[])
     }
   }
 
-  mem_init(&mem);
-  pic_trace_init();
+  if (mem_init(&mem) != 0) {
+    fprintf(stderr, "Unable to allocate program memory\n");
+    return EXIT_FAILURE;
+  }
   pic_init(&pic, &mem);
+  pic.panic_hook = panic_break;
+  if (pic_trace_init(&pic) != 0) {
+    fprintf(stderr, "Unable to allocate trace buffer\n");
+    return EXIT_FAILURE;
+  }
 
-  if (argc <= optind) {
+  if (record_filename != NULL && replay_filename != NULL) {
     display_help(argv[0]);
     return EXIT_FAILURE;
+  }
+
+  if (compile_image) {
+    if (argc - optind != 2) {
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (mem_load(&mem, argv[optind]) != 0) {
+      fprintf(stderr, "Unable to load HEX file: %s\n", argv[optind]);
+      return EXIT_FAILURE;
+    }
+    if (predecode) {
+      pic_predecode(&mem);
+    }
+    if (mem_image_save(&mem, argv[optind + 1], predecode) != 0) {
+      fprintf(stderr, "Unable to write image file: %s\n", argv[optind + 1]);
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  if (argc <= optind) {
+    if (load_state_filename == NULL) {
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
   } else {
     hex_filename = argv[optind];
   }
 
-  if (mem_load(&mem, hex_filename) != 0) {
-    fprintf(stderr, "Unable to load HEX file: %s\n", hex_filename);
-    return EXIT_FAILURE;
+  if (hex_filename != NULL && load_state_filename == NULL) {
+    if (mem_load(&mem, hex_filename) != 0) {
+      fprintf(stderr, "Unable to load HEX file: %s\n", hex_filename);
+      return EXIT_FAILURE;
+    }
   }
 
   if (aegl_mode) {
-    aegl_init(&pic);
-  } else {
+    if (trace_open(trace_filename) != 0) {
+      fprintf(stderr, "Unable to open trace file: %s\n",
+        trace_filename != NULL ? trace_filename : "stdout");
+      return EXIT_FAILURE;
+    }
+    aegl_init(&aegl, &pic);
+    aegl_lcd_trace(&aegl, lcd_trace);
+    aegl_lcd_dump_frames(&aegl, lcd_dump_prefix, lcd_dump_every);
+    if (i2c_eeprom_filename != NULL) {
+      if (aegl_i2c_eeprom(&aegl, i2c_eeprom_filename, i2c_size) != 0) {
+        fprintf(stderr, "Unable to open I2C EEPROM image: %s\n",
+          i2c_eeprom_filename);
+        return EXIT_FAILURE;
+      }
+    }
+    if (script_filename != NULL) {
+      if (aegl_script(&aegl, script_filename) != 0) {
+        fprintf(stderr, "Unable to load script file: %s\n", script_filename);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  /* Checkpoint restores over any defaults set by the peripheral init. */
+  if (load_state_filename != NULL) {
+    if (state_load(&pic, &mem, aegl_mode ? &aegl : NULL,
+      load_state_filename) != 0) {
+      fprintf(stderr, "Unable to load state file: %s\n",
+        load_state_filename);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* Opened after the checkpoint, so that the backing file content takes
+   * precedence over both the HEX file and checkpoint EEPROM data. */
+  if (eeprom_filename != NULL) {
+    if (mem_eeprom_open(&mem, eeprom_filename) != 0) {
+      fprintf(stderr, "Unable to open EEPROM file: %s\n", eeprom_filename);
+      return EXIT_FAILURE;
+    }
+    atexit(eeprom_close);
+  }
+
+  if (save_state_filename != NULL) {
+    atexit(save_state);
+  }
+
+  if (record_filename != NULL) {
+    if (replay_record_open(&pic, record_filename) != 0) {
+      fprintf(stderr, "Unable to open record file: %s\n", record_filename);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (replay_filename != NULL) {
+    if (replay_play_open(&pic, replay_filename) != 0) {
+      fprintf(stderr, "Unable to open replay file: %s\n", replay_filename);
+      return EXIT_FAILURE;
+    }
+    if (aegl_mode) {
+      aegl_uart_input(&aegl, NULL); /* UART input comes from the log instead. */
+    }
+    replay_enabled = true;
+  }
+
+  if (rewind_budget > 0) {
+    if (rewind_init(&pic, aegl_mode ? &aegl : NULL, rewind_budget) != 0) {
+      fprintf(stderr, "Unable to allocate reverse execution history\n");
+      return EXIT_FAILURE;
+    }
+    rewind_enabled = true;
+  }
+
+  if (shm_name != NULL) {
+    if (shm_open_window(&pic, shm_name, shm_interval) != 0) {
+      fprintf(stderr, "Unable to open shared memory: %s\n", shm_name);
+      return EXIT_FAILURE;
+    }
+    shm_enabled = true;
+  }
+
+  if (! aegl_mode) {
     chipview_init(&pic);
     chipview_update(&pic);
   }
 
+  /* Installed last, since it passes writes on to the peripheral hook. */
+  if (vcd_filename != NULL) {
+    if (vcd_init(&pic, vcd_filename) != 0) {
+      fprintf(stderr, "Unable to open VCD file: %s\n", vcd_filename);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* Last, so GDB sees the fully set up emulator from the start. */
+  if (gdb_address != NULL) {
+    if (gdb_init(&pic, gdb_address) != 0) {
+      fprintf(stderr, "Unable to wait for GDB on: %s\n", gdb_address);
+      return EXIT_FAILURE;
+    }
+    gdb_enabled = true;
+  }
+
+  /* A checkpoint may have started the cycle count anywhere. */
+  event_cycle = pic.cycle;
+  eeprom_sync_next = pic.cycle;
   while (1) {
+    if (events_due(event_cycle)) {
+      event_cycle = events_run();
+    }
+
     pic_execute(&pic, &mem);
+    if (rewind_enabled) {
+      rewind_step(&pic);
+    }
+
+    if (gdb_enabled) {
+      gdb_step(&pic);
+    }
 
     if (pic.pc == debugger_breakpoint) {
-      strncpy(panic_msg, "Break\n", sizeof(panic_msg));
+      strncpy(pic.panic_msg, "Break\n", sizeof(pic.panic_msg));
       debugger_break = true;
     }
 
     if (debugger_break) {
+      trace_sync();
       chipview_pause();
-      if (panic_msg[0] != '\0') {
-        fprintf(stdout, "%s", panic_msg);
-        panic_msg[0] = '\0';
+      if (pic.panic_msg[0] != '\0') {
+        fprintf(stdout, "%s", pic.panic_msg);
+        pic.panic_msg[0] = '\0';
       }
       debugger_break = debugger();
       if (! debugger_break) {
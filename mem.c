@@ -1,79 +1,540 @@
 #include "mem.h"
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+/* Intel HEX loader. The file is mapped and parsed in place with a lookup
+ * table for the hex digits. Every record checksum is verified, and any
+ * malformed record rejects the whole file. Addresses in the file are byte
+ * addresses, so the 14-bit words, config words at 0x2000 and EEPROM data
+ * at 0x2100 appear at twice their word address.
+ */
 
+#define X -1
+static const int8_t mem_hex_digit[256] = {
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+  X,10,11,12,13,14,15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X,10,11,12,13,14,15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
 
-void mem_init(mem_t *mem)
+/* Binary program image layout, all values in host (little) endian order:
+ *
+ *   mem_image_header_t
+ *   uint16_t program[MEM_PROGRAM_MAX]
+ *   uint8_t decoded[MEM_PROGRAM_MAX], only if MEM_IMAGE_DECODED is set
+ *   uint8_t eeprom[MEM_EEPROM_MAX]
+ *   uint16_t config[MEM_CONFIG_MAX]
+ *
+ * The image is mapped private and writable, so the program and decoded
+ * sections are used in place and stay shared through the page cache
+ * between all emulator instances running it, until something writes to
+ * program memory.
+ */
+
+#define MEM_IMAGE_MAGIC "PIC16IMG"
+#define MEM_IMAGE_VERSION 2
+#define MEM_IMAGE_DECODED 0x01
+#define MEM_IMAGE_EEPROM 0x02 /* The HEX file had EEPROM data. */
+
+typedef struct mem_image_header_s {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t hash; /* FNV-1a of all sections, in file order. */
+  uint32_t program_offset;
+  uint32_t decoded_offset;
+  uint32_t eeprom_offset;
+  uint32_t config_offset;
+  uint32_t size;
+  uint32_t reserved[5];
+} mem_image_header_t;
+
+
+
+static mem_program_t *mem_program_alloc(bool words)
+{
+  mem_program_t *program;
+  size_t size;
+
+  size = sizeof(mem_program_t) + MEM_PROGRAM_MAX;
+  if (words) {
+    size += MEM_PROGRAM_MAX * sizeof(uint16_t);
+  }
+
+  program = calloc(1, size);
+  if (program == NULL) {
+    return NULL;
+  }
+
+  program->refs = 1;
+  program->decoded = (uint8_t *)(program + 1);
+  if (words) {
+    program->word = (uint16_t *)(program->decoded + MEM_PROGRAM_MAX);
+  }
+  return program;
+}
+
+
+
+static void mem_program_release(mem_program_t *program)
+{
+  if (program == NULL ||
+    __atomic_sub_fetch(&program->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  if (program->map != NULL) {
+    munmap(program->map, program->map_size);
+  }
+  free(program);
+}
+
+
+
+static void mem_program_attach(mem_t *mem, mem_program_t *program)
+{
+  mem_program_release(mem->shared);
+  mem->shared = program;
+  mem->program = program->word;
+  mem->decoded = program->decoded;
+}
+
+
+
+/* Makes sure the program is not shared before it is modified. A mapped
+ * image only referenced by this mem_t is written in place, as the mapping
+ * is private. */
+static int mem_program_own(mem_t *mem)
 {
+  mem_program_t *program;
+
+  if (__atomic_load_n(&mem->shared->refs, __ATOMIC_ACQUIRE) == 1) {
+    return 0;
+  }
+
+  program = mem_program_alloc(true);
+  if (program == NULL) {
+    return -1;
+  }
+  memcpy(program->word, mem->program, MEM_PROGRAM_MAX * sizeof(uint16_t));
+  memcpy(program->decoded, mem->decoded, MEM_PROGRAM_MAX);
+  mem_program_attach(mem, program);
+  return 0;
+}
+
+
+
+int mem_init(mem_t *mem)
+{
+  mem_program_t *program;
   int i;
 
-  for (i = 0; i < MEM_PROGRAM_MAX; i++) {
-    mem->program[i] = 0x0000;
+  program = mem_program_alloc(true);
+  if (program == NULL) {
+    return -1;
   }
+
+  mem->shared = NULL;
+  mem_program_attach(mem, program);
+  mem->eeprom_fd = -1;
+  mem->eeprom_dirty_start = MEM_EEPROM_MAX;
+  mem->eeprom_dirty_end = 0;
+  mem->eeprom_loaded = false;
+
   for (i = 0; i < MEM_EEPROM_MAX; i++) {
     mem->eeprom[i] = 0x00;
   }
+  for (i = 0; i < MEM_CONFIG_MAX; i++) {
+    mem->config[i] = 0x3FFF; /* Unprogrammed. */
+  }
+  return 0;
 }
 
 
 
-int mem_load(mem_t *mem, const char *filename)
+void mem_free(mem_t *mem)
 {
-  FILE *fh;
-  char line[128];
-  uint8_t byte_count;
-  uint16_t address;
-  uint8_t record_type;
-  uint8_t data;
-  int n;
-
-  fh = fopen(filename, "r");
-  if (fh == NULL) {
+  mem_program_release(mem->shared);
+  mem->shared = NULL;
+  mem->program = NULL;
+  mem->decoded = NULL;
+}
+
+
+
+/* Initializes dst to run the program of src, with a copy of its EEPROM and
+ * config words. Both point at the same program until one changes it. */
+void mem_share(mem_t *dst, const mem_t *src)
+{
+  __atomic_add_fetch(&src->shared->refs, 1, __ATOMIC_RELAXED);
+  dst->shared = NULL;
+  mem_program_attach(dst, src->shared);
+  dst->eeprom_fd = -1;
+  dst->eeprom_dirty_start = MEM_EEPROM_MAX;
+  dst->eeprom_dirty_end = 0;
+  dst->eeprom_loaded = src->eeprom_loaded;
+  memcpy(dst->eeprom, src->eeprom, sizeof(dst->eeprom));
+  memcpy(dst->config, src->config, sizeof(dst->config));
+}
+
+
+
+static int mem_hex_byte(const char *p)
+{
+  int hi = mem_hex_digit[(uint8_t)p[0]];
+  int lo = mem_hex_digit[(uint8_t)p[1]];
+
+  if (hi < 0 || lo < 0) {
     return -1;
   }
+  return (hi << 4) | lo;
+}
+
 
-  while (fgets(line, sizeof(line), fh) != NULL) {
-    if (sscanf(line, ":%02hhx%04hx%02hhx",
-      &byte_count, &address, &record_type) != 3) {
-      continue; /* Not a Intel HEX line. */
-    }
 
-    if (record_type != 0) {
-      continue; /* Only check data records. */
+static void mem_store(mem_t *mem, uint32_t address, uint8_t data)
+{
+  uint32_t word = address / 2;
+  bool high = address & 1;
+  uint16_t *p;
+
+  if (word < MEM_PROGRAM_MAX) {
+    p = &mem->shared->word[word];
+  } else if (word >= MEM_CONFIG_BASE &&
+    word < MEM_CONFIG_BASE + MEM_CONFIG_MAX) {
+    p = &mem->config[word - MEM_CONFIG_BASE];
+  } else if (word >= MEM_EEPROM_BASE &&
+    word < MEM_EEPROM_BASE + MEM_EEPROM_MAX) {
+    if (! high) {
+      mem->eeprom[word - MEM_EEPROM_BASE] = data;
+      mem->eeprom_loaded = true;
     }
+    return;
+  } else {
+    return; /* Outside of the device, ignore. */
+  }
+
+  if (high) {
+    *p = (*p & 0x00FF) | (data << 8);
+  } else {
+    *p = (*p & 0xFF00) | data;
+  }
+}
 
-    address /= 2; /* Convert from 8-bit to 16-bit word addresses. */
 
-    /* NOTE: Checksum is not calculcated nor checked. */
 
-    if (byte_count > 16) {
-      continue; /* Byte overflow, ignore. */
+static int mem_parse(mem_t *mem, const char *p, const char *end)
+{
+  uint8_t record[5 + 255];
+  uint32_t base = 0;
+  uint32_t address;
+  uint8_t checksum;
+  int count;
+  int value;
+
+  while (p < end) {
+    if (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t') {
+      p++;
+      continue;
     }
+    if (*p != ':' || end - p < 11) {
+      return -1; /* Not a Intel HEX line. */
+    }
+    p++;
 
-    n = 9;
-    while (byte_count > 0) {
-      sscanf(&line[n], "%02hhx", &data);
-      n += 2;
-      if (address < MEM_PROGRAM_MAX) {
-        mem->program[address] = data;
-      } else if (address >= 0x2100 && address <= 0x21FF) {
-        mem->eeprom[address - 0x2100] = data;
+    /* Byte count, address, type, data and checksum. */
+    count = mem_hex_byte(p);
+    if (count < 0 || end - p < (count + 5) * 2) {
+      return -1;
+    }
+    checksum = 0;
+    for (int i = 0; i < count + 5; i++) {
+      value = mem_hex_byte(p);
+      if (value < 0) {
+        return -1;
       }
+      record[i] = value;
+      checksum += value;
+      p += 2;
+    }
+    if (checksum != 0) {
+      return -1;
+    }
+
+    address = (record[1] << 8) | record[2];
+    switch (record[3]) {
+    case 0x00: /* Data */
+      for (int i = 0; i < count; i++) {
+        mem_store(mem, base + address + i, record[4 + i]);
+      }
+      break;
+
+    case 0x01: /* End of file */
+      return 0;
 
-      sscanf(&line[n], "%02hhx", &data);
-      n += 2;
-      if (address < MEM_PROGRAM_MAX) {
-        mem->program[address] += (data << 8);
+    case 0x02: /* Extended segment address */
+      if (count != 2) {
+        return -1;
       }
+      base = ((record[4] << 8) | record[5]) << 4;
+      break;
+
+    case 0x04: /* Extended linear address */
+      if (count != 2) {
+        return -1;
+      }
+      base = ((record[4] << 8) | record[5]) << 16;
+      break;
+
+    case 0x03: /* Start segment address */
+    case 0x05: /* Start linear address */
+      break;
 
-      address++;
-      byte_count -= 2;
+    default:
+      return -1;
     }
   }
 
-  fclose(fh);
+  return -1; /* Missing end of file record. */
+}
+
+
+
+/* FNV-1a, continuing from hash, which is MEM_HASH_INIT to start with. */
+uint64_t mem_hash(uint64_t hash, const void *data, size_t size)
+{
+  const uint8_t *p = data;
+
+  for (size_t i = 0; i < size; i++) {
+    hash ^= p[i];
+    hash *= MEM_HASH_PRIME;
+  }
+  return hash;
+}
+
+
+
+/* The decoded section is NULL when it is not part of the image. */
+static uint64_t mem_image_hash(const uint16_t *program, const uint8_t *decoded,
+  const uint8_t *eeprom, const uint16_t *config)
+{
+  uint64_t hash = MEM_HASH_INIT;
+
+  hash = mem_hash(hash, program, MEM_PROGRAM_MAX * sizeof(uint16_t));
+  if (decoded != NULL) {
+    hash = mem_hash(hash, decoded, MEM_PROGRAM_MAX);
+  }
+  hash = mem_hash(hash, eeprom, MEM_EEPROM_MAX);
+  hash = mem_hash(hash, config, MEM_CONFIG_MAX * sizeof(uint16_t));
+  return hash;
+}
+
+
+
+static int mem_image_map(mem_t *mem, uint8_t *data, size_t size)
+{
+  mem_image_header_t header;
+  mem_program_t *program;
+  size_t expected;
+
+  if (size < sizeof(mem_image_header_t)) {
+    return -1;
+  }
+  memcpy(&header, data, sizeof(mem_image_header_t));
+
+  expected = sizeof(mem_image_header_t) +
+    (MEM_PROGRAM_MAX * sizeof(uint16_t)) + MEM_EEPROM_MAX +
+    (MEM_CONFIG_MAX * sizeof(uint16_t));
+  if (header.flags & MEM_IMAGE_DECODED) {
+    expected += MEM_PROGRAM_MAX;
+  }
+  if (header.version != MEM_IMAGE_VERSION || header.size != size ||
+    size != expected ||
+    header.program_offset + (MEM_PROGRAM_MAX * sizeof(uint16_t)) > size ||
+    header.eeprom_offset + MEM_EEPROM_MAX > size ||
+    header.config_offset + (MEM_CONFIG_MAX * sizeof(uint16_t)) > size ||
+    ((header.flags & MEM_IMAGE_DECODED) &&
+    header.decoded_offset + MEM_PROGRAM_MAX > size) ||
+    (header.program_offset % sizeof(uint16_t)) != 0 ||
+    (header.config_offset % sizeof(uint16_t)) != 0) {
+    return -1;
+  }
+
+  if (mem_image_hash((uint16_t *)(data + header.program_offset),
+    (header.flags & MEM_IMAGE_DECODED) ? data + header.decoded_offset : NULL,
+    data + header.eeprom_offset,
+    (uint16_t *)(data + header.config_offset)) != header.hash) {
+    return -1;
+  }
+
+  program = mem_program_alloc(false);
+  if (program == NULL) {
+    return -1;
+  }
+  program->word = (uint16_t *)(data + header.program_offset);
+  if (header.flags & MEM_IMAGE_DECODED) {
+    program->decoded = data + header.decoded_offset;
+  } /* Otherwise decoded on first use, in the allocated cache. */
+  program->map = data;
+  program->map_size = size;
+  mem_program_attach(mem, program);
+
+  memcpy(mem->eeprom, data + header.eeprom_offset, MEM_EEPROM_MAX);
+  mem->eeprom_loaded = (header.flags & MEM_IMAGE_EEPROM) != 0;
+  memcpy(mem->config, data + header.config_offset,
+    MEM_CONFIG_MAX * sizeof(uint16_t));
+  return 0;
+}
+
+
+
+int mem_load(mem_t *mem, const char *filename)
+{
+  struct stat st;
+  void *data;
+  int result;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+
+  /* Writable private mapping, so a program image can be used in place. */
+  data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+
+  if (st.st_size >= 8 && memcmp(data, MEM_IMAGE_MAGIC, 8) == 0) {
+    result = mem_image_map(mem, data, st.st_size);
+    if (result != 0) {
+      munmap(data, st.st_size);
+    }
+    return result;
+  }
+
+  if (mem_program_own(mem) != 0) {
+    munmap(data, st.st_size);
+    return -1;
+  }
+  result = mem_parse(mem, data, (const char *)data + st.st_size);
+  munmap(data, st.st_size);
+  mem_invalidate(mem);
+  return result;
+}
+
+
+
+int mem_image_save(mem_t *mem, const char *filename, bool decoded)
+{
+  mem_image_header_t header;
+  FILE *fh;
+  int result = 0;
+
+  memset(&header, 0, sizeof(mem_image_header_t));
+  memcpy(header.magic, MEM_IMAGE_MAGIC, 8);
+  header.version = MEM_IMAGE_VERSION;
+  header.flags = decoded ? MEM_IMAGE_DECODED : 0;
+  if (mem->eeprom_loaded) {
+    header.flags |= MEM_IMAGE_EEPROM;
+  }
+  header.hash = mem_image_hash(mem->program, decoded ? mem->decoded : NULL,
+    mem->eeprom, mem->config);
+  header.program_offset = sizeof(mem_image_header_t);
+  header.size = header.program_offset + (MEM_PROGRAM_MAX * sizeof(uint16_t));
+  if (decoded) {
+    header.decoded_offset = header.size;
+    header.size += MEM_PROGRAM_MAX;
+  }
+  header.eeprom_offset = header.size;
+  header.size += MEM_EEPROM_MAX;
+  header.config_offset = header.size;
+  header.size += MEM_CONFIG_MAX * sizeof(uint16_t);
+
+  fh = fopen(filename, "wb");
+  if (fh == NULL) {
+    return -1;
+  }
+
+  if (fwrite(&header, sizeof(mem_image_header_t), 1, fh) != 1 ||
+    fwrite(mem->program, sizeof(uint16_t), MEM_PROGRAM_MAX, fh) !=
+    MEM_PROGRAM_MAX ||
+    (decoded && fwrite(mem->decoded, 1, MEM_PROGRAM_MAX, fh) !=
+    MEM_PROGRAM_MAX) ||
+    fwrite(mem->eeprom, 1, MEM_EEPROM_MAX, fh) != MEM_EEPROM_MAX ||
+    fwrite(mem->config, sizeof(uint16_t), MEM_CONFIG_MAX, fh) !=
+    MEM_CONFIG_MAX) {
+    result = -1;
+  }
+
+  if (fclose(fh) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+
+
+int mem_program_set(mem_t *mem, uint16_t address, uint16_t word)
+{
+  if (mem_program_own(mem) != 0) {
+    return -1;
+  }
+
+  address %= MEM_PROGRAM_MAX;
+  mem->shared->word[address] = word;
+  mem->decoded[address] = 0; /* Decoded again on next fetch. */
+  return 0;
+}
+
+
+
+int mem_program_load(mem_t *mem, const void *words)
+{
+  if (mem_program_own(mem) != 0) {
+    return -1;
+  }
+
+  memcpy(mem->shared->word, words, MEM_PROGRAM_MAX * sizeof(uint16_t));
+  return mem_invalidate(mem);
+}
+
+
+
+int mem_invalidate(mem_t *mem)
+{
+  if (mem_program_own(mem) != 0) {
+    return -1;
+  }
+
+  memset(mem->decoded, 0, MEM_PROGRAM_MAX);
   return 0;
 }
 
@@ -94,3 +555,108 @@ void mem_eeprom_dump(mem_t *mem, FILE *fh)
 
 
 
+/* The EEPROM backing file is read once on open, and afterwards only the
+ * range of bytes changed since the last sync is written back, on exit or
+ * on the checkpoint interval. A new file is created from the EEPROM data
+ * of the HEX file or checkpoint, or erased to 0xFF if there was none, while
+ * an existing file takes precedence over it.
+ */
+int mem_eeprom_open(mem_t *mem, const char *filename)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  if (st.st_size == 0) {
+    if (! mem->eeprom_loaded) {
+      memset(mem->eeprom, 0xFF, MEM_EEPROM_MAX);
+    }
+    mem->eeprom_fd = fd;
+    mem_eeprom_dirty(mem, 0, MEM_EEPROM_MAX);
+    return mem_eeprom_sync(mem);
+  }
+
+  if (st.st_size != MEM_EEPROM_MAX ||
+    pread(fd, mem->eeprom, MEM_EEPROM_MAX, 0) != MEM_EEPROM_MAX) {
+    close(fd);
+    return -1;
+  }
+
+  mem->eeprom_fd = fd;
+  mem->eeprom_dirty_start = MEM_EEPROM_MAX;
+  mem->eeprom_dirty_end = 0;
+  return 0;
+}
+
+
+
+void mem_eeprom_write(mem_t *mem, uint8_t address, uint8_t value)
+{
+  if (mem->eeprom[address] != value) {
+    mem->eeprom[address] = value;
+    mem_eeprom_dirty(mem, address, address + 1);
+  }
+}
+
+
+
+void mem_eeprom_dirty(mem_t *mem, uint16_t start, uint16_t end)
+{
+  if (start < mem->eeprom_dirty_start) {
+    mem->eeprom_dirty_start = start;
+  }
+  if (end > mem->eeprom_dirty_end) {
+    mem->eeprom_dirty_end = end;
+  }
+}
+
+
+
+int mem_eeprom_sync(mem_t *mem)
+{
+  size_t size;
+  ssize_t n;
+
+  if (mem->eeprom_fd == -1 ||
+    mem->eeprom_dirty_start >= mem->eeprom_dirty_end) {
+    return 0;
+  }
+
+  size = mem->eeprom_dirty_end - mem->eeprom_dirty_start;
+  n = pwrite(mem->eeprom_fd, &mem->eeprom[mem->eeprom_dirty_start], size,
+    mem->eeprom_dirty_start);
+  if (n < 0 || (size_t)n != size) {
+    return -1;
+  }
+
+  mem->eeprom_dirty_start = MEM_EEPROM_MAX;
+  mem->eeprom_dirty_end = 0;
+  return 0;
+}
+
+
+
+void mem_eeprom_close(mem_t *mem)
+{
+  if (mem->eeprom_fd == -1) {
+    return;
+  }
+
+  if (mem_eeprom_sync(mem) != 0) {
+    fprintf(stderr, "Unable to write back EEPROM file\n");
+  }
+  close(mem->eeprom_fd);
+  mem->eeprom_fd = -1;
+}
+
+
+
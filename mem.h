@@ -1,19 +1,59 @@
 #ifndef _MEM_H
 #define _MEM_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #define MEM_PROGRAM_MAX 0x2000
 #define MEM_EEPROM_MAX 0x100
+#define MEM_CONFIG_BASE 0x2000 /* User IDs, device ID and config words. */
+#define MEM_CONFIG_MAX 0x10
+#define MEM_CONFIG_WORD1 0x07
+#define MEM_CONFIG_WORD2 0x08
+#define MEM_EEPROM_BASE 0x2100 /* EEPROM data location in HEX files. */
+#define MEM_HASH_INIT 0xCBF29CE484222325ULL /* FNV-1a offset basis. */
+#define MEM_HASH_PRIME 0x100000001B3ULL
+
+/* Program words with their decode cache, reference counted and shared by
+ * every mem_t running the same program. A mem_t gets its own copy before
+ * changing a shared program, so it is never modified while shared. It
+ * should be fully decoded before being shared between threads. */
+typedef struct mem_program_s {
+  uint32_t refs;
+  uint16_t *word;
+  uint8_t *decoded;
+  void *map; /* Mapped image file, or NULL. */
+  size_t map_size;
+} mem_program_t;
 
 typedef struct mem_s {
-  uint16_t program[MEM_PROGRAM_MAX];
+  const uint16_t *program; /* Words of the shared program. */
+  uint8_t *decoded; /* Cached instruction class per word, 0 if unknown. */
+  mem_program_t *shared;
   uint8_t eeprom[MEM_EEPROM_MAX];
+  uint16_t config[MEM_CONFIG_MAX];
+  int eeprom_fd; /* Backing file, or -1 if EEPROM is only kept in memory. */
+  uint16_t eeprom_dirty_start; /* Range not yet written back, empty if */
+  uint16_t eeprom_dirty_end;   /* start is not below end. */
+  bool eeprom_loaded; /* EEPROM data came from a HEX file or checkpoint. */
 } mem_t;
 
-void mem_init(mem_t *mem);
+int mem_init(mem_t *mem);
+void mem_free(mem_t *mem);
+void mem_share(mem_t *dst, const mem_t *src);
 int mem_load(mem_t *mem, const char *filename);
+int mem_image_save(mem_t *mem, const char *filename, bool decoded);
+int mem_program_set(mem_t *mem, uint16_t address, uint16_t word);
+int mem_program_load(mem_t *mem, const void *words);
+int mem_invalidate(mem_t *mem);
 void mem_eeprom_dump(mem_t *mem, FILE *fh);
+int mem_eeprom_open(mem_t *mem, const char *filename);
+void mem_eeprom_write(mem_t *mem, uint8_t address, uint8_t value);
+void mem_eeprom_dirty(mem_t *mem, uint16_t start, uint16_t end);
+int mem_eeprom_sync(mem_t *mem);
+void mem_eeprom_close(mem_t *mem);
+uint64_t mem_hash(uint64_t hash, const void *data, size_t size);
 
 #endif /* _MEM_H */
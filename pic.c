@@ -1,5 +1,6 @@
 #include "pic.h"
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,7 +8,6 @@
 #include <string.h>
 
 #include "mem.h"
-#include "panic.h"
 
 #define PIC_STATUS_C   0
 #define PIC_STATUS_DC  1
@@ -18,7 +18,6 @@
 #define PIC_STATUS_RP1 6
 #define PIC_STATUS_IRP 7
 
-#define PIC_TRACE_BUFFER_SIZE 512
 #define PIC_TRACE_BUFFER_ENTRY 80
 
 #define pic_status_set(x, b)   (((pic_t *)x)->r[PIC_REG_STATUS] |=  (1 << b));
@@ -27,30 +26,122 @@
 
 
 
-static char pic_trace_buffer[PIC_TRACE_BUFFER_SIZE][PIC_TRACE_BUFFER_ENTRY];
-static int pic_trace_buffer_index = 0;
+#define PIC_ARG_NONE 0
+#define PIC_ARG_K8   1 /* 8-bit literal. */
+#define PIC_ARG_K11  2 /* 11-bit address. */
+#define PIC_ARG_F    3 /* Register. */
+#define PIC_ARG_FD   4 /* Register and destination. */
+#define PIC_ARG_FB   5 /* Register and bit. */
+#define PIC_ARG_TRIS 6
+
+typedef struct pic_op_info_s {
+  const char *name;
+  uint8_t arg;
+} pic_op_info_t;
+
+static const pic_op_info_t pic_op_info[] = {
+  [PIC_OP_NOP]     = { "NOP",    PIC_ARG_NONE },
+  [PIC_OP_ADDLW]   = { "ADDLW",  PIC_ARG_K8 },
+  [PIC_OP_ADDWF]   = { "ADDWF",  PIC_ARG_FD },
+  [PIC_OP_ANDLW]   = { "ANDLW",  PIC_ARG_K8 },
+  [PIC_OP_ANDWF]   = { "ANDWF",  PIC_ARG_FD },
+  [PIC_OP_BCF]     = { "BCF",    PIC_ARG_FB },
+  [PIC_OP_BSF]     = { "BSF",    PIC_ARG_FB },
+  [PIC_OP_BTFSC]   = { "BTFSC",  PIC_ARG_FB },
+  [PIC_OP_BTFSS]   = { "BTFSS",  PIC_ARG_FB },
+  [PIC_OP_CALL]    = { "CALL",   PIC_ARG_K11 },
+  [PIC_OP_CLRF]    = { "CLRF",   PIC_ARG_F },
+  [PIC_OP_CLRW]    = { "CLRW",   PIC_ARG_NONE },
+  [PIC_OP_COMF]    = { "COMF",   PIC_ARG_FD },
+  [PIC_OP_DECF]    = { "DECF",   PIC_ARG_FD },
+  [PIC_OP_DECFSZ]  = { "DECFSZ", PIC_ARG_FD },
+  [PIC_OP_GOTO]    = { "GOTO",   PIC_ARG_K11 },
+  [PIC_OP_IORLW]   = { "IORLW",  PIC_ARG_K8 },
+  [PIC_OP_IORWF]   = { "IORWF",  PIC_ARG_FD },
+  [PIC_OP_INCF]    = { "INCF",   PIC_ARG_FD },
+  [PIC_OP_INCFSZ]  = { "INCFSZ", PIC_ARG_FD },
+  [PIC_OP_MOVF]    = { "MOVF",   PIC_ARG_FD },
+  [PIC_OP_MOVLW]   = { "MOVLW",  PIC_ARG_K8 },
+  [PIC_OP_MOVWF]   = { "MOVWF",  PIC_ARG_F },
+  [PIC_OP_RETLW]   = { "RETLW",  PIC_ARG_K8 },
+  [PIC_OP_RETURN]  = { "RETURN", PIC_ARG_NONE },
+  [PIC_OP_RLF]     = { "RLF",    PIC_ARG_FD },
+  [PIC_OP_RRF]     = { "RRF",    PIC_ARG_FD },
+  [PIC_OP_SUBLW]   = { "SUBLW",  PIC_ARG_K8 },
+  [PIC_OP_SUBWF]   = { "SUBWF",  PIC_ARG_FD },
+  [PIC_OP_SWAPF]   = { "SWAPF",  PIC_ARG_FD },
+  [PIC_OP_TRIS]    = { "TRIS",   PIC_ARG_TRIS },
+  [PIC_OP_XORLW]   = { "XORLW",  PIC_ARG_K8 },
+  [PIC_OP_XORWF]   = { "XORWF",  PIC_ARG_FD },
+  [PIC_OP_INVALID] = { "???",    PIC_ARG_NONE },
+};
+
+
+
+/* Only the raw state is recorded per instruction, the text is produced
+ * when the trace is dumped. */
+static inline void pic_trace(pic_t *pic, uint16_t opcode)
+{
+  pic_trace_entry_t *e = &pic->trace[pic->trace_index];
+
+  e->cycle = pic->cycle;
+  e->pc = pic->pc;
+  e->opcode = opcode;
+  e->w = pic->w;
+  e->status = pic->r[PIC_REG_STATUS];
+  e->sp = pic->sp;
+  pic->trace_index++;
+  if (pic->trace_index >= PIC_TRACE_BUFFER_SIZE) {
+    pic->trace_index = 0;
+    pic->trace_wrapped = true;
+  }
+}
 
 
 
-static void pic_trace(pic_t *pic, uint16_t opcode, const char *format, ...)
+int pic_disassemble(uint16_t opcode, char *buffer, size_t size)
+{
+  const pic_op_info_t *info = &pic_op_info[pic_decode(opcode)];
+  uint8_t f = opcode & 0x7F;
+
+  switch (info->arg) {
+  case PIC_ARG_K8:
+    return snprintf(buffer, size, "%s 0x%02x", info->name, opcode & 0xFF);
+  case PIC_ARG_K11:
+    return snprintf(buffer, size, "%s 0x%04x", info->name, opcode & 0x7FF);
+  case PIC_ARG_F:
+    return snprintf(buffer, size, "%s 0x%02x", info->name, f);
+  case PIC_ARG_FD:
+    return snprintf(buffer, size, "%s 0x%02x, %d", info->name, f,
+      (opcode >> 7) & 1);
+  case PIC_ARG_FB:
+    return snprintf(buffer, size, "%s 0x%02x, %d", info->name, f,
+      (opcode >> 7) & 0x7);
+  case PIC_ARG_TRIS:
+    return snprintf(buffer, size, "%s %d", info->name, opcode & 0x3);
+  default:
+    return snprintf(buffer, size, "%s", info->name);
+  }
+}
+
+
+
+static void pic_trace_format(const pic_trace_entry_t *e, FILE *fh)
 {
-  va_list args;
   char buffer[PIC_TRACE_BUFFER_ENTRY + 2];
   int i;
   int n = 0;
 
-  n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "%08x  ", pic->cycle);
-  n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "%04x  ", pic->pc);
-  n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "%04x  ", opcode);
+  n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "%08x  ", e->cycle);
+  n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "%04x  ", e->pc);
+  n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "%04x  ", e->opcode);
 
-  for (i = 0; i < pic->sp; i++) {
+  for (i = 0; i < e->sp; i++) {
     buffer[n] = '_';
     n++;
   }
 
-  va_start(args, format);
-  n += vsnprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, format, args);
-  va_end(args);
+  n += pic_disassemble(e->opcode, &buffer[n], PIC_TRACE_BUFFER_ENTRY - n);
 
   while (46 - n > 0) {
     buffer[n] = ' ';
@@ -60,54 +151,59 @@ static void pic_trace(pic_t *pic, uint16_t opcode, const char *format, ...)
     }
   }
 
-  n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "W=%02x ", pic->w);
+  n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "W=%02x ", e->w);
 
   n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "RP=%d ",
-    (pic->r[PIC_REG_STATUS] >> 5) & 3);
+    (e->status >> 5) & 3);
 
-  n += snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "%c%c%c",
-    (pic->r[PIC_REG_STATUS] >> 2) & 1 ? 'Z' : '.',
-    (pic->r[PIC_REG_STATUS] >> 1) & 1 ? 'D' : '.',
-     pic->r[PIC_REG_STATUS]       & 1 ? 'C' : '.');
+  snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "%c%c%c\n",
+    (e->status >> 2) & 1 ? 'Z' : '.',
+    (e->status >> 1) & 1 ? 'D' : '.',
+     e->status       & 1 ? 'C' : '.');
+
+  fputs(buffer, fh);
+}
 
-  snprintf(&buffer[n], PIC_TRACE_BUFFER_ENTRY - n, "\n");
 
-  strncpy(pic_trace_buffer[pic_trace_buffer_index],
-    buffer, PIC_TRACE_BUFFER_ENTRY);
-  pic_trace_buffer_index++;
-  if (pic_trace_buffer_index >= PIC_TRACE_BUFFER_SIZE) {
-    pic_trace_buffer_index = 0;
+
+/* The instruction trace is only kept for instances that ask for it. */
+int pic_trace_init(pic_t *pic)
+{
+  pic->trace = calloc(PIC_TRACE_BUFFER_SIZE, sizeof(pic_trace_entry_t));
+  if (pic->trace == NULL) {
+    return -1;
   }
+  pic->trace_index = 0;
+  pic->trace_wrapped = false;
+  return 0;
 }
 
 
 
-void pic_trace_init(void)
+void pic_trace_free(pic_t *pic)
 {
-  int i;
-
-  for (i = 0; i < PIC_TRACE_BUFFER_SIZE; i++) {
-    pic_trace_buffer[i][0] = '\0';
-  }
-  pic_trace_buffer_index = 0;
+  free(pic->trace);
+  pic->trace = NULL;
 }
 
 
 
-void pic_trace_dump(FILE *fh)
+void pic_trace_dump(pic_t *pic, FILE *fh)
 {
   int i;
 
-  for (i = pic_trace_buffer_index; i < PIC_TRACE_BUFFER_SIZE; i++) {
-    if (pic_trace_buffer[i][0] != '\0') {
-      fprintf(fh, pic_trace_buffer[i]);
-    }
+  if (pic->trace == NULL) {
+    return;
   }
-  for (i = 0; i < pic_trace_buffer_index; i++) {
-    if (pic_trace_buffer[i][0] != '\0') {
-      fprintf(fh, pic_trace_buffer[i]);
+
+  if (pic->trace_wrapped) {
+    for (i = pic->trace_index; i < PIC_TRACE_BUFFER_SIZE; i++) {
+      pic_trace_format(&pic->trace[i], fh);
     }
   }
+  for (i = 0; i < pic->trace_index; i++) {
+    pic_trace_format(&pic->trace[i], fh);
+  }
 }
 
 
@@ -120,6 +216,108 @@ void pic_init(pic_t *pic, mem_t *mem)
 
 
 
+void pic_panic(pic_t *pic, const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(pic->panic_msg, sizeof(pic->panic_msg), format, args);
+  va_end(args);
+
+  if (pic->panic_hook != NULL) {
+    (pic->panic_hook)(pic, pic->panic_user);
+  }
+}
+
+
+
+void pic_reg_set(pic_t *pic, uint16_t f, uint8_t value)
+{
+  pic->r[f] = value;
+
+  if (pic->journal_hook != NULL) {
+    (pic->journal_hook)(pic, pic->journal_user, PIC_JOURNAL_REG, f, value);
+  }
+}
+
+
+
+uint8_t pic_port_pins(pic_t *pic, int port)
+{
+  switch (port) {
+  case 0:
+    return (pic->r[PIC_REG_PORTA] & ~pic->r[PIC_REG_TRISA]) |
+           (pic->in_porta         &  pic->r[PIC_REG_TRISA]);
+  case 1:
+    return (pic->r[PIC_REG_PORTB] & ~pic->r[PIC_REG_TRISB]) |
+           (pic->in_portb         &  pic->r[PIC_REG_TRISB]);
+  case 2:
+    return (pic->r[PIC_REG_PORTC] & ~pic->r[PIC_REG_TRISC]) |
+           (pic->in_portc         &  pic->r[PIC_REG_TRISC]);
+  case 3:
+    return (pic->r[PIC_REG_PORTD] & ~pic->r[PIC_REG_TRISD]) |
+           (pic->in_portd         &  pic->r[PIC_REG_TRISD]);
+  case 4:
+    return (pic->r[PIC_REG_PORTE] & ~pic->r[PIC_REG_TRISE]) |
+           (pic->in_porte         &  pic->r[PIC_REG_TRISE]);
+  default:
+    return 0;
+  }
+}
+
+
+
+void pic_port_input_set(pic_t *pic, int port, uint8_t value)
+{
+  switch (port) {
+  case 0:
+    pic->in_porta = value;
+    break;
+  case 1:
+    pic->in_portb = value;
+    break;
+  case 2:
+    pic->in_portc = value;
+    break;
+  case 3:
+    pic->in_portd = value;
+    break;
+  case 4:
+    pic->in_porte = value;
+    break;
+  default:
+    return;
+  }
+
+  if (pic->journal_hook != NULL) {
+    (pic->journal_hook)(pic, pic->journal_user, PIC_JOURNAL_INPUT, port,
+      value);
+  }
+  if (pic->input_hook != NULL) {
+    (pic->input_hook)(pic, pic->input_user, port, value);
+  }
+
+  /* Let peripherals know that the pin state as seen through PORTx changed. */
+  if (pic->reg_write_hook != NULL) {
+    (pic->reg_write_hook)(pic, pic->reg_write_user, PIC_REG_PORTA + port);
+  }
+}
+
+
+
+void pic_uart_rx_write(pic_t *pic, uint8_t data)
+{
+  pic_reg_set(pic, PIC_REG_RCREG, data);
+  /* Set RCIF to indicate new data. */
+  pic_reg_set(pic, PIC_REG_PIR1, pic->r[PIC_REG_PIR1] | 0x20);
+
+  if (pic->input_hook != NULL) {
+    (pic->input_hook)(pic, pic->input_user, PIC_INPUT_UART, data);
+  }
+}
+
+
+
 void pic_reg_dump(pic_t *pic, FILE *fh)
 {
   fprintf(fh, "    ");
@@ -223,10 +421,70 @@ static inline void pic_flag_sub(pic_t *pic, uint8_t value)
 
 
 
+/* Address a banked register access ends up at, as watched. */
+static uint16_t pic_watch_home(pic_t *pic, uint16_t f)
+{
+  switch (f) {
+  case PIC_REG_INDF:
+  case PIC_REG_INDF_1:
+  case PIC_REG_INDF_2:
+  case PIC_REG_INDF_3:
+    f  =  pic->r[PIC_REG_FSR];
+    f |= (pic_status_get(pic, PIC_STATUS_IRP) << 8);
+    return f;
+  case PIC_REG_PCL_1:
+  case PIC_REG_PCL_2:
+  case PIC_REG_PCL_3:
+    return PIC_REG_PCL;
+  case PIC_REG_STATUS_1:
+  case PIC_REG_STATUS_2:
+  case PIC_REG_STATUS_3:
+    return PIC_REG_STATUS;
+  case PIC_REG_FSR_1:
+  case PIC_REG_FSR_2:
+  case PIC_REG_FSR_3:
+    return PIC_REG_FSR;
+  case PIC_REG_PCLATH_1:
+  case PIC_REG_PCLATH_2:
+  case PIC_REG_PCLATH_3:
+    return PIC_REG_PCLATH;
+  default:
+    return f;
+  }
+}
+
+
+
+static void pic_watch_read(pic_t *pic, uint16_t f)
+{
+  f = pic_watch_home(pic, f);
+  if (pic->watch[f] & PIC_WATCH_READ) {
+    pic->watch_addr = f;
+    pic->watch_hit = PIC_WATCH_READ;
+  }
+}
+
+
+
+/* Only called for writes made by instructions, not for flag updates. */
+static void pic_watch_write(pic_t *pic, uint16_t f)
+{
+  f = pic_watch_home(pic, f);
+  if (pic->watch[f] & PIC_WATCH_WRITE) {
+    pic->watch_addr = f;
+    pic->watch_hit = PIC_WATCH_WRITE;
+  }
+}
+
+
+
 static uint8_t pic_reg_read(pic_t *pic, uint16_t f)
 {
   f |= (pic_status_get(pic, PIC_STATUS_RP0) << 7);
   f |= (pic_status_get(pic, PIC_STATUS_RP1) << 8);
+  if (pic->watch != NULL) {
+    pic_watch_read(pic, f);
+  }
   switch (f) {
   case PIC_REG_INDF:
   case PIC_REG_INDF_1:
@@ -256,13 +514,16 @@ static uint8_t pic_reg_read(pic_t *pic, uint16_t f)
     f = PIC_REG_PCLATH;
     break;
   case PIC_REG_RCREG:
-    pic->r[PIC_REG_PIR1] &= ~0x20; /* Clear RCIF once RCREG has been read. */
+    /* Clear RCIF once RCREG has been read. */
+    pic_reg_set(pic, PIC_REG_PIR1, pic->r[PIC_REG_PIR1] & ~0x20);
     break;
   case PIC_REG_PIR1:
-    pic->r[PIC_REG_PIR1] |= 0x10; /* Make sure TXIF is always set. */
+    /* Make sure TXIF is always set. */
+    pic_reg_set(pic, PIC_REG_PIR1, pic->r[PIC_REG_PIR1] | 0x10);
     break;
   case PIC_REG_TXSTA:
-    pic->r[PIC_REG_TXSTA] |= 0x02; /* Make sure TRMT is always set. */
+    /* Make sure TRMT is always set. */
+    pic_reg_set(pic, PIC_REG_TXSTA, pic->r[PIC_REG_TXSTA] | 0x02);
     break;
   case PIC_REG_PORTA:
     return (pic->r[PIC_REG_PORTA] & ~pic->r[PIC_REG_TRISA]) |
@@ -284,7 +545,7 @@ static uint8_t pic_reg_read(pic_t *pic, uint16_t f)
   }
 
   if (pic->reg_read_hook != NULL) {
-    (pic->reg_read_hook)(pic, f);
+    (pic->reg_read_hook)(pic, pic->reg_read_user, f);
   }
 
   return pic->r[f];
@@ -292,6 +553,82 @@ static uint8_t pic_reg_read(pic_t *pic, uint16_t f)
 
 
 
+/* Program memory reads and writes through EECON1 with EEPGD set. The
+ * core stalls for the two instructions after setting RD or WR, which are
+ * skipped like on the real device, where they are ignored. Writes need
+ * WREN and the EECON2 unlock sequence, and are latched until the last
+ * word of a PIC_FLASH_BLOCK is written, which stores the whole block and
+ * stalls for the erase/write time. Only the written words are dropped
+ * from the decode cache.
+ */
+static void pic_flash_read(pic_t *pic)
+{
+  uint16_t addr;
+  uint16_t word;
+
+  addr = ((pic->r[PIC_REG_EEADRH] << 8) | pic->r[PIC_REG_EEADR]) %
+    MEM_PROGRAM_MAX;
+  word = pic->mem->program[addr];
+  pic_reg_set(pic, PIC_REG_EEDATA, word & 0xFF);
+  pic_reg_set(pic, PIC_REG_EEDATH, (word >> 8) & 0x3F);
+  pic->pc += 2;
+  pic->cycle += 2;
+}
+
+
+
+static void pic_unlock_set(pic_t *pic, uint8_t unlock)
+{
+  if (pic->eecon2_unlock == unlock) {
+    return;
+  }
+  pic->eecon2_unlock = unlock;
+
+  if (pic->journal_hook != NULL) {
+    (pic->journal_hook)(pic, pic->journal_user, PIC_JOURNAL_UNLOCK, 0, unlock);
+  }
+}
+
+
+
+static void pic_flash_write(pic_t *pic)
+{
+  uint16_t addr;
+  uint16_t block;
+
+  addr = ((pic->r[PIC_REG_EEADRH] << 8) | pic->r[PIC_REG_EEADR]) %
+    MEM_PROGRAM_MAX;
+  pic->flash_latch[addr % PIC_FLASH_BLOCK] =
+    ((pic->r[PIC_REG_EEDATH] << 8) | pic->r[PIC_REG_EEDATA]) & 0x3FFF;
+  if (pic->journal_hook != NULL) {
+    (pic->journal_hook)(pic, pic->journal_user, PIC_JOURNAL_LATCH,
+      addr % PIC_FLASH_BLOCK, pic->flash_latch[addr % PIC_FLASH_BLOCK]);
+  }
+  pic->pc += 2;
+  pic->cycle += 2;
+
+  if ((addr % PIC_FLASH_BLOCK) != PIC_FLASH_BLOCK - 1) {
+    return;
+  }
+
+  block = addr - (PIC_FLASH_BLOCK - 1);
+  for (int i = 0; i < PIC_FLASH_BLOCK; i++) {
+    if (pic->journal_hook != NULL) {
+      (pic->journal_hook)(pic, pic->journal_user, PIC_JOURNAL_PROGRAM_OLD,
+        block + i, pic->mem->program[block + i]);
+      (pic->journal_hook)(pic, pic->journal_user, PIC_JOURNAL_PROGRAM,
+        block + i, pic->flash_latch[i]);
+    }
+    if (mem_program_set(pic->mem, block + i, pic->flash_latch[i]) != 0) {
+      pic_panic(pic, "Program write at 0x%04x failed", block + i);
+      return;
+    }
+  }
+  pic->cycle += PIC_FLASH_WRITE_CYCLES;
+}
+
+
+
 static void pic_reg_write(pic_t *pic, uint16_t f, uint8_t value)
 {
   f |= (pic_status_get(pic, PIC_STATUS_RP0) << 7);
@@ -327,35 +664,143 @@ static void pic_reg_write(pic_t *pic, uint16_t f, uint8_t value)
     break;
   case PIC_REG_RCSTA:
     if ((value & 0x10) == 0) {
-      pic->r[PIC_REG_RCSTA] &= ~0x02; /* Clear OERR when CREN is cleared. */
+      /* Clear OERR when CREN is cleared. */
+      pic_reg_set(pic, PIC_REG_RCSTA, pic->r[PIC_REG_RCSTA] & ~0x02);
     }
     break;
   case PIC_REG_EECON1:
     if (value & 0x01) {
       if ((value & 0x80) == 0) {
         /* Read from data memory EEPROM. */
-        pic->r[PIC_REG_EEDATA] = pic->mem->eeprom[pic->r[PIC_REG_EEADR]];
+        pic_reg_set(pic, PIC_REG_EEDATA,
+          pic->mem->eeprom[pic->r[PIC_REG_EEADR]]);
       } else {
-        panic("Reading from program memory not implemented!\n");
+        pic_flash_read(pic);
       }
+      value &= ~0x01; /* Clear RD again, data is available already. */
     } else if (value & 0x02) {
       if ((value & 0x80) == 0) {
         /* Write to data memory EEPROM. */
-        pic->mem->eeprom[pic->r[PIC_REG_EEADR]] = pic->r[PIC_REG_EEDATA];
+        mem_eeprom_write(pic->mem, pic->r[PIC_REG_EEADR],
+          pic->r[PIC_REG_EEDATA]);
+        if (pic->journal_hook != NULL) {
+          (pic->journal_hook)(pic, pic->journal_user, PIC_JOURNAL_EEPROM,
+            pic->r[PIC_REG_EEADR], pic->r[PIC_REG_EEDATA]);
+        }
         value &= ~0x02; /* Clear WR again to indicate write done already. */
+      } else if ((value & 0x04) && pic->eecon2_unlock == 2) {
+        pic_flash_write(pic);
+        value &= ~0x02;
       } else {
-        panic("Writing to program memory not implemented!\n");
+        value &= ~0x02; /* Not unlocked, so the write never starts. */
       }
+      pic_unlock_set(pic, 0);
     }
     break;
+  case PIC_REG_EECON2:
+    if (value == 0x55) {
+      pic_unlock_set(pic, 1);
+    } else if (value == 0xAA && pic->eecon2_unlock == 1) {
+      pic_unlock_set(pic, 2);
+    } else {
+      pic_unlock_set(pic, 0);
+    }
+    return; /* Not a physical register, always reads as zero. */
   default:
     break;
   }
 
-  pic->r[f] = value;
+  if (pic->watch != NULL) {
+    pic_watch_write(pic, f);
+  }
+  pic_reg_set(pic, f, value);
 
   if (pic->reg_write_hook != NULL) {
-    (pic->reg_write_hook)(pic, f);
+    (pic->reg_write_hook)(pic, pic->reg_write_user, f);
+  }
+}
+
+
+
+uint8_t pic_decode(uint16_t opcode)
+{
+  if ((opcode & 0xFF9F) == 0x0000) {
+    return PIC_OP_NOP;
+  } else if ((opcode & 0xFE00) == 0x3E00) {
+    return PIC_OP_ADDLW;
+  } else if ((opcode & 0xFF00) == 0x700) {
+    return PIC_OP_ADDWF;
+  } else if ((opcode & 0xFF00) == 0x3900) {
+    return PIC_OP_ANDLW;
+  } else if ((opcode & 0xFF00) == 0x500) {
+    return PIC_OP_ANDWF;
+  } else if ((opcode & 0xFC00) == 0x1000) {
+    return PIC_OP_BCF;
+  } else if ((opcode & 0xFC00) == 0x1400) {
+    return PIC_OP_BSF;
+  } else if ((opcode & 0xFC00) == 0x1800) {
+    return PIC_OP_BTFSC;
+  } else if ((opcode & 0xFC00) == 0x1C00) {
+    return PIC_OP_BTFSS;
+  } else if ((opcode & 0xF800) == 0x2000) {
+    return PIC_OP_CALL;
+  } else if ((opcode & 0xFF80) == 0x180) {
+    return PIC_OP_CLRF;
+  } else if ((opcode & 0xFF80) == 0x100) {
+    return PIC_OP_CLRW;
+  } else if ((opcode & 0xFF00) == 0x900) {
+    return PIC_OP_COMF;
+  } else if ((opcode & 0xFF00) == 0x300) {
+    return PIC_OP_DECF;
+  } else if ((opcode & 0xFF00) == 0xB00) {
+    return PIC_OP_DECFSZ;
+  } else if ((opcode & 0xF800) == 0x2800) {
+    return PIC_OP_GOTO;
+  } else if ((opcode & 0xFF00) == 0x3800) {
+    return PIC_OP_IORLW;
+  } else if ((opcode & 0xFF00) == 0x400) {
+    return PIC_OP_IORWF;
+  } else if ((opcode & 0xFF00) == 0xA00) {
+    return PIC_OP_INCF;
+  } else if ((opcode & 0xFF00) == 0xF00) {
+    return PIC_OP_INCFSZ;
+  } else if ((opcode & 0xFF00) == 0x800) {
+    return PIC_OP_MOVF;
+  } else if ((opcode & 0xFC00) == 0x3000) {
+    return PIC_OP_MOVLW;
+  } else if ((opcode & 0xFF80) == 0x80) {
+    return PIC_OP_MOVWF;
+  } else if ((opcode & 0xFC00) == 0x3400) {
+    return PIC_OP_RETLW;
+  } else if (opcode == 0x8) {
+    return PIC_OP_RETURN;
+  } else if ((opcode & 0xFF00) == 0xD00) {
+    return PIC_OP_RLF;
+  } else if ((opcode & 0xFF00) == 0xC00) {
+    return PIC_OP_RRF;
+  } else if ((opcode & 0xFE00) == 0x3C00) {
+    return PIC_OP_SUBLW;
+  } else if ((opcode & 0xFF00) == 0x200) {
+    return PIC_OP_SUBWF;
+  } else if ((opcode & 0xFF00) == 0xE00) {
+    return PIC_OP_SWAPF;
+  } else if ((opcode & 0xFFFC) == 0x64) {
+    return PIC_OP_TRIS;
+  } else if ((opcode & 0xFF00) == 0x3A00) {
+    return PIC_OP_XORLW;
+  } else if ((opcode & 0xFF00) == 0x600) {
+    return PIC_OP_XORWF;
+  } else {
+    return PIC_OP_INVALID;
+  }
+}
+
+
+
+void pic_predecode(mem_t *mem)
+{
+  for (int i = 0; i < MEM_PROGRAM_MAX; i++) {
+    mem->decoded[i] = pic_decode(mem->program[i]);
   }
 }
 
@@ -364,6 +809,7 @@ static void pic_reg_write(pic_t *pic, uint16_t f, uint8_t value)
 void pic_execute(pic_t *pic, mem_t *mem)
 {
   uint16_t opcode;
+  uint8_t op;
   uint16_t k;
   uint8_t b;
   uint8_t f;
@@ -371,15 +817,24 @@ void pic_execute(pic_t *pic, mem_t *mem)
   bool bit;
 
   opcode = mem->program[pic->pc & 0x1FFF];
+  op = mem->decoded[pic->pc & 0x1FFF];
+  if (op == PIC_OP_NONE) {
+    op = pic_decode(opcode);
+    mem->decoded[pic->pc & 0x1FFF] = op;
+  }
 
-  if ((opcode & 0xFF9F) == 0x0000) { /* NOP */
-    pic_trace(pic, opcode, "NOP");
+  if (pic->trace != NULL) {
+    pic_trace(pic, opcode);
+  }
+
+  switch (op) {
+  case PIC_OP_NOP:
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFE00) == 0x3E00) { /* ADDLW */
+  case PIC_OP_ADDLW:
     k = opcode & 0xFF;
-    pic_trace(pic, opcode, "ADDLW 0x%02x", k);
     pic_flag_add(pic, k);
     pic->w += k;
     pic_flag_z(pic, pic->w);
@@ -387,14 +842,14 @@ void pic_execute(pic_t *pic, mem_t *mem)
     pic->cycle++;
 #ifdef PANIC_ON_3FFF
     if (opcode == 0x3FFF) {
-      panic("Suspicious 0x3FFF opcode!\n");
+      pic_panic(pic, "Suspicious 0x3FFF opcode!\n");
     }
 #endif
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x700) { /* ADDWF */
+  case PIC_OP_ADDWF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "ADDWF 0x%02x, %d", f, d);
     if (d) {
       pic_flag_add(pic, pic_reg_read(pic, f));
       pic_reg_write(pic, f, pic_reg_read(pic, f) + pic->w);
@@ -406,19 +861,19 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x3900) { /* ANDLW */
+  case PIC_OP_ANDLW:
     k = opcode & 0xFF;
-    pic_trace(pic, opcode, "ANDLW 0x%02x", k);
     pic->w &= k;
     pic_flag_z(pic, pic->w);
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x500) { /* ANDWF */
+  case PIC_OP_ANDWF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "ANDWF 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, pic_reg_read(pic, f) & pic->w);
       pic_flag_z(pic, pic_reg_read(pic, f));
@@ -428,27 +883,27 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFC00) == 0x1000) { /* BCF */
+  case PIC_OP_BCF:
     f = opcode & 0x7F;
     b = (opcode >> 7) & 0x7;
-    pic_trace(pic, opcode, "BCF 0x%02x, %d", f, b);
     pic_reg_write(pic, f, pic_reg_read(pic, f) & ~(1 << b));
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFC00) == 0x1400) { /* BSF */
+  case PIC_OP_BSF:
     f = opcode & 0x7F;
     b = (opcode >> 7) & 0x7;
-    pic_trace(pic, opcode, "BSF 0x%02x, %d", f, b);
     pic_reg_write(pic, f, pic_reg_read(pic, f) | (1 << b));
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFC00) == 0x1800) { /* BTFSC */
+  case PIC_OP_BTFSC:
     f = opcode & 0x7F;
     b = (opcode >> 7) & 0x7;
-    pic_trace(pic, opcode, "BTFSC 0x%02x, %d", f, b);
     if ((pic_reg_read(pic, f) >> b) & 1) {
       pic->pc++;
       pic->cycle++;
@@ -456,11 +911,11 @@ void pic_execute(pic_t *pic, mem_t *mem)
       pic->pc += 2;
       pic->cycle += 2;
     }
+    break;
 
-  } else if ((opcode & 0xFC00) == 0x1C00) { /* BTFSS */
+  case PIC_OP_BTFSS:
     f = opcode & 0x7F;
     b = (opcode >> 7) & 0x7;
-    pic_trace(pic, opcode, "BTFSS 0x%02x, %d", f, b);
     if ((pic_reg_read(pic, f) >> b) & 1) {
       pic->pc += 2;
       pic->cycle += 2;
@@ -468,39 +923,43 @@ void pic_execute(pic_t *pic, mem_t *mem)
       pic->pc++;
       pic->cycle++;
     }
+    break;
 
-  } else if ((opcode & 0xF800) == 0x2000) { /* CALL */
+  case PIC_OP_CALL:
     k = opcode & 0x7FF;
-    pic_trace(pic, opcode, "CALL 0x%04x", k);
     if (pic->sp == PIC_STACK_SIZE) {
-      panic("Stack overflow on call!\n");
+      pic_panic(pic, "Stack overflow on call!\n");
     } else {
       pic->stack[pic->sp] = pic->pc + 1;
+      if (pic->journal_hook != NULL) {
+        (pic->journal_hook)(pic, pic->journal_user, PIC_JOURNAL_STACK,
+          pic->sp, pic->pc + 1);
+      }
       pic->sp++;
       pic->pc = k;
       pic->pc += (((pic->r[PIC_REG_PCLATH] >> 3) & 0x3) << 11);
       pic->cycle += 2;
     }
+    break;
 
-  } else if ((opcode & 0xFF80) == 0x180) { /* CLRF */
+  case PIC_OP_CLRF:
     f = opcode & 0x7F;
-    pic_trace(pic, opcode, "CLRF 0x%02x", f);
     pic_reg_write(pic, f, 0);
     pic_flag_z(pic, 0);
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF80) == 0x100) { /* CLRW */
-    pic_trace(pic, opcode, "CLRW");
+  case PIC_OP_CLRW:
     pic->w = 0;
     pic_flag_z(pic, 0);
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x900) { /* COMF */
+  case PIC_OP_COMF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "COMF 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, ~pic_reg_read(pic, f));
       pic_flag_z(pic, pic_reg_read(pic, f));
@@ -510,11 +969,11 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x300) { /* DECF */
+  case PIC_OP_DECF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "DECF 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, pic_reg_read(pic, f) - 1);
       pic_flag_z(pic, pic_reg_read(pic, f));
@@ -524,11 +983,11 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0xB00) { /* DECFSZ */
+  case PIC_OP_DECFSZ:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "DECFSZ 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, pic_reg_read(pic, f) - 1);
       if (pic_reg_read(pic, f)) {
@@ -548,26 +1007,26 @@ void pic_execute(pic_t *pic, mem_t *mem)
         pic->cycle += 2;
       }
     }
+    break;
 
-  } else if ((opcode & 0xF800) == 0x2800) { /* GOTO */
+  case PIC_OP_GOTO:
     k = opcode & 0x7FF;
-    pic_trace(pic, opcode, "GOTO 0x%04x", k);
     pic->pc = k;
     pic->pc += (((pic->r[PIC_REG_PCLATH] >> 3) & 0x3) << 11);
     pic->cycle += 2;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x3800) { /* IORLW */
+  case PIC_OP_IORLW:
     k = opcode & 0xFF;
-    pic_trace(pic, opcode, "IORLW 0x%02x", k);
     pic->w |= k;
     pic_flag_z(pic, pic->w);
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x400) { /* IORWF */
+  case PIC_OP_IORWF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "IORWF 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, pic_reg_read(pic, f) | pic->w);
       pic_flag_z(pic, pic_reg_read(pic, f));
@@ -577,11 +1036,11 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0xA00) { /* INCF */
+  case PIC_OP_INCF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "INCF 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, pic_reg_read(pic, f) + 1);
       pic_flag_z(pic, pic_reg_read(pic, f));
@@ -591,11 +1050,11 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0xF00) { /* INCFSZ */
+  case PIC_OP_INCFSZ:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "INCFSZ 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, pic_reg_read(pic, f) + 1);
       if (pic_reg_read(pic, f)) {
@@ -615,11 +1074,11 @@ void pic_execute(pic_t *pic, mem_t *mem)
         pic->cycle += 2;
       }
     }
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x800) { /* MOVF */
+  case PIC_OP_MOVF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "MOVF 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, pic->w);
       pic_flag_z(pic, pic_reg_read(pic, f));
@@ -629,47 +1088,47 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFC00) == 0x3000) { /* MOVLW */
+  case PIC_OP_MOVLW:
     k = opcode & 0xFF;
-    pic_trace(pic, opcode, "MOVLW 0x%02x", k);
     pic->w = k;
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF80) == 0x80) { /* MOVWF */
+  case PIC_OP_MOVWF:
     f = opcode & 0x7F;
-    pic_trace(pic, opcode, "MOVWF 0x%02x", f);
     pic_reg_write(pic, f, pic->w);
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFC00) == 0x3400) { /* RETLW */
+  case PIC_OP_RETLW:
     k = opcode & 0xFF;
-    pic_trace(pic, opcode, "RETLW 0x%02x", k);
     pic->w = k;
     if (pic->sp == 0) {
-      panic("Attempted to return with no stack!\n");
+      pic_panic(pic, "Attempted to return with no stack!\n");
     } else {
       pic->sp--;
       pic->pc = pic->stack[pic->sp];
       pic->cycle += 2;
     }
+    break;
 
-  } else if (opcode == 0x8) { /* RETURN */
-    pic_trace(pic, opcode, "RETURN");
+  case PIC_OP_RETURN:
     if (pic->sp == 0) {
-      panic("Attempted to return with no stack!\n");
+      pic_panic(pic, "Attempted to return with no stack!\n");
     } else {
       pic->sp--;
       pic->pc = pic->stack[pic->sp];
       pic->cycle += 2;
     }
+    break;
 
-  } else if ((opcode & 0xFF00) == 0xD00) { /* RLF */
+  case PIC_OP_RLF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "RLF 0x%02x, %d", f, d);
     bit = pic_reg_read(pic, f) & 0x80;
     if (d) {
       pic_reg_write(pic, f, pic_reg_read(pic, f) << 1);
@@ -689,11 +1148,11 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0xC00) { /* RRF */
+  case PIC_OP_RRF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "RRF 0x%02x, %d", f, d);
     bit = pic_reg_read(pic, f) & 1;
     if (d) {
       pic_reg_write(pic, f, pic_reg_read(pic, f) >> 1);
@@ -713,20 +1172,20 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFE00) == 0x3C00) { /* SUBLW */
+  case PIC_OP_SUBLW:
     k = opcode & 0xFF;
-    pic_trace(pic, opcode, "SUBLW 0x%02x", k);
     pic_flag_sub(pic, k);
     pic->w = k - pic->w;
     pic_flag_z(pic, pic->w);
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x200) { /* SUBWF */
+  case PIC_OP_SUBWF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "SUBWF 0x%02x, %d", f, d);
     if (d) {
       pic_flag_sub(pic, pic_reg_read(pic, f));
       pic_reg_write(pic, f, pic_reg_read(pic, f) - pic->w);
@@ -738,11 +1197,11 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0xE00) { /* SWAPF */
+  case PIC_OP_SWAPF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "SWAPF 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, (pic_reg_read(pic, f) >> 4) |
                            ((pic_reg_read(pic, f) << 4) & 0xF0));
@@ -752,32 +1211,38 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFFFC) == 0x64) { /* TRIS */
+  case PIC_OP_TRIS:
     f = opcode & 0x3;
-    pic_trace(pic, opcode, "TRIS %d", f);
     if (f == 1) {
-      pic->r[PIC_REG_TRISA] = pic->w;
+      pic_reg_set(pic, PIC_REG_TRISA, pic->w);
     } else if (f == 2) {
-      pic->r[PIC_REG_TRISB] = pic->w;
+      pic_reg_set(pic, PIC_REG_TRISB, pic->w);
     } else if (f == 3) {
-      pic->r[PIC_REG_TRISC] = pic->w;
+      pic_reg_set(pic, PIC_REG_TRISC, pic->w);
+    }
+    if (f != 0 && pic->watch != NULL) {
+      pic_watch_write(pic, PIC_REG_TRISA + f - 1);
+    }
+    if (f != 0 && pic->reg_write_hook != NULL) {
+      (pic->reg_write_hook)(pic, pic->reg_write_user, PIC_REG_TRISA + f - 1);
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x3A00) { /* XORLW */
+  case PIC_OP_XORLW:
     k = opcode & 0xFF;
-    pic_trace(pic, opcode, "XORLW 0x%02x", k);
     pic->w ^= k;
     pic_flag_z(pic, pic->w);
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else if ((opcode & 0xFF00) == 0x600) { /* XORWF */
+  case PIC_OP_XORWF:
     f = opcode & 0x7F;
     d = (opcode >> 7) & 1;
-    pic_trace(pic, opcode, "XORWF 0x%02x, %d", f, d);
     if (d) {
       pic_reg_write(pic, f, pic_reg_read(pic, f) ^ pic->w);
       pic_flag_z(pic, pic_reg_read(pic, f));
@@ -787,9 +1252,11 @@ void pic_execute(pic_t *pic, mem_t *mem)
     }
     pic->pc++;
     pic->cycle++;
+    break;
 
-  } else {
-    panic("Unhandled opcode: 0x%04x @ 0x%04x\n", opcode, pic->pc);
+  default:
+    pic_panic(pic, "Unhandled opcode: 0x%04x @ 0x%04x\n", opcode, pic->pc);
+    break;
   }
 }
 
@@ -2,12 +2,15 @@
 #define _PIC_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include "mem.h"
 
 #define PIC_STACK_SIZE 8
 #define PIC_REGISTER_MAX 0x200
+#define PIC_TRACE_BUFFER_SIZE 512
+#define PIC_PANIC_MAX 80
 
 #define PIC_REG_INDF     0x000
 #define PIC_REG_PCL      0x002
@@ -43,6 +46,8 @@
 #define PIC_REG_PCLATH_2 0x10A
 #define PIC_REG_EEDATA   0x10C
 #define PIC_REG_EEADR    0x10D
+#define PIC_REG_EEDATH   0x10E
+#define PIC_REG_EEADRH   0x10F
 
 #define PIC_REG_INDF_3   0x180
 #define PIC_REG_PCL_3    0x182
@@ -50,10 +55,87 @@
 #define PIC_REG_FSR_3    0x184
 #define PIC_REG_PCLATH_3 0x18A
 #define PIC_REG_EECON1   0x18C
+#define PIC_REG_EECON2   0x18D
 
+#define PIC_JOURNAL_REG    1
+#define PIC_JOURNAL_EEPROM 2
+#define PIC_JOURNAL_STACK  3
+#define PIC_JOURNAL_INPUT  4
+#define PIC_JOURNAL_PROGRAM 5
+#define PIC_JOURNAL_PROGRAM_OLD 6 /* Previous word, ahead of the new one. */
+#define PIC_JOURNAL_LATCH  7 /* Flash write latch word. */
+#define PIC_JOURNAL_UNLOCK 8 /* EECON2 unlock sequence progress. */
+
+#define PIC_FLASH_BLOCK 4 /* Words written together by a program write. */
+#define PIC_FLASH_WRITE_CYCLES 4000 /* 4 ms erase/write at 1 MHz. */
+
+#define PIC_INPUT_PORTA 0
+#define PIC_INPUT_PORTB 1
+#define PIC_INPUT_PORTC 2
+#define PIC_INPUT_PORTD 3
+#define PIC_INPUT_PORTE 4
+#define PIC_INPUT_UART  5
+
+#define PIC_WATCH_READ  0x01
+#define PIC_WATCH_WRITE 0x02
+
+/* Instruction classes as cached per program word in mem_t. */
+enum {
+  PIC_OP_NONE = 0, /* Not decoded yet. */
+  PIC_OP_NOP,
+  PIC_OP_ADDLW,
+  PIC_OP_ADDWF,
+  PIC_OP_ANDLW,
+  PIC_OP_ANDWF,
+  PIC_OP_BCF,
+  PIC_OP_BSF,
+  PIC_OP_BTFSC,
+  PIC_OP_BTFSS,
+  PIC_OP_CALL,
+  PIC_OP_CLRF,
+  PIC_OP_CLRW,
+  PIC_OP_COMF,
+  PIC_OP_DECF,
+  PIC_OP_DECFSZ,
+  PIC_OP_GOTO,
+  PIC_OP_IORLW,
+  PIC_OP_IORWF,
+  PIC_OP_INCF,
+  PIC_OP_INCFSZ,
+  PIC_OP_MOVF,
+  PIC_OP_MOVLW,
+  PIC_OP_MOVWF,
+  PIC_OP_RETLW,
+  PIC_OP_RETURN,
+  PIC_OP_RLF,
+  PIC_OP_RRF,
+  PIC_OP_SUBLW,
+  PIC_OP_SUBWF,
+  PIC_OP_SWAPF,
+  PIC_OP_TRIS,
+  PIC_OP_XORLW,
+  PIC_OP_XORWF,
+  PIC_OP_INVALID,
+};
+
+/* CPU state before an executed instruction, as kept in the trace. */
+typedef struct pic_trace_entry_s {
+  uint32_t cycle;
+  uint16_t pc;
+  uint16_t opcode;
+  uint8_t w;
+  uint8_t status;
+  uint8_t sp;
+} pic_trace_entry_t;
+
+/* Hooks are called with the user pointer stored next to them. */
 typedef struct pic_s pic_t;
-typedef void (*pic_reg_read_notify_hook_t)(pic_t *, uint16_t);
-typedef void (*pic_reg_write_notify_hook_t)(pic_t *, uint16_t);
+typedef void (*pic_reg_read_notify_hook_t)(pic_t *, void *, uint16_t);
+typedef void (*pic_reg_write_notify_hook_t)(pic_t *, void *, uint16_t);
+typedef void (*pic_journal_hook_t)(pic_t *, void *, uint8_t, uint16_t,
+  uint16_t);
+typedef void (*pic_input_notify_hook_t)(pic_t *, void *, uint8_t, uint8_t);
+typedef void (*pic_panic_hook_t)(pic_t *, void *);
 
 struct pic_s {
   uint16_t pc;
@@ -69,17 +151,40 @@ struct pic_s {
   uint8_t in_porte;
   mem_t *mem;
   pic_reg_read_notify_hook_t reg_read_hook;
+  void *reg_read_user;
   pic_reg_write_notify_hook_t reg_write_hook;
+  void *reg_write_user;
+  pic_journal_hook_t journal_hook;
+  void *journal_user;
+  pic_input_notify_hook_t input_hook;
+  void *input_user;
+  pic_panic_hook_t panic_hook;
+  void *panic_user;
+  const uint8_t *watch; /* PIC_WATCH_* flags per register, or NULL. */
+  uint16_t watch_addr;
+  uint8_t watch_hit;
+  uint8_t eecon2_unlock; /* Progress of the 0x55, 0xAA unlock sequence. */
+  uint16_t flash_latch[PIC_FLASH_BLOCK];
+  pic_trace_entry_t *trace; /* Instruction trace ring, or NULL. */
+  int trace_index;
+  bool trace_wrapped;
+  char panic_msg[PIC_PANIC_MAX];
 };
 
-void pic_trace_init(void);
-void pic_trace_dump(FILE *fh);
-void pic_port_trace_init(void);
-void pic_port_trace_dump(FILE *fh);
+int pic_trace_init(pic_t *pic);
+void pic_trace_free(pic_t *pic);
+void pic_trace_dump(pic_t *pic, FILE *fh);
 void pic_init(pic_t *pic, mem_t *mem);
+void pic_panic(pic_t *pic, const char *format, ...);
 void pic_reg_dump(pic_t *pic, FILE *fh);
 void pic_port_dump(pic_t *pic, FILE *fh);
 void pic_execute(pic_t *pic, mem_t *mem);
+uint8_t pic_decode(uint16_t opcode);
+int pic_disassemble(uint16_t opcode, char *buffer, size_t size);
+void pic_predecode(mem_t *mem);
+void pic_reg_set(pic_t *pic, uint16_t f, uint8_t value);
+uint8_t pic_port_pins(pic_t *pic, int port);
+void pic_port_input_set(pic_t *pic, int port, uint8_t value);
 int16_t pic_uart_tx_read(pic_t *pic);
 void pic_uart_rx_write(pic_t *pic, uint8_t data);
 
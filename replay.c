@@ -0,0 +1,202 @@
+#include "replay.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mem.h"
+#include "pic.h"
+
+/* Input log layout, all values in host (little) endian order:
+ *
+ *   "PIC16REC" + uint32_t version
+ *   replay_event_t
+ *   replay_event_t
+ *   ...
+ *
+ * Events are stored in the order they happened, so the cycle stamps are
+ * never decreasing. The last event is always END, stamped with the cycle
+ * the recorded run stopped at.
+ */
+
+#define REPLAY_MAGIC "PIC16REC"
+#define REPLAY_VERSION 1
+#define REPLAY_HEADER_SIZE 12
+
+#define REPLAY_EVENT_END    0
+#define REPLAY_EVENT_PORT   1
+#define REPLAY_EVENT_UART   2
+#define REPLAY_EVENT_EEPROM 3
+
+typedef struct replay_event_s {
+  uint32_t cycle;
+  uint8_t type;
+  uint8_t index;
+  uint8_t value;
+  uint8_t reserved;
+} replay_event_t;
+
+static pic_t *replay_pic = NULL;
+static FILE *replay_record_fh = NULL;
+
+static uint8_t *replay_data = NULL;
+static size_t replay_data_size = 0;
+static size_t replay_event_count = 0;
+static size_t replay_event_index = 0;
+
+
+
+static void replay_record(uint32_t cycle, uint8_t type, uint8_t index,
+  uint8_t value)
+{
+  replay_event_t event;
+
+  event.cycle = cycle;
+  event.type = type;
+  event.index = index;
+  event.value = value;
+  event.reserved = 0;
+  fwrite(&event, sizeof(replay_event_t), 1, replay_record_fh);
+}
+
+
+
+static void replay_input_hook(pic_t *pic, void *user, uint8_t source,
+  uint8_t value)
+{
+  (void)user;
+
+  if (source == PIC_INPUT_UART) {
+    replay_record(pic->cycle, REPLAY_EVENT_UART, 0, value);
+  } else {
+    replay_record(pic->cycle, REPLAY_EVENT_PORT, source, value);
+  }
+}
+
+
+
+static void replay_record_close(void)
+{
+  replay_record(replay_pic->cycle, REPLAY_EVENT_END, 0, 0);
+  fclose(replay_record_fh);
+  replay_record_fh = NULL;
+}
+
+
+
+int replay_record_open(pic_t *pic, const char *filename)
+{
+  uint32_t version = REPLAY_VERSION;
+  int i;
+
+  replay_record_fh = fopen(filename, "wb");
+  if (replay_record_fh == NULL) {
+    return -1;
+  }
+
+  fwrite(REPLAY_MAGIC, 1, 8, replay_record_fh);
+  fwrite(&version, sizeof(uint32_t), 1, replay_record_fh);
+
+  /* Start from the current port inputs and EEPROM contents. */
+  replay_record(pic->cycle, REPLAY_EVENT_PORT, 0, pic->in_porta);
+  replay_record(pic->cycle, REPLAY_EVENT_PORT, 1, pic->in_portb);
+  replay_record(pic->cycle, REPLAY_EVENT_PORT, 2, pic->in_portc);
+  replay_record(pic->cycle, REPLAY_EVENT_PORT, 3, pic->in_portd);
+  replay_record(pic->cycle, REPLAY_EVENT_PORT, 4, pic->in_porte);
+  for (i = 0; i < MEM_EEPROM_MAX; i++) {
+    replay_record(pic->cycle, REPLAY_EVENT_EEPROM, i, pic->mem->eeprom[i]);
+  }
+
+  replay_pic = pic;
+  pic->input_hook = replay_input_hook;
+  atexit(replay_record_close);
+  return 0;
+}
+
+
+
+int replay_play_open(pic_t *pic, const char *filename)
+{
+  struct stat st;
+  uint32_t version;
+  void *data;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) == -1 || st.st_size < REPLAY_HEADER_SIZE) {
+    close(fd);
+    return -1;
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+
+  memcpy(&version, (uint8_t *)data + 8, sizeof(uint32_t));
+  if (memcmp(data, REPLAY_MAGIC, 8) != 0 || version != REPLAY_VERSION ||
+    (st.st_size - REPLAY_HEADER_SIZE) % sizeof(replay_event_t) != 0) {
+    munmap(data, st.st_size);
+    return -1;
+  }
+
+  replay_data = data;
+  replay_data_size = st.st_size;
+  replay_event_count = (st.st_size - REPLAY_HEADER_SIZE) /
+    sizeof(replay_event_t);
+  replay_event_index = 0;
+  replay_pic = pic;
+  return 0;
+}
+
+
+
+uint32_t replay_apply(pic_t *pic)
+{
+  replay_event_t event;
+
+  while (replay_event_index < replay_event_count) {
+    memcpy(&event, replay_data + REPLAY_HEADER_SIZE +
+      (replay_event_index * sizeof(replay_event_t)), sizeof(replay_event_t));
+    if (event.cycle > pic->cycle) {
+      return event.cycle;
+    }
+    replay_event_index++;
+
+    switch (event.type) {
+    case REPLAY_EVENT_END:
+      exit(EXIT_SUCCESS);
+      break;
+
+    case REPLAY_EVENT_PORT:
+      pic_port_input_set(pic, event.index, event.value);
+      break;
+
+    case REPLAY_EVENT_UART:
+      pic_uart_rx_write(pic, event.value);
+      break;
+
+    case REPLAY_EVENT_EEPROM:
+      pic->mem->eeprom[event.index] = event.value;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  /* Log ended without an END event, just keep running. */
+  return UINT32_MAX;
+}
+
+
+
@@ -0,0 +1,11 @@
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include <stdint.h>
+#include "pic.h"
+
+int replay_record_open(pic_t *pic, const char *filename);
+int replay_play_open(pic_t *pic, const char *filename);
+uint32_t replay_apply(pic_t *pic);
+
+#endif /* _REPLAY_H */
@@ -0,0 +1,463 @@
+#include "rewind.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aegl.h"
+#include "mem.h"
+#include "pic.h"
+
+/* Reverse execution is done by restoring the nearest checkpoint taken
+ * before the target step, and then replaying the journal forward from
+ * there. The journal holds every register, EEPROM, stack and input write
+ * as well as a step record with the CPU state after each instruction.
+ * Replaying only applies the recorded values, so no instructions are
+ * executed and no hooks are called when going backwards.
+ *
+ * Program memory is not part of the checkpoints, since it is rarely
+ * written. Instead each program write is journaled with the previous
+ * word as well, and those are put back before replaying from a
+ * checkpoint.
+ *
+ * With a board attached, its state is part of each checkpoint, and the
+ * bytes of it that changed are journaled ahead of each step record.
+ */
+
+#define REWIND_SEGMENT 16384 /* Journal bytes between checkpoints. */
+#define REWIND_SLACK 256 /* Room for records of the last instruction. */
+
+#define REWIND_STEP 0
+#define REWIND_BOARD 0x80 /* Byte of the board state at an offset. */
+
+typedef struct rewind_checkpoint_s {
+  uint64_t step;
+  uint64_t pos;
+  uint16_t pc;
+  uint8_t w;
+  uint8_t sp;
+  uint32_t cycle;
+  uint16_t stack[PIC_STACK_SIZE];
+  uint8_t in_port[5];
+  uint8_t r[PIC_REGISTER_MAX];
+  uint8_t eeprom[MEM_EEPROM_MAX];
+  uint8_t eecon2_unlock;
+  uint16_t flash_latch[PIC_FLASH_BLOCK];
+  aegl_state_t board;
+} rewind_checkpoint_t;
+
+static rewind_checkpoint_t *rewind_checkpoint = NULL;
+static int rewind_checkpoint_max = 0;
+static int rewind_checkpoint_first = 0;
+static int rewind_checkpoint_used = 0;
+
+static uint8_t *rewind_journal = NULL;
+static size_t rewind_journal_size = 0;
+static uint64_t rewind_head = 0;
+static uint64_t rewind_steps = 0;
+
+static aegl_t *rewind_aegl = NULL;
+static aegl_state_t rewind_board; /* As of the last step record. */
+static aegl_state_t rewind_board_now;
+
+
+
+static inline rewind_checkpoint_t *rewind_checkpoint_get(int n)
+{
+  return &rewind_checkpoint[(rewind_checkpoint_first + n) %
+    rewind_checkpoint_max];
+}
+
+
+
+static void rewind_put(const uint8_t *data, size_t size)
+{
+  /* Drop the oldest checkpoint if its journal is about to be overwritten. */
+  while (rewind_checkpoint_used > 1 && rewind_head + size -
+    rewind_checkpoint_get(0)->pos > rewind_journal_size) {
+    rewind_checkpoint_first = (rewind_checkpoint_first + 1) %
+      rewind_checkpoint_max;
+    rewind_checkpoint_used--;
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    rewind_journal[(rewind_head + i) % rewind_journal_size] = data[i];
+  }
+  rewind_head += size;
+}
+
+
+
+static void rewind_get(uint64_t pos, uint8_t *data, size_t size)
+{
+  for (size_t i = 0; i < size; i++) {
+    data[i] = rewind_journal[(pos + i) % rewind_journal_size];
+  }
+}
+
+
+
+static void rewind_journal_hook(pic_t *pic, void *user, uint8_t type,
+  uint16_t addr, uint16_t value)
+{
+  uint8_t record[5];
+
+  (void)pic;
+  (void)user;
+  record[0] = type;
+  record[1] = addr & 0xFF;
+  record[2] = addr >> 8;
+  record[3] = value & 0xFF;
+  record[4] = value >> 8;
+  rewind_put(record, sizeof(record));
+}
+
+
+
+static void rewind_checkpoint_take(pic_t *pic)
+{
+  rewind_checkpoint_t *cp;
+
+  if (rewind_checkpoint_used == rewind_checkpoint_max) {
+    rewind_checkpoint_first = (rewind_checkpoint_first + 1) %
+      rewind_checkpoint_max;
+    rewind_checkpoint_used--;
+  }
+
+  cp = rewind_checkpoint_get(rewind_checkpoint_used);
+  rewind_checkpoint_used++;
+
+  cp->step = rewind_steps;
+  cp->pos = rewind_head;
+  cp->pc = pic->pc;
+  cp->w = pic->w;
+  cp->sp = pic->sp;
+  cp->cycle = pic->cycle;
+  memcpy(cp->stack, pic->stack, sizeof(cp->stack));
+  cp->in_port[0] = pic->in_porta;
+  cp->in_port[1] = pic->in_portb;
+  cp->in_port[2] = pic->in_portc;
+  cp->in_port[3] = pic->in_portd;
+  cp->in_port[4] = pic->in_porte;
+  memcpy(cp->r, pic->r, sizeof(cp->r));
+  memcpy(cp->eeprom, pic->mem->eeprom, sizeof(cp->eeprom));
+  cp->eecon2_unlock = pic->eecon2_unlock;
+  memcpy(cp->flash_latch, pic->flash_latch, sizeof(cp->flash_latch));
+  cp->board = rewind_board;
+}
+
+
+
+static void rewind_checkpoint_restore(pic_t *pic, rewind_checkpoint_t *cp)
+{
+  pic->pc = cp->pc;
+  pic->w = cp->w;
+  pic->sp = cp->sp;
+  pic->cycle = cp->cycle;
+  memcpy(pic->stack, cp->stack, sizeof(pic->stack));
+  pic->in_porta = cp->in_port[0];
+  pic->in_portb = cp->in_port[1];
+  pic->in_portc = cp->in_port[2];
+  pic->in_portd = cp->in_port[3];
+  pic->in_porte = cp->in_port[4];
+  memcpy(pic->r, cp->r, sizeof(pic->r));
+  memcpy(pic->mem->eeprom, cp->eeprom, sizeof(cp->eeprom));
+  mem_eeprom_dirty(pic->mem, 0, MEM_EEPROM_MAX);
+  pic->eecon2_unlock = cp->eecon2_unlock;
+  memcpy(pic->flash_latch, cp->flash_latch, sizeof(pic->flash_latch));
+  rewind_board = cp->board;
+}
+
+
+
+/* Returns the size of the record at pos, applying it to pic if not NULL. */
+static size_t rewind_record(pic_t *pic, uint64_t pos, bool *step,
+  uint16_t *pc)
+{
+  uint8_t record[10];
+  uint16_t addr;
+  uint16_t value;
+
+  rewind_get(pos, record, 1);
+
+  if (record[0] == REWIND_STEP) {
+    rewind_get(pos, record, 10);
+    *step = true;
+    *pc = record[1] | (record[2] << 8);
+    if (pic != NULL) {
+      pic->pc = *pc;
+      pic->w = record[3];
+      pic->r[PIC_REG_STATUS] = record[4];
+      pic->sp = record[5];
+      pic->cycle = record[6] | (record[7] << 8) |
+        (record[8] << 16) | ((uint32_t)record[9] << 24);
+    }
+    return 10;
+  }
+
+  rewind_get(pos, record, 5);
+  *step = false;
+  if (pic != NULL) {
+    addr = record[1] | (record[2] << 8);
+    value = record[3] | (record[4] << 8);
+    switch (record[0]) {
+    case PIC_JOURNAL_REG:
+      pic->r[addr % PIC_REGISTER_MAX] = value;
+      break;
+    case PIC_JOURNAL_EEPROM:
+      mem_eeprom_write(pic->mem, addr % MEM_EEPROM_MAX, value);
+      break;
+    case PIC_JOURNAL_STACK:
+      pic->stack[addr % PIC_STACK_SIZE] = value;
+      break;
+    case PIC_JOURNAL_INPUT:
+      pic_port_input_set(pic, addr, value);
+      break;
+    case PIC_JOURNAL_PROGRAM:
+      mem_program_set(pic->mem, addr, value);
+      break;
+    case PIC_JOURNAL_LATCH:
+      pic->flash_latch[addr % PIC_FLASH_BLOCK] = value;
+      break;
+    case PIC_JOURNAL_UNLOCK:
+      pic->eecon2_unlock = value;
+      break;
+    case REWIND_BOARD:
+      if (addr < sizeof(aegl_state_t)) {
+        ((uint8_t *)&rewind_board)[addr] = value;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return 5;
+}
+
+
+
+/* Puts back program words as they were at pos, the oldest previous word
+ * recorded after pos being the one in place at pos. */
+static void rewind_program_undo(pic_t *pic, uint64_t pos)
+{
+  uint8_t undone[MEM_PROGRAM_MAX / 8];
+  uint8_t record[5];
+  uint16_t addr;
+  uint16_t pc;
+  bool is_step;
+
+  memset(undone, 0, sizeof(undone));
+  while (pos < rewind_head) {
+    rewind_get(pos, record, 1);
+    if (record[0] == PIC_JOURNAL_PROGRAM_OLD) {
+      rewind_get(pos, record, 5);
+      addr = (record[1] | (record[2] << 8)) % MEM_PROGRAM_MAX;
+      if (! (undone[addr / 8] & (1 << (addr % 8)))) {
+        undone[addr / 8] |= 1 << (addr % 8);
+        mem_program_set(pic->mem, addr, record[3] | (record[4] << 8));
+      }
+    }
+    pos += rewind_record(NULL, pos, &is_step, &pc);
+  }
+}
+
+
+
+static bool rewind_restore(pic_t *pic, uint64_t target)
+{
+  pic_reg_read_notify_hook_t reg_read_hook = pic->reg_read_hook;
+  pic_reg_write_notify_hook_t reg_write_hook = pic->reg_write_hook;
+  pic_input_notify_hook_t input_hook = pic->input_hook;
+  rewind_checkpoint_t *cp = NULL;
+  uint64_t pos;
+  uint64_t step;
+  uint16_t pc;
+  bool is_step;
+  int n;
+
+  for (n = rewind_checkpoint_used - 1; n >= 0; n--) {
+    cp = rewind_checkpoint_get(n);
+    if (cp->step <= target) {
+      break;
+    }
+  }
+  if (n < 0) {
+    return false;
+  }
+
+  /* Journal must not be recorded while replaying it, and replayed inputs
+   * must not reach a recording, VCD or the board peripherals. */
+  pic->journal_hook = NULL;
+  pic->reg_read_hook = NULL;
+  pic->reg_write_hook = NULL;
+  pic->input_hook = NULL;
+  rewind_checkpoint_restore(pic, cp);
+  rewind_program_undo(pic, cp->pos);
+  pos = cp->pos;
+  step = cp->step;
+  while (step < target && pos < rewind_head) {
+    pos += rewind_record(pic, pos, &is_step, &pc);
+    if (is_step) {
+      step++;
+    }
+  }
+  if (rewind_aegl != NULL) {
+    aegl_state_set(rewind_aegl, &rewind_board);
+  }
+  pic->journal_hook = rewind_journal_hook;
+  pic->reg_read_hook = reg_read_hook;
+  pic->reg_write_hook = reg_write_hook;
+  pic->input_hook = input_hook;
+
+  /* Discard the future that was just rewound. */
+  rewind_head = pos;
+  rewind_steps = step;
+  rewind_checkpoint_used = n + 1;
+  return true;
+}
+
+
+
+/* Journals the board state bytes changed since the last step. */
+static void rewind_board_diff(void)
+{
+  uint8_t *now = (uint8_t *)&rewind_board_now;
+  uint8_t *last = (uint8_t *)&rewind_board;
+  uint8_t record[5];
+
+  aegl_state_get(rewind_aegl, &rewind_board_now);
+  if (memcmp(now, last, sizeof(aegl_state_t)) == 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < sizeof(aegl_state_t); i++) {
+    if (now[i] != last[i]) {
+      record[0] = REWIND_BOARD;
+      record[1] = i & 0xFF;
+      record[2] = i >> 8;
+      record[3] = now[i];
+      record[4] = 0;
+      rewind_put(record, sizeof(record));
+      last[i] = now[i];
+    }
+  }
+}
+
+
+
+int rewind_init(pic_t *pic, aegl_t *aegl, size_t budget)
+{
+  rewind_checkpoint_max = budget /
+    (sizeof(rewind_checkpoint_t) + REWIND_SEGMENT + REWIND_SLACK);
+  if (rewind_checkpoint_max < 2) {
+    return -1;
+  }
+
+  rewind_journal_size = rewind_checkpoint_max *
+    (REWIND_SEGMENT + REWIND_SLACK);
+  rewind_journal = malloc(rewind_journal_size);
+  rewind_checkpoint = malloc(rewind_checkpoint_max *
+    sizeof(rewind_checkpoint_t));
+  if (rewind_journal == NULL || rewind_checkpoint == NULL) {
+    free(rewind_journal);
+    free(rewind_checkpoint);
+    rewind_journal = NULL;
+    rewind_checkpoint = NULL;
+    return -1;
+  }
+
+  rewind_checkpoint_first = 0;
+  rewind_checkpoint_used = 0;
+  rewind_head = 0;
+  rewind_steps = 0;
+  rewind_aegl = aegl;
+  if (aegl != NULL) {
+    aegl_state_get(aegl, &rewind_board);
+  }
+  rewind_checkpoint_take(pic);
+
+  pic->journal_hook = rewind_journal_hook;
+  return 0;
+}
+
+
+
+void rewind_step(pic_t *pic)
+{
+  uint8_t record[10];
+
+  if (rewind_aegl != NULL) {
+    rewind_board_diff();
+  }
+
+  record[0] = REWIND_STEP;
+  record[1] = pic->pc & 0xFF;
+  record[2] = pic->pc >> 8;
+  record[3] = pic->w;
+  record[4] = pic->r[PIC_REG_STATUS];
+  record[5] = pic->sp;
+  record[6] = pic->cycle & 0xFF;
+  record[7] = (pic->cycle >> 8) & 0xFF;
+  record[8] = (pic->cycle >> 16) & 0xFF;
+  record[9] = pic->cycle >> 24;
+  rewind_put(record, sizeof(record));
+  rewind_steps++;
+
+  if (rewind_head - rewind_checkpoint_get(rewind_checkpoint_used - 1)->pos
+    >= REWIND_SEGMENT) {
+    rewind_checkpoint_take(pic);
+  }
+}
+
+
+
+bool rewind_step_back(pic_t *pic)
+{
+  if (rewind_checkpoint_used == 0) {
+    return false;
+  }
+  if (rewind_steps <= rewind_checkpoint_get(0)->step) {
+    return false;
+  }
+  return rewind_restore(pic, rewind_steps - 1);
+}
+
+
+
+bool rewind_continue_back(pic_t *pic, int32_t breakpoint)
+{
+  rewind_checkpoint_t *cp;
+  uint64_t target;
+  uint64_t pos;
+  uint64_t step;
+  uint16_t pc;
+  bool is_step;
+
+  if (rewind_checkpoint_used == 0) {
+    return false;
+  }
+
+  /* Scan the whole journal for the last time the breakpoint was hit. */
+  cp = rewind_checkpoint_get(0);
+  target = cp->step;
+  step = cp->step;
+  pos = cp->pos;
+  while (pos < rewind_head) {
+    pos += rewind_record(NULL, pos, &is_step, &pc);
+    if (is_step) {
+      step++;
+      if (pc == breakpoint && step < rewind_steps) {
+        target = step;
+      }
+    }
+  }
+
+  if (target == rewind_steps) {
+    return false;
+  }
+  return rewind_restore(pic, target);
+}
+
+
+
@@ -0,0 +1,15 @@
+#ifndef _REWIND_H
+#define _REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "aegl.h"
+#include "pic.h"
+
+int rewind_init(pic_t *pic, aegl_t *aegl, size_t budget);
+void rewind_step(pic_t *pic);
+bool rewind_step_back(pic_t *pic);
+bool rewind_continue_back(pic_t *pic, int32_t breakpoint);
+
+#endif /* _REWIND_H */
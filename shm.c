@@ -0,0 +1,121 @@
+#include "shm.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pic.h"
+
+/* Live emulator state mapped into a POSIX shared memory segment, so local
+ * test tools can watch and drive a running emulator without any IPC round
+ * trips. The window is refreshed from the event scheduler every interval
+ * cycles, which keeps the cost per instruction at zero.
+ */
+
+static shm_window_t *shm_window = NULL;
+static char shm_name[256];
+static uint32_t shm_interval = SHM_DEFAULT_INTERVAL;
+
+
+
+static void shm_close_window(void)
+{
+  munmap(shm_window, sizeof(shm_window_t));
+  shm_window = NULL;
+  shm_unlink(shm_name);
+}
+
+
+
+int shm_open_window(pic_t *pic, const char *name, uint32_t interval)
+{
+  void *data;
+  int fd;
+
+  /* POSIX wants the name to start with a slash. */
+  snprintf(shm_name, sizeof(shm_name), "%s%s", name[0] == '/' ? "" : "/",
+    name);
+
+  fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (ftruncate(fd, sizeof(shm_window_t)) == -1) {
+    close(fd);
+    shm_unlink(shm_name);
+    return -1;
+  }
+
+  data = mmap(NULL, sizeof(shm_window_t), PROT_READ | PROT_WRITE,
+    MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    shm_unlink(shm_name);
+    return -1;
+  }
+
+  shm_window = data;
+  shm_interval = (interval > 0) ? interval : 1;
+
+  memset(shm_window, 0, sizeof(shm_window_t));
+  shm_window->version = SHM_VERSION;
+  shm_window->size = sizeof(shm_window_t);
+  shm_window->interval = shm_interval;
+  shm_window->pid = getpid();
+  shm_update(pic);
+
+  /* Magic goes last, so tools never see a half initialised window. */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(shm_window->magic, SHM_MAGIC, 8);
+
+  atexit(shm_close_window);
+  return 0;
+}
+
+
+
+uint32_t shm_update(pic_t *pic)
+{
+  shm_window_t *win = shm_window;
+  uint32_t input;
+  uint8_t in[5];
+
+  /* Take any pending input changes first, so they show up below. */
+  for (int i = 0; i < 5; i++) {
+    if (__atomic_load_n(&win->input[i], __ATOMIC_RELAXED) != 0) {
+      input = __atomic_exchange_n(&win->input[i], 0, __ATOMIC_ACQUIRE);
+      if (input & SHM_INPUT_PENDING) {
+        pic_port_input_set(pic, i, input & 0xFF);
+      }
+    }
+  }
+
+  in[0] = pic->in_porta;
+  in[1] = pic->in_portb;
+  in[2] = pic->in_portc;
+  in[3] = pic->in_portd;
+  in[4] = pic->in_porte;
+
+  __atomic_store_n(&win->seq, win->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  win->updates++;
+  win->cycle = pic->cycle;
+  win->pc = pic->pc;
+  win->w = pic->w;
+  win->status = pic->r[PIC_REG_STATUS];
+  win->sp = pic->sp;
+  for (int i = 0; i < 5; i++) {
+    win->port[i] = pic_port_pins(pic, i);
+    win->tris[i] = pic->r[PIC_REG_TRISA + i];
+    win->in_port[i] = in[i];
+  }
+
+  __atomic_store_n(&win->seq, win->seq + 1, __ATOMIC_RELEASE);
+
+  return pic->cycle + shm_interval;
+}
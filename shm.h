@@ -0,0 +1,51 @@
+#ifndef _SHM_H
+#define _SHM_H
+
+#include <stdint.h>
+#include "pic.h"
+
+#define SHM_MAGIC "PIC16SHM"
+#define SHM_VERSION 1
+#define SHM_DEFAULT_INTERVAL 10000
+
+#define SHM_INPUT_PENDING 0x100
+
+/* Layout of the shared memory window, all values in host (little) endian
+ * order. External tools map the segment read/write and should check the
+ * magic, version and size fields first.
+ *
+ * The live state is published under a sequence counter: it is odd while
+ * the emulator is updating, so a reader copies the state and retries if
+ * seq was odd or changed in the meantime.
+ *
+ * To set an input port, a tool stores SHM_INPUT_PENDING | value to
+ * input[port]. The emulator takes it at the next update and clears the
+ * word back to zero.
+ */
+typedef struct shm_window_s {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;
+  uint32_t interval; /* Cycles between updates. */
+  uint32_t pid;
+
+  uint32_t seq;
+  uint32_t updates;
+  uint32_t cycle;
+  uint16_t pc;
+  uint8_t w;
+  uint8_t status;
+  uint8_t sp;
+  uint8_t reserved[3];
+  uint8_t port[5]; /* Effective pin levels. */
+  uint8_t tris[5];
+  uint8_t in_port[5];
+  uint8_t reserved2;
+
+  uint32_t input[5];
+} shm_window_t;
+
+int shm_open_window(pic_t *pic, const char *name, uint32_t interval);
+uint32_t shm_update(pic_t *pic);
+
+#endif /* _SHM_H */
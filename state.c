@@ -0,0 +1,417 @@
+#include "state.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aegl.h"
+#include "i2c.h"
+#include "lcd.h"
+#include "mem.h"
+#include "pic.h"
+
+/* Checkpoint file layout, all values in host (little) endian order:
+ *
+ *   state_header_t
+ *   state_section_t + data
+ *   state_section_t + data
+ *   ...
+ *
+ * The checksum is a CRC-32 of everything following the header.
+ * Unknown sections are skipped when loading, so new sections can be
+ * added without bumping the version, as long as old ones keep their
+ * layout.
+ */
+
+#define STATE_MAGIC "PIC16CHU"
+#define STATE_VERSION 1
+
+#define STATE_TAG(a, b, c, d) \
+  ((uint32_t)(a) | ((uint32_t)(b) << 8) | \
+  ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define STATE_TAG_CORE STATE_TAG('C', 'O', 'R', 'E')
+#define STATE_TAG_PROG STATE_TAG('P', 'R', 'O', 'G')
+#define STATE_TAG_EEPR STATE_TAG('E', 'E', 'P', 'R')
+#define STATE_TAG_AEGL STATE_TAG('A', 'E', 'G', 'L')
+#define STATE_TAG_CONF STATE_TAG('C', 'O', 'N', 'F')
+#define STATE_TAG_LCD  STATE_TAG('L', 'C', 'D', 'P')
+#define STATE_TAG_I2C  STATE_TAG('I', '2', 'C', 'B')
+#define STATE_TAG_FLSH STATE_TAG('F', 'L', 'S', 'H')
+
+typedef struct state_header_s {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;
+  uint32_t checksum;
+  uint32_t sections;
+} state_header_t;
+
+typedef struct state_section_s {
+  uint32_t tag;
+  uint32_t size;
+} state_section_t;
+
+typedef struct state_core_s {
+  uint16_t pc;
+  uint8_t w;
+  uint8_t sp;
+  uint32_t cycle;
+  uint16_t stack[PIC_STACK_SIZE];
+  uint8_t in_port[5];
+  uint8_t r[PIC_REGISTER_MAX];
+} state_core_t;
+
+/* Self-write state, kept apart so CORE keeps its layout. */
+typedef struct state_flash_s {
+  uint8_t eecon2_unlock;
+  uint8_t reserved;
+  uint16_t flash_latch[PIC_FLASH_BLOCK];
+} state_flash_t;
+
+/* Board models added later have sections of their own. */
+typedef struct state_aegl_s {
+  uint8_t lcd_trace_porta;
+  uint8_t lcd_trace_portb;
+  uint8_t lcd_trace_portc;
+  uint8_t i2c_trace_trisc;
+  int32_t uart_delay;
+} state_aegl_t;
+
+
+
+static uint32_t state_crc32(const uint8_t *data, size_t size)
+{
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+    0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+  };
+  uint32_t crc = 0xFFFFFFFF;
+
+  while (size-- > 0) {
+    crc ^= *data++;
+    crc = (crc >> 4) ^ table[crc & 0xF];
+    crc = (crc >> 4) ^ table[crc & 0xF];
+  }
+
+  return ~crc;
+}
+
+
+
+static uint8_t *state_section_add(uint8_t *p, uint32_t tag,
+  const void *data, uint32_t size)
+{
+  state_section_t section;
+
+  section.tag = tag;
+  section.size = size;
+  memcpy(p, &section, sizeof(state_section_t));
+  p += sizeof(state_section_t);
+  memcpy(p, data, size);
+  return p + size;
+}
+
+
+
+int state_save(pic_t *pic, mem_t *mem, aegl_t *aegl, const char *filename)
+{
+  state_header_t header;
+  state_core_t core;
+  state_flash_t flash;
+  state_aegl_t aegl_core;
+  aegl_state_t aegl_state;
+  uint8_t *buffer;
+  uint8_t *p;
+  size_t size;
+  FILE *fh;
+
+  memset(&core, 0, sizeof(state_core_t));
+  core.pc = pic->pc;
+  core.w = pic->w;
+  core.sp = pic->sp;
+  core.cycle = pic->cycle;
+  memcpy(core.stack, pic->stack, sizeof(core.stack));
+  core.in_port[0] = pic->in_porta;
+  core.in_port[1] = pic->in_portb;
+  core.in_port[2] = pic->in_portc;
+  core.in_port[3] = pic->in_portd;
+  core.in_port[4] = pic->in_porte;
+  memcpy(core.r, pic->r, sizeof(core.r));
+
+  memset(&flash, 0, sizeof(state_flash_t));
+  flash.eecon2_unlock = pic->eecon2_unlock;
+  memcpy(flash.flash_latch, pic->flash_latch, sizeof(flash.flash_latch));
+
+  size = sizeof(state_header_t);
+  size += sizeof(state_section_t) + sizeof(state_core_t);
+  size += sizeof(state_section_t) + (MEM_PROGRAM_MAX * sizeof(uint16_t));
+  size += sizeof(state_section_t) + MEM_EEPROM_MAX;
+  size += sizeof(state_section_t) + sizeof(mem->config);
+  size += sizeof(state_section_t) + sizeof(state_flash_t);
+  if (aegl != NULL) {
+    aegl_state_get(aegl, &aegl_state);
+    memset(&aegl_core, 0, sizeof(state_aegl_t));
+    aegl_core.lcd_trace_porta = aegl_state.lcd_trace_porta;
+    aegl_core.lcd_trace_portb = aegl_state.lcd_trace_portb;
+    aegl_core.lcd_trace_portc = aegl_state.lcd_trace_portc;
+    aegl_core.i2c_trace_trisc = aegl_state.i2c_trace_trisc;
+    aegl_core.uart_delay = aegl_state.uart_delay;
+    size += sizeof(state_section_t) + sizeof(state_aegl_t);
+    size += sizeof(state_section_t) + sizeof(lcd_t);
+    size += sizeof(state_section_t) + sizeof(i2c_t);
+  }
+
+  buffer = malloc(size);
+  if (buffer == NULL) {
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(state_header_t));
+  memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+  header.version = STATE_VERSION;
+  header.size = size;
+  header.sections = (aegl != NULL) ? 8 : 5;
+
+  p = buffer + sizeof(state_header_t);
+  p = state_section_add(p, STATE_TAG_CORE, &core, sizeof(state_core_t));
+  p = state_section_add(p, STATE_TAG_PROG, mem->program,
+    MEM_PROGRAM_MAX * sizeof(uint16_t));
+  p = state_section_add(p, STATE_TAG_EEPR, mem->eeprom, MEM_EEPROM_MAX);
+  p = state_section_add(p, STATE_TAG_CONF, mem->config, sizeof(mem->config));
+  p = state_section_add(p, STATE_TAG_FLSH, &flash, sizeof(state_flash_t));
+  if (aegl != NULL) {
+    p = state_section_add(p, STATE_TAG_AEGL, &aegl_core,
+      sizeof(state_aegl_t));
+    p = state_section_add(p, STATE_TAG_LCD, &aegl_state.lcd, sizeof(lcd_t));
+    p = state_section_add(p, STATE_TAG_I2C, &aegl_state.i2c, sizeof(i2c_t));
+  }
+
+  header.checksum = state_crc32(buffer + sizeof(state_header_t),
+    size - sizeof(state_header_t));
+  memcpy(buffer, &header, sizeof(state_header_t));
+
+  fh = fopen(filename, "wb");
+  if (fh == NULL) {
+    free(buffer);
+    return -1;
+  }
+
+  if (fwrite(buffer, 1, size, fh) != size) {
+    fclose(fh);
+    free(buffer);
+    return -1;
+  }
+
+  free(buffer);
+  return fclose(fh) == 0 ? 0 : -1;
+}
+
+
+
+static int state_parse(pic_t *pic, mem_t *mem, aegl_t *aegl,
+  const uint8_t *data, size_t size)
+{
+  state_header_t header;
+  state_section_t section;
+  state_core_t core;
+  state_flash_t flash;
+  state_aegl_t aegl_core;
+  aegl_state_t aegl_state;
+  const uint8_t *prog = NULL;
+  const uint8_t *eeprom = NULL;
+  const uint8_t *config = NULL;
+  const uint8_t *p;
+  const uint8_t *end;
+  bool have_core = false;
+
+  if (size < sizeof(state_header_t)) {
+    return -1;
+  }
+  memcpy(&header, data, sizeof(state_header_t));
+
+  if (memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0) {
+    return -1;
+  }
+  if (header.version != STATE_VERSION || header.size != size) {
+    return -1;
+  }
+  if (header.checksum != state_crc32(data + sizeof(state_header_t),
+    size - sizeof(state_header_t))) {
+    return -1;
+  }
+
+  /* Older checkpoints without self-write state restore it to reset. */
+  memset(&flash, 0, sizeof(state_flash_t));
+
+  /* Board sections missing from older checkpoints keep the current state. */
+  if (aegl != NULL) {
+    aegl_state_get(aegl, &aegl_state);
+  }
+
+  p = data + sizeof(state_header_t);
+  end = data + size;
+  for (uint32_t i = 0; i < header.sections; i++) {
+    if ((size_t)(end - p) < sizeof(state_section_t)) {
+      return -1;
+    }
+    memcpy(&section, p, sizeof(state_section_t));
+    p += sizeof(state_section_t);
+    if ((size_t)(end - p) < section.size) {
+      return -1;
+    }
+
+    switch (section.tag) {
+    case STATE_TAG_CORE:
+      if (section.size != sizeof(state_core_t)) {
+        return -1;
+      }
+      memcpy(&core, p, sizeof(state_core_t));
+      if (core.sp > PIC_STACK_SIZE) {
+        return -1;
+      }
+      have_core = true;
+      break;
+
+    case STATE_TAG_PROG:
+      if (section.size != MEM_PROGRAM_MAX * sizeof(uint16_t)) {
+        return -1;
+      }
+      prog = p;
+      break;
+
+    case STATE_TAG_EEPR:
+      if (section.size != MEM_EEPROM_MAX) {
+        return -1;
+      }
+      eeprom = p;
+      break;
+
+    case STATE_TAG_CONF:
+      if (section.size != sizeof(mem->config)) {
+        return -1;
+      }
+      config = p;
+      break;
+
+    case STATE_TAG_FLSH:
+      if (section.size != sizeof(state_flash_t)) {
+        return -1;
+      }
+      memcpy(&flash, p, sizeof(state_flash_t));
+      if (flash.eecon2_unlock > 2) {
+        return -1;
+      }
+      break;
+
+    case STATE_TAG_AEGL:
+      if (section.size != sizeof(state_aegl_t)) {
+        return -1;
+      }
+      memcpy(&aegl_core, p, sizeof(state_aegl_t));
+      aegl_state.lcd_trace_porta = aegl_core.lcd_trace_porta;
+      aegl_state.lcd_trace_portb = aegl_core.lcd_trace_portb;
+      aegl_state.lcd_trace_portc = aegl_core.lcd_trace_portc;
+      aegl_state.i2c_trace_trisc = aegl_core.i2c_trace_trisc;
+      aegl_state.uart_delay = aegl_core.uart_delay;
+      break;
+
+    case STATE_TAG_LCD:
+      if (section.size != sizeof(lcd_t)) {
+        return -1;
+      }
+      memcpy(&aegl_state.lcd, p, sizeof(lcd_t));
+      break;
+
+    case STATE_TAG_I2C:
+      if (section.size != sizeof(i2c_t)) {
+        return -1;
+      }
+      memcpy(&aegl_state.i2c, p, sizeof(i2c_t));
+      break;
+
+    default:
+      break; /* Unknown section, skip. */
+    }
+
+    p += section.size;
+  }
+
+  if (! have_core) {
+    return -1;
+  }
+
+  /* Every section is valid, only now the instance is changed. The program
+   * goes first, as it is the only part that can still fail. */
+  if (prog != NULL && mem_program_load(mem, prog) != 0) {
+    return -1;
+  }
+  if (eeprom != NULL) {
+    memcpy(mem->eeprom, eeprom, MEM_EEPROM_MAX);
+    mem->eeprom_loaded = true;
+    mem_eeprom_dirty(mem, 0, MEM_EEPROM_MAX);
+  }
+  if (config != NULL) {
+    memcpy(mem->config, config, sizeof(mem->config));
+  }
+  if (aegl != NULL) {
+    aegl_state_set(aegl, &aegl_state);
+  }
+
+  pic->pc = core.pc;
+  pic->w = core.w;
+  pic->sp = core.sp;
+  pic->cycle = core.cycle;
+  memcpy(pic->stack, core.stack, sizeof(pic->stack));
+  pic->in_porta = core.in_port[0];
+  pic->in_portb = core.in_port[1];
+  pic->in_portc = core.in_port[2];
+  pic->in_portd = core.in_port[3];
+  pic->in_porte = core.in_port[4];
+  memcpy(pic->r, core.r, sizeof(pic->r));
+  pic->eecon2_unlock = flash.eecon2_unlock;
+  memcpy(pic->flash_latch, flash.flash_latch, sizeof(pic->flash_latch));
+
+  return 0;
+}
+
+
+
+int state_load(pic_t *pic, mem_t *mem, aegl_t *aegl, const char *filename)
+{
+  struct stat st;
+  void *data;
+  int result;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(state_header_t)) {
+    close(fd);
+    return -1;
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+
+  result = state_parse(pic, mem, aegl, data, st.st_size);
+
+  munmap(data, st.st_size);
+  return result;
+}
+
+
+
@@ -0,0 +1,13 @@
+#ifndef _STATE_H
+#define _STATE_H
+
+#include <stdbool.h>
+#include "aegl.h"
+#include "pic.h"
+#include "mem.h"
+
+/* The AE-GraphicLCD state is included if aegl is not NULL. */
+int state_save(pic_t *pic, mem_t *mem, aegl_t *aegl, const char *filename);
+int state_load(pic_t *pic, mem_t *mem, aegl_t *aegl, const char *filename);
+
+#endif /* _STATE_H */
@@ -0,0 +1,184 @@
+#include "stimulus.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pic.h"
+
+/* Stimulus file format, one change per line:
+ *
+ *   <cycle>,<target>,<value>
+ *
+ * The target is either a whole port "A" to "E" where the value is a hex
+ * byte, or a single pin "RA0" to "RE7" where the value is 0 or 1. The
+ * cycle is decimal or "0x" prefixed hex. Empty lines and lines starting
+ * with '#' are ignored.
+ */
+
+struct stimulus_change_s {
+  uint32_t cycle;
+  uint32_t line;
+  uint8_t port;
+  uint8_t mask; /* Zero when setting the whole port. */
+  uint8_t value;
+};
+
+
+
+static int stimulus_compare(const void *a, const void *b)
+{
+  const stimulus_change_t *sa = a;
+  const stimulus_change_t *sb = b;
+
+  if (sa->cycle != sb->cycle) {
+    return sa->cycle < sb->cycle ? -1 : 1;
+  }
+  /* Keep file order for changes on the same cycle. */
+  return sa->line < sb->line ? -1 : (sa->line > sb->line);
+}
+
+
+
+static int stimulus_parse(char *line, uint32_t line_no,
+  stimulus_change_t *s)
+{
+  char *target;
+  char *value;
+  char *end;
+
+  target = strchr(line, ',');
+  if (target == NULL) {
+    return -1;
+  }
+  *target++ = '\0';
+  value = strchr(target, ',');
+  if (value == NULL) {
+    return -1;
+  }
+  *value++ = '\0';
+
+  while (isspace((unsigned char)*target)) {
+    target++;
+  }
+
+  s->line = line_no;
+  s->cycle = strtoul(line, &end, 0);
+  if (end == line) {
+    return -1;
+  }
+
+  if (target[0] >= 'A' && target[0] <= 'E' &&
+    ! isalnum((unsigned char)target[1])) {
+    s->port = target[0] - 'A';
+    s->mask = 0;
+    s->value = strtoul(value, &end, 16);
+  } else if (target[0] == 'R' && target[1] >= 'A' && target[1] <= 'E' &&
+    target[2] >= '0' && target[2] <= '7') {
+    s->port = target[1] - 'A';
+    s->mask = 1 << (target[2] - '0');
+    s->value = strtoul(value, &end, 10) ? s->mask : 0;
+  } else {
+    return -1;
+  }
+  if (end == value) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+int stimulus_load(stimulus_t *stimulus, const char *filename)
+{
+  FILE *fh;
+  char line[128];
+  uint32_t line_no = 0;
+  size_t size = 0;
+  size_t count = 0;
+  stimulus_change_t *change = NULL;
+  stimulus_change_t *p;
+
+  fh = fopen(filename, "r");
+  if (fh == NULL) {
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fh) != NULL) {
+    line_no++;
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+      continue;
+    }
+
+    if (count == size) {
+      size = (size == 0) ? 64 : size * 2;
+      p = realloc(change, size * sizeof(stimulus_change_t));
+      if (p == NULL) {
+        free(change);
+        fclose(fh);
+        return -1;
+      }
+      change = p;
+    }
+
+    if (stimulus_parse(line, line_no, &change[count]) != 0) {
+      fprintf(stderr, "%s:%u: Invalid stimulus\n", filename, line_no);
+      free(change);
+      fclose(fh);
+      return -1;
+    }
+    count++;
+  }
+
+  fclose(fh);
+
+  qsort(change, count, sizeof(stimulus_change_t), stimulus_compare);
+  stimulus->change = change;
+  stimulus->count = count;
+  stimulus->index = 0;
+  return 0;
+}
+
+
+
+void stimulus_free(stimulus_t *stimulus)
+{
+  free((void *)stimulus->change);
+  stimulus->change = NULL;
+  stimulus->count = 0;
+  stimulus->index = 0;
+}
+
+
+
+uint32_t stimulus_apply(stimulus_t *stimulus, pic_t *pic)
+{
+  const stimulus_change_t *s;
+  uint8_t in[5];
+
+  while (stimulus->index < stimulus->count) {
+    s = &stimulus->change[stimulus->index];
+    if (s->cycle > pic->cycle) {
+      return s->cycle;
+    }
+    stimulus->index++;
+
+    in[0] = pic->in_porta;
+    in[1] = pic->in_portb;
+    in[2] = pic->in_portc;
+    in[3] = pic->in_portd;
+    in[4] = pic->in_porte;
+    if (s->mask == 0) {
+      pic_port_input_set(pic, s->port, s->value);
+    } else {
+      pic_port_input_set(pic, s->port, (in[s->port] & ~s->mask) | s->value);
+    }
+  }
+
+  return UINT32_MAX;
+}
+
+
+
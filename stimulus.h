@@ -0,0 +1,22 @@
+#ifndef _STIMULUS_H
+#define _STIMULUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pic.h"
+
+typedef struct stimulus_change_s stimulus_change_t;
+
+/* The change list is never modified after loading, so copies of a loaded
+ * stimulus_t can share it, each applying it with its own index. */
+typedef struct stimulus_s {
+  const stimulus_change_t *change;
+  size_t count;
+  size_t index;
+} stimulus_t;
+
+int stimulus_load(stimulus_t *stimulus, const char *filename);
+void stimulus_free(stimulus_t *stimulus);
+uint32_t stimulus_apply(stimulus_t *stimulus, pic_t *pic);
+
+#endif /* _STIMULUS_H */
@@ -0,0 +1,539 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "aegl.h"
+#include "mem.h"
+#include "pic.h"
+
+/* Parameter sweeps from a booted state. The firmware runs once up to a
+ * cycle count or breakpoint, after which one child process is forked per
+ * variant. Children start from the booted state through copy-on-write,
+ * apply their variant, run for the cycle budget and write their result
+ * to a pipe shared by all of them. At most one child per CPU runs at a
+ * time. Variants file format, one variant per line:
+ *
+ *   [porta=N] [portb=N] ... [porte=N] [eeprom=FILE] [uart=FILE]
+ *
+ * Port values set the input pins, an EEPROM file replaces the data
+ * EEPROM contents, and a UART file is fed to RCREG whenever the firmware
+ * polls PIR1 with RCIF clear, using the same conventions as --script.
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * The report has one tab separated line per variant in file order, with
+ * the result, the cycles and PC at the end, the number of bytes written
+ * to TXREG and FNV-1a hashes of those bytes and of the EEPROM.
+ */
+
+#define SWEEP_LINE_MAX 1024
+#define SWEEP_PORTS 5
+#define SWEEP_DEFAULT_CYCLES 1000000
+#define SWEEP_BREAKPOINT_CYCLES 100000000
+
+typedef struct sweep_variant_s {
+  uint32_t line;
+  int16_t port[SWEEP_PORTS]; /* -1 to keep the booted value. */
+  bool eeprom_set;
+  uint8_t eeprom[MEM_EEPROM_MAX];
+  uint8_t *uart;
+  size_t uart_size;
+} sweep_variant_t;
+
+/* Less than PIPE_BUF, so each write to the pipe is atomic. */
+typedef struct sweep_result_s {
+  uint32_t variant;
+  uint8_t done;
+  uint8_t panic;
+  uint16_t pc;
+  uint32_t cycles;
+  uint32_t uart_bytes;
+  uint64_t uart_hash;
+  uint64_t eeprom_hash;
+  char panic_msg[PIC_PANIC_MAX];
+} sweep_result_t;
+
+static sweep_variant_t *sweep_variants = NULL;
+static size_t sweep_variant_count = 0;
+static sweep_result_t *sweep_results = NULL;
+
+static aegl_t sweep_aegl;
+static mem_t sweep_mem;
+static pic_t sweep_pic;
+static bool sweep_aegl_mode = false;
+static pic_reg_write_notify_hook_t sweep_next_hook = NULL;
+static void *sweep_next_user = NULL;
+
+/* State of the variant run in a child. */
+static const sweep_variant_t *sweep_variant = NULL;
+static size_t sweep_uart_pos = 0;
+static sweep_result_t sweep_result;
+
+
+
+static int sweep_file_read(const char *filename, uint8_t **data,
+  size_t *size)
+{
+  FILE *fh;
+  long n;
+
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    return -1;
+  }
+  fseek(fh, 0, SEEK_END);
+  n = ftell(fh);
+  rewind(fh);
+  *data = malloc(n > 0 ? n : 1);
+  if (*data == NULL || fread(*data, 1, n, fh) != (size_t)n) {
+    free(*data);
+    fclose(fh);
+    return -1;
+  }
+  *size = n;
+  fclose(fh);
+  return 0;
+}
+
+
+
+static int sweep_variant_parse(sweep_variant_t *variant, char *line)
+{
+  char *token;
+  char *value;
+  uint8_t *data;
+  size_t size;
+
+  for (int i = 0; i < SWEEP_PORTS; i++) {
+    variant->port[i] = -1;
+  }
+
+  for (token = strtok(line, " \t\r\n"); token != NULL;
+    token = strtok(NULL, " \t\r\n")) {
+    value = strchr(token, '=');
+    if (value == NULL) {
+      return -1;
+    }
+    *value++ = '\0';
+
+    if (strlen(token) == 5 && strncmp(token, "port", 4) == 0 &&
+      token[4] >= 'a' && token[4] < 'a' + SWEEP_PORTS) {
+      variant->port[token[4] - 'a'] = strtoul(value, NULL, 0) & 0xFF;
+    } else if (strcmp(token, "eeprom") == 0) {
+      if (sweep_file_read(value, &data, &size) != 0) {
+        return -1;
+      }
+      memset(variant->eeprom, 0, MEM_EEPROM_MAX);
+      memcpy(variant->eeprom, data, size < MEM_EEPROM_MAX ?
+        size : MEM_EEPROM_MAX);
+      variant->eeprom_set = true;
+      free(data);
+    } else if (strcmp(token, "uart") == 0) {
+      free(variant->uart);
+      if (sweep_file_read(value, &variant->uart, &variant->uart_size) != 0) {
+        variant->uart = NULL;
+        return -1;
+      }
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+
+static int sweep_variants_load(const char *filename)
+{
+  char line[SWEEP_LINE_MAX];
+  uint32_t line_no = 0;
+  size_t size = 0;
+  sweep_variant_t *p;
+  FILE *fh;
+
+  fh = fopen(filename, "r");
+  if (fh == NULL) {
+    fprintf(stderr, "Unable to open variants: %s\n", filename);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fh) != NULL) {
+    line_no++;
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+      continue;
+    }
+
+    if (sweep_variant_count == size) {
+      size = (size == 0) ? 64 : size * 2;
+      p = realloc(sweep_variants, size * sizeof(sweep_variant_t));
+      if (p == NULL) {
+        fclose(fh);
+        return -1;
+      }
+      sweep_variants = p;
+    }
+
+    p = &sweep_variants[sweep_variant_count];
+    memset(p, 0, sizeof(sweep_variant_t));
+    p->line = line_no;
+    if (sweep_variant_parse(p, line) != 0) {
+      fprintf(stderr, "%s:%u: Invalid variant\n", filename, line_no);
+      fclose(fh);
+      return -1;
+    }
+    sweep_variant_count++;
+  }
+
+  fclose(fh);
+  return 0;
+}
+
+
+
+static void sweep_reg_read(pic_t *pic, void *user, uint16_t f)
+{
+  uint8_t c;
+
+  (void)user;
+  if (f != PIC_REG_PIR1 || sweep_variant == NULL ||
+    (pic->r[PIC_REG_PIR1] & 0x20)) {
+    return; /* Previous byte not taken yet. */
+  }
+
+  if (sweep_uart_pos < sweep_variant->uart_size) {
+    c = sweep_variant->uart[sweep_uart_pos++];
+    if (c == '\n') {
+      c = '\r';
+    } else if (c == '.') {
+      c = 0x1B;
+    }
+    pic_uart_rx_write(pic, c);
+  }
+}
+
+
+
+static void sweep_reg_write(pic_t *pic, void *user, uint16_t f)
+{
+  (void)user;
+  if (f == PIC_REG_TXREG && sweep_variant != NULL) {
+    sweep_result.uart_hash = mem_hash(sweep_result.uart_hash, &pic->r[f], 1);
+    sweep_result.uart_bytes++;
+  }
+
+  if (sweep_next_hook != NULL) {
+    (sweep_next_hook)(pic, sweep_next_user, f);
+  }
+}
+
+
+
+static void sweep_panic_hook(pic_t *pic, void *user)
+{
+  (void)pic;
+  (void)user;
+  sweep_result.panic = 1;
+}
+
+
+
+static int sweep_boot(const char *filename, uint32_t cycles,
+  int32_t breakpoint)
+{
+  if (mem_init(&sweep_mem) != 0 || mem_load(&sweep_mem, filename) != 0) {
+    fprintf(stderr, "Unable to load HEX file: %s\n", filename);
+    return -1;
+  }
+  pic_predecode(&sweep_mem); /* Once here instead of in every child. */
+
+  pic_init(&sweep_pic, &sweep_mem);
+  if (sweep_aegl_mode) {
+    aegl_init(&sweep_aegl, &sweep_pic);
+    aegl_uart_input(&sweep_aegl, NULL);
+  }
+  sweep_next_hook = sweep_pic.reg_write_hook;
+  sweep_next_user = sweep_pic.reg_write_user;
+  sweep_pic.reg_read_hook = sweep_reg_read;
+  sweep_pic.reg_write_hook = sweep_reg_write;
+  sweep_pic.panic_hook = sweep_panic_hook;
+
+  for (;;) {
+    if (breakpoint < 0 && sweep_pic.cycle >= cycles) {
+      return 0;
+    } else if (breakpoint >= 0 && (sweep_pic.pc & 0x1FFF) == breakpoint) {
+      return 0;
+    } else if (breakpoint >= 0 && sweep_pic.cycle >= cycles) {
+      fprintf(stderr, "Breakpoint 0x%04x not reached in %u cycles\n",
+        breakpoint, cycles);
+      return -1;
+    }
+
+    pic_execute(&sweep_pic, &sweep_mem);
+    if (sweep_result.panic) {
+      fprintf(stderr, "Panic during boot: %s", sweep_pic.panic_msg);
+      return -1;
+    }
+  }
+}
+
+
+
+static void sweep_child(size_t index, uint32_t budget, int fd)
+{
+  uint32_t end;
+
+  sweep_variant = &sweep_variants[index];
+  memset(&sweep_result, 0, sizeof(sweep_result));
+  sweep_result.variant = index;
+  sweep_result.uart_hash = MEM_HASH_INIT;
+
+  for (int i = 0; i < SWEEP_PORTS; i++) {
+    if (sweep_variant->port[i] >= 0) {
+      pic_port_input_set(&sweep_pic, i, sweep_variant->port[i]);
+    }
+  }
+  if (sweep_variant->eeprom_set) {
+    memcpy(sweep_mem.eeprom, sweep_variant->eeprom, MEM_EEPROM_MAX);
+  }
+
+  end = sweep_pic.cycle + budget;
+  while (sweep_pic.cycle < end && ! sweep_result.panic) {
+    pic_execute(&sweep_pic, &sweep_mem);
+  }
+
+  sweep_result.done = 1;
+  sweep_result.pc = sweep_pic.pc;
+  sweep_result.cycles = sweep_pic.cycle;
+  sweep_result.eeprom_hash = mem_hash(MEM_HASH_INIT,
+    sweep_mem.eeprom, MEM_EEPROM_MAX);
+  if (sweep_result.panic) {
+    strncpy(sweep_result.panic_msg, sweep_pic.panic_msg,
+      sizeof(sweep_result.panic_msg) - 1);
+  }
+  if (write(fd, &sweep_result, sizeof(sweep_result)) !=
+    sizeof(sweep_result)) {
+    _exit(EXIT_FAILURE);
+  }
+  _exit(EXIT_SUCCESS);
+}
+
+
+
+/* Returns the number of results read. */
+static int sweep_collect(int fd)
+{
+  sweep_result_t result;
+  int count = 0;
+
+  while (read(fd, &result, sizeof(result)) == sizeof(result)) {
+    if (result.variant < sweep_variant_count) {
+      sweep_results[result.variant] = result;
+    }
+    count++;
+  }
+  return count;
+}
+
+
+
+static int sweep_run(int workers, uint32_t budget)
+{
+  struct pollfd pfd;
+  size_t next = 0;
+  int running = 0;
+  int status;
+  int fd[2];
+  pid_t pid;
+
+  sweep_results = calloc(sweep_variant_count, sizeof(sweep_result_t));
+  if (sweep_results == NULL || pipe(fd) != 0) {
+    return -1;
+  }
+  fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+  while (next < sweep_variant_count || running > 0) {
+    if (next < sweep_variant_count && running < workers) {
+      fflush(NULL); /* Nothing buffered twice. */
+      pid = fork();
+      if (pid == 0) {
+        close(fd[0]);
+        sweep_child(next, budget, fd[1]);
+      } else if (pid > 0) {
+        next++;
+        running++;
+        continue;
+      } else if (running == 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        return -1;
+      }
+    }
+
+    /* Children block writing their result while the pipe is full, so it
+     * is drained instead of waiting for them to exit. A child is done
+     * once its result is read, or when it exits without one after a
+     * failure, which the timeout catches. */
+    pfd.fd = fd[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+      return -1;
+    }
+    running -= sweep_collect(fd[0]);
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      if (! WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        running--;
+      }
+    }
+  }
+
+  while (waitpid(-1, NULL, 0) > 0) {
+    /* Children that sent their result and have not exited yet. */
+  }
+  close(fd[0]);
+  close(fd[1]);
+  return 0;
+}
+
+
+
+static void sweep_report(FILE *fh)
+{
+  sweep_result_t *result;
+  char *p;
+
+  fprintf(fh, "#line\tresult\tcycles\tpc\tuart_bytes\tuart_hash\t"
+    "eeprom_hash\tmessage\n");
+  for (size_t i = 0; i < sweep_variant_count; i++) {
+    result = &sweep_results[i];
+    p = strchr(result->panic_msg, '\n');
+    if (p != NULL) {
+      *p = '\0';
+    }
+    fprintf(fh, "%u\t%s\t%u\t%04x\t%u\t%016llx\t%016llx\t%s\n",
+      sweep_variants[i].line,
+      ! result->done ? "error" : (result->panic ? "panic" : "budget"),
+      result->cycles, result->pc, result->uart_bytes,
+      (unsigned long long)result->uart_hash,
+      (unsigned long long)result->eeprom_hash, result->panic_msg);
+  }
+}
+
+
+
+static void display_help(const char *progname)
+{
+  fprintf(stdout, "Usage: %s <options> <hex-file> <variants>\n", progname);
+  fprintf(stdout, "Options:\n"
+    "  -h                Display this help.\n"
+    "  -a                Emulate the AE-GraphicLCD board.\n"
+    "  -b CYCLES         Boot for CYCLES before forking, default 0.\n"
+    "  -B ADDR           Boot until the PC reaches ADDR, at most -b cycles,\n"
+    "                    default %u.\n"
+    "  -c CYCLES         Run each variant for CYCLES, default %u.\n"
+    "  -j N              Run N variants in parallel, default is one per CPU.\n"
+    "  -o FILE           Write the report to FILE instead of stdout.\n"
+    "\n", SWEEP_BREAKPOINT_CYCLES, SWEEP_DEFAULT_CYCLES);
+  fprintf(stdout,
+    "Variant lines hold any of \"port<a-e>=N\", \"eeprom=FILE\" and\n"
+    "\"uart=FILE\".\n"
+    "\n");
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  char *report_filename = NULL;
+  uint32_t budget = SWEEP_DEFAULT_CYCLES;
+  uint32_t boot_cycles = 0;
+  int32_t breakpoint = -1;
+  int workers;
+  FILE *fh;
+  int c;
+
+  workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while ((c = getopt(argc, argv, "hab:B:c:j:o:")) != -1) {
+    switch (c) {
+    case 'h':
+      display_help(argv[0]);
+      return EXIT_SUCCESS;
+
+    case 'a':
+      sweep_aegl_mode = true;
+      break;
+
+    case 'b':
+      boot_cycles = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'B':
+      breakpoint = strtoul(optarg, NULL, 16) & 0x1FFF;
+      break;
+
+    case 'c':
+      budget = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'j':
+      workers = strtol(optarg, NULL, 10);
+      break;
+
+    case 'o':
+      report_filename = optarg;
+      break;
+
+    case '?':
+    default:
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 2) {
+    display_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (workers < 1) {
+    workers = 1;
+  }
+  if (breakpoint >= 0 && boot_cycles == 0) {
+    boot_cycles = SWEEP_BREAKPOINT_CYCLES;
+  }
+
+  if (sweep_variants_load(argv[optind + 1]) != 0) {
+    return EXIT_FAILURE;
+  }
+  if (sweep_boot(argv[optind], boot_cycles, breakpoint) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  if (sweep_run(workers, budget) != 0) {
+    fprintf(stderr, "Unable to run variants\n");
+    return EXIT_FAILURE;
+  }
+
+  if (report_filename != NULL) {
+    fh = fopen(report_filename, "w");
+    if (fh == NULL) {
+      fprintf(stderr, "Unable to write report: %s\n", report_filename);
+      return EXIT_FAILURE;
+    }
+    sweep_report(fh);
+    fclose(fh);
+  } else {
+    sweep_report(stdout);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+
@@ -0,0 +1,698 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aegl.h"
+#include "mem.h"
+#include "pic.h"
+
+/* Multi-chip system simulation, running each chip of a topology on its
+ * own thread. Topology format, one entry per line:
+ *
+ *   chip <name> <hex-file> [aegl]
+ *   uart <from> <to> [baud]
+ *   i2c <name> <name> ...
+ *
+ * A uart line wires the TX of one chip to the RX of another, 9600 baud
+ * by default. An i2c line joins RC3 (SCL) and RC4 (SDA) of its chips as
+ * open-drain lines with pull-ups. Chips marked aegl also get the
+ * AE-GraphicLCD board, whose EEPROM only sees the pins of its own chip.
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * Every signal crossing from one chip to another is pushed into a single
+ * producer, single consumer ring for that direction, stamped with the
+ * cycle it takes effect at the receiver. That is at least the lookahead
+ * after the cycle it was sent at: a UART byte arrives one byte time after
+ * it starts, and I2C levels arrive after a fixed latency. Chips run in
+ * quanta no longer than the lookahead, and a chip only starts a quantum
+ * once all others have finished the previous one, so every signal is in
+ * its ring before the receiver reaches its cycle. Results do not depend
+ * on thread scheduling.
+ *
+ * The report has one tab separated line per chip in topology order, with
+ * the result, the cycles and PC at the end, the number of bytes written
+ * to TXREG, an FNV-1a hash of those bytes, the number of received
+ * bytes lost to overruns and the number of sent bytes lost because a
+ * link was full. Nothing is sent to a chip that has stopped.
+ */
+
+#define SYSTEM_LINE_MAX 1024
+#define SYSTEM_CHIPS_MAX 16
+/* Enough for every chip to have both a UART and an I2C link to each other. */
+#define SYSTEM_CHIP_LINKS_MAX ((SYSTEM_CHIPS_MAX - 1) * 2)
+#define SYSTEM_LINKS_MAX (SYSTEM_CHIPS_MAX * SYSTEM_CHIP_LINKS_MAX)
+#define SYSTEM_QUEUE_SIZE 4096 /* Power of two. */
+#define SYSTEM_RX_FIFO 2
+#define SYSTEM_CYCLES_PER_SECOND 1000000 /* 4 MHz oscillator. */
+#define SYSTEM_DEFAULT_BAUD 9600
+#define SYSTEM_DEFAULT_CYCLES 1000000
+#define SYSTEM_DEFAULT_I2C_LATENCY 5
+
+#define SYSTEM_LINK_UART 0
+#define SYSTEM_LINK_I2C  1
+
+#define SYSTEM_I2C_LINES 0x18 /* RC3 and RC4. */
+
+typedef struct system_event_s {
+  uint32_t cycle; /* Cycle at which the receiver sees it. */
+  uint8_t value;
+} system_event_t;
+
+typedef struct system_queue_s {
+  atomic_uint head; /* Written by the producer only. */
+  atomic_uint tail; /* Written by the consumer only. */
+  system_event_t event[SYSTEM_QUEUE_SIZE];
+} system_queue_t;
+
+typedef struct system_chip_s system_chip_t;
+
+typedef struct system_link_s {
+  int type;
+  system_chip_t *from;
+  system_chip_t *to;
+  uint32_t delay; /* Byte time or I2C latency in cycles. */
+  uint8_t level; /* I2C lines not pulled low by the sender, as last seen. */
+  system_queue_t queue;
+} system_link_t;
+
+struct system_chip_s {
+  char *name;
+  mem_t mem;
+  pic_t pic;
+  aegl_t aegl;
+  bool aegl_mode;
+  pic_reg_read_notify_hook_t next_read_hook;
+  void *next_read_user;
+  pic_reg_write_notify_hook_t next_write_hook;
+  void *next_write_user;
+  system_link_t *in[SYSTEM_CHIP_LINKS_MAX];
+  int in_count;
+  system_link_t *out[SYSTEM_CHIP_LINKS_MAX];
+  int out_count;
+  uint32_t tx_delay; /* Byte time of the slowest outgoing UART, or 0. */
+  uint32_t tx_free; /* Cycle at which the last byte sent has left. */
+  uint8_t rx[SYSTEM_RX_FIFO];
+  int rx_count;
+  bool i2c_bus;
+  uint8_t i2c_local; /* I2C lines as seen without the other chips. */
+  uint8_t i2c_drive; /* I2C lines not pulled low, as last sent. */
+  atomic_uint done; /* All cycles before this have been run. */
+  pthread_t thread;
+  /* Results. */
+  bool panic;
+  uint32_t uart_bytes;
+  uint64_t uart_hash;
+  uint32_t overruns;
+  uint32_t lost;
+};
+
+static system_chip_t system_chips[SYSTEM_CHIPS_MAX];
+static int system_chip_count = 0;
+static system_link_t *system_links[SYSTEM_LINKS_MAX];
+static int system_link_count = 0;
+static uint32_t system_i2c_latency = SYSTEM_DEFAULT_I2C_LATENCY;
+static uint32_t system_quantum = 0;
+static uint32_t system_budget = SYSTEM_DEFAULT_CYCLES;
+
+
+
+static bool system_queue_push(system_queue_t *queue, uint32_t cycle,
+  uint8_t value)
+{
+  unsigned int head;
+
+  head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) ==
+    SYSTEM_QUEUE_SIZE) {
+    return false;
+  }
+  queue->event[head % SYSTEM_QUEUE_SIZE].cycle = cycle;
+  queue->event[head % SYSTEM_QUEUE_SIZE].value = value;
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
+
+
+
+/* The oldest event if it is due by the given cycle, or NULL. */
+static system_event_t *system_queue_peek(system_queue_t *queue,
+  uint32_t cycle)
+{
+  unsigned int tail;
+  system_event_t *event;
+
+  tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  if (tail == atomic_load_explicit(&queue->head, memory_order_acquire)) {
+    return NULL;
+  }
+  event = &queue->event[tail % SYSTEM_QUEUE_SIZE];
+  return (event->cycle <= cycle) ? event : NULL;
+}
+
+
+
+static void system_queue_pop(system_queue_t *queue)
+{
+  unsigned int tail;
+
+  tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+
+
+static system_chip_t *system_chip_get(const char *name)
+{
+  for (int i = 0; i < system_chip_count; i++) {
+    if (strcmp(system_chips[i].name, name) == 0) {
+      return &system_chips[i];
+    }
+  }
+  return NULL;
+}
+
+
+
+static int system_link_add(int type, system_chip_t *from, system_chip_t *to,
+  uint32_t delay)
+{
+  system_link_t *link;
+
+  if (from == to || system_link_count == SYSTEM_LINKS_MAX ||
+    from->out_count == SYSTEM_CHIP_LINKS_MAX ||
+    to->in_count == SYSTEM_CHIP_LINKS_MAX) {
+    return -1;
+  }
+
+  link = calloc(1, sizeof(system_link_t));
+  if (link == NULL) {
+    return -1;
+  }
+  link->type = type;
+  link->from = from;
+  link->to = to;
+  link->delay = delay;
+  link->level = SYSTEM_I2C_LINES;
+
+  if (type == SYSTEM_LINK_UART && delay > from->tx_delay) {
+    from->tx_delay = delay;
+  } else if (type == SYSTEM_LINK_I2C) {
+    from->i2c_bus = true;
+  }
+  from->out[from->out_count++] = link;
+  to->in[to->in_count++] = link;
+  system_links[system_link_count++] = link;
+  return 0;
+}
+
+
+
+static int system_chip_add(const char *name, const char *filename,
+  bool aegl_mode)
+{
+  system_chip_t *chip;
+
+  if (system_chip_count == SYSTEM_CHIPS_MAX || system_chip_get(name) != NULL) {
+    return -1;
+  }
+
+  chip = &system_chips[system_chip_count];
+  memset(chip, 0, sizeof(system_chip_t));
+  if (mem_init(&chip->mem) != 0) {
+    return -1;
+  }
+  if (mem_load(&chip->mem, filename) != 0) {
+    fprintf(stderr, "Unable to load HEX file: %s\n", filename);
+    mem_free(&chip->mem);
+    return -1;
+  }
+  chip->name = strdup(name);
+  chip->aegl_mode = aegl_mode;
+  chip->uart_hash = MEM_HASH_INIT;
+  chip->i2c_local = SYSTEM_I2C_LINES;
+  chip->i2c_drive = SYSTEM_I2C_LINES;
+  system_chip_count++;
+  return 0;
+}
+
+
+
+static int system_topology_line(char *line)
+{
+  char *token[SYSTEM_CHIPS_MAX + 2];
+  system_chip_t *from;
+  system_chip_t *to;
+  uint32_t baud;
+  int count = 0;
+
+  for (char *p = strtok(line, " \t\r\n"); p != NULL;
+    p = strtok(NULL, " \t\r\n")) {
+    if (count == SYSTEM_CHIPS_MAX + 2) {
+      return -1;
+    }
+    token[count++] = p;
+  }
+
+  if (strcmp(token[0], "chip") == 0 && (count == 3 || count == 4)) {
+    if (count == 4 && strcmp(token[3], "aegl") != 0) {
+      return -1;
+    }
+    return system_chip_add(token[1], token[2], count == 4);
+  } else if (strcmp(token[0], "uart") == 0 && (count == 3 || count == 4)) {
+    from = system_chip_get(token[1]);
+    to = system_chip_get(token[2]);
+    baud = (count == 4) ? strtoul(token[3], NULL, 0) : SYSTEM_DEFAULT_BAUD;
+    if (from == NULL || to == NULL || baud == 0 ||
+      baud > SYSTEM_CYCLES_PER_SECOND * 10) {
+      return -1;
+    }
+    /* Start bit, 8 data bits and a stop bit. */
+    return system_link_add(SYSTEM_LINK_UART, from, to,
+      SYSTEM_CYCLES_PER_SECOND * 10 / baud);
+  } else if (strcmp(token[0], "i2c") == 0 && count >= 3) {
+    for (int i = 1; i < count; i++) {
+      for (int j = 1; j < count; j++) {
+        from = system_chip_get(token[i]);
+        to = system_chip_get(token[j]);
+        if (from == NULL || to == NULL) {
+          return -1;
+        }
+        if (i != j && system_link_add(SYSTEM_LINK_I2C, from, to,
+          system_i2c_latency) != 0) {
+          return -1;
+        }
+      }
+    }
+    return 0;
+  }
+  return -1;
+}
+
+
+
+static int system_topology_load(const char *filename)
+{
+  char line[SYSTEM_LINE_MAX];
+  uint32_t line_no = 0;
+  FILE *fh;
+
+  fh = fopen(filename, "r");
+  if (fh == NULL) {
+    fprintf(stderr, "Unable to open topology: %s\n", filename);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fh) != NULL) {
+    line_no++;
+    if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) {
+      continue;
+    }
+    if (system_topology_line(line) != 0) {
+      fprintf(stderr, "%s:%u: Invalid topology entry\n", filename, line_no);
+      fclose(fh);
+      return -1;
+    }
+  }
+
+  fclose(fh);
+  if (system_chip_count == 0) {
+    fprintf(stderr, "%s: No chips\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+
+
+static void system_i2c_apply(system_chip_t *chip)
+{
+  uint8_t level = chip->i2c_local;
+
+  for (int i = 0; i < chip->in_count; i++) {
+    if (chip->in[i]->type == SYSTEM_LINK_I2C) {
+      level &= chip->in[i]->level;
+    }
+  }
+  chip->pic.in_portc = (chip->pic.in_portc & ~SYSTEM_I2C_LINES) | level;
+}
+
+
+
+static void system_send(system_chip_t *chip, int type, uint32_t cycle,
+  uint8_t value)
+{
+  system_link_t *link;
+
+  for (int i = 0; i < chip->out_count; i++) {
+    link = chip->out[i];
+    if (link->type != type || atomic_load_explicit(&link->to->done,
+      memory_order_acquire) == UINT32_MAX) {
+      continue;
+    }
+    if (system_queue_push(&link->queue, cycle + link->delay, value)) {
+      continue;
+    }
+    if (type == SYSTEM_LINK_UART) {
+      chip->lost++;
+    } else {
+      pic_panic(&chip->pic, "Link to %s full\n", link->to->name);
+    }
+  }
+}
+
+
+
+static void system_reg_read(pic_t *pic, void *user, uint16_t f)
+{
+  system_chip_t *chip = user;
+
+  if (chip->next_read_hook != NULL) {
+    (chip->next_read_hook)(pic, chip->next_read_user, f);
+  }
+
+  /* TXREG is free once at most one byte is left in the shift register,
+   * and the shift register is empty once the last byte has left. */
+  if (f == PIC_REG_PIR1 && chip->tx_free > pic->cycle + chip->tx_delay) {
+    pic->r[PIC_REG_PIR1] &= ~0x10;
+  } else if (f == PIC_REG_TXSTA && chip->tx_free > pic->cycle) {
+    pic->r[PIC_REG_TXSTA] &= ~0x02;
+  }
+}
+
+
+
+static void system_reg_write(pic_t *pic, void *user, uint16_t f)
+{
+  system_chip_t *chip = user;
+  uint8_t drive;
+
+  if (chip->next_write_hook != NULL) {
+    (chip->next_write_hook)(pic, chip->next_write_user, f);
+  }
+
+  switch (f) {
+  case PIC_REG_TXREG:
+    chip->uart_hash = mem_hash(chip->uart_hash, &pic->r[f], 1);
+    chip->uart_bytes++;
+    if (chip->tx_delay > 0) {
+      /* The byte starts once the previous one has left. */
+      if (chip->tx_free < pic->cycle) {
+        chip->tx_free = pic->cycle;
+      }
+      system_send(chip, SYSTEM_LINK_UART, chip->tx_free, pic->r[f]);
+      chip->tx_free += chip->tx_delay;
+    }
+    break;
+
+  case PIC_REG_PORTC:
+  case PIC_REG_TRISC:
+    if (! chip->i2c_bus) {
+      break;
+    }
+    /* The board EEPROM may hold SDA low. Taken from the model, since
+     * in_portc already has the other chips folded in. */
+    if (chip->aegl_mode) {
+      chip->i2c_local = chip->aegl.i2c.sda_slave_low ?
+        (SYSTEM_I2C_LINES & ~0x10) : SYSTEM_I2C_LINES;
+    }
+    /* Open-drain lines, only driven low when the TRIS bit is cleared. */
+    drive = (pic->r[PIC_REG_TRISC] | pic->r[PIC_REG_PORTC]) &
+      SYSTEM_I2C_LINES;
+    if (drive != chip->i2c_drive) {
+      chip->i2c_drive = drive;
+      system_send(chip, SYSTEM_LINK_I2C, pic->cycle, drive);
+    }
+    system_i2c_apply(chip);
+    break;
+  }
+}
+
+
+
+static void system_panic_hook(pic_t *pic, void *user)
+{
+  system_chip_t *chip = user;
+
+  (void)pic;
+  chip->panic = true;
+}
+
+
+
+static void system_deliver(system_chip_t *chip)
+{
+  system_link_t *link;
+  system_event_t *event;
+  bool i2c = false;
+
+  for (int i = 0; i < chip->in_count; i++) {
+    link = chip->in[i];
+    while ((event = system_queue_peek(&link->queue, chip->pic.cycle)) !=
+      NULL) {
+      if (link->type == SYSTEM_LINK_I2C) {
+        link->level = event->value;
+        i2c = true;
+      } else if (chip->rx_count < SYSTEM_RX_FIFO) {
+        chip->rx[chip->rx_count++] = event->value;
+      } else {
+        chip->overruns++;
+      }
+      system_queue_pop(&link->queue);
+    }
+  }
+
+  if (i2c) {
+    system_i2c_apply(chip);
+  }
+  if (chip->rx_count > 0 && ! (chip->pic.r[PIC_REG_PIR1] & 0x20)) {
+    pic_uart_rx_write(&chip->pic, chip->rx[0]);
+    memmove(chip->rx, chip->rx + 1, --chip->rx_count);
+  }
+}
+
+
+
+static void system_wait(system_chip_t *chip, uint32_t cycle)
+{
+  for (int i = 0; i < system_chip_count; i++) {
+    if (&system_chips[i] == chip) {
+      continue;
+    }
+    while (atomic_load_explicit(&system_chips[i].done,
+      memory_order_acquire) < cycle) {
+      sched_yield();
+    }
+  }
+}
+
+
+
+static void *system_thread(void *arg)
+{
+  system_chip_t *chip = arg;
+  uint32_t start;
+  uint32_t end;
+
+  for (start = 0; start < system_budget && ! chip->panic; start = end) {
+    end = start + system_quantum;
+    if (end > system_budget) {
+      end = system_budget;
+    }
+
+    system_wait(chip, start);
+    while (chip->pic.cycle < end && ! chip->panic) {
+      system_deliver(chip);
+      pic_execute(&chip->pic, &chip->mem);
+    }
+    atomic_store_explicit(&chip->done, end, memory_order_release);
+  }
+
+  /* Nothing more will be sent, so nobody needs to wait for this one. */
+  atomic_store_explicit(&chip->done, UINT32_MAX, memory_order_release);
+  return NULL;
+}
+
+
+
+static void system_chip_init(system_chip_t *chip)
+{
+  pic_t *pic = &chip->pic;
+
+  pic_init(pic, &chip->mem);
+  if (chip->aegl_mode) {
+    aegl_init(&chip->aegl, pic);
+    aegl_uart_input(&chip->aegl, NULL);
+  }
+  chip->next_read_hook = pic->reg_read_hook;
+  chip->next_read_user = pic->reg_read_user;
+  chip->next_write_hook = pic->reg_write_hook;
+  chip->next_write_user = pic->reg_write_user;
+  pic->reg_read_hook = system_reg_read;
+  pic->reg_read_user = chip;
+  pic->reg_write_hook = system_reg_write;
+  pic->reg_write_user = chip;
+  pic->panic_hook = system_panic_hook;
+  pic->panic_user = chip;
+  if (chip->i2c_bus) {
+    system_i2c_apply(chip);
+  }
+}
+
+
+
+static int system_run(void)
+{
+  uint32_t lookahead = UINT32_MAX;
+
+  for (int i = 0; i < system_link_count; i++) {
+    if (system_links[i]->delay < lookahead) {
+      lookahead = system_links[i]->delay;
+    }
+  }
+  if (lookahead == 0) {
+    fprintf(stderr, "Links need a delay of at least one cycle\n");
+    return -1;
+  }
+  if (system_quantum == 0 || system_quantum > lookahead) {
+    system_quantum = lookahead;
+  }
+  if (system_quantum > system_budget) {
+    system_quantum = system_budget;
+  }
+
+  for (int i = 0; i < system_chip_count; i++) {
+    system_chip_init(&system_chips[i]);
+  }
+  for (int i = 0; i < system_chip_count; i++) {
+    if (pthread_create(&system_chips[i].thread, NULL, system_thread,
+      &system_chips[i]) != 0) {
+      /* Let the started ones finish before giving up. */
+      for (int j = i; j < system_chip_count; j++) {
+        atomic_store(&system_chips[j].done, UINT32_MAX);
+      }
+      for (int j = 0; j < i; j++) {
+        pthread_join(system_chips[j].thread, NULL);
+      }
+      return -1;
+    }
+  }
+  for (int i = 0; i < system_chip_count; i++) {
+    pthread_join(system_chips[i].thread, NULL);
+  }
+  return 0;
+}
+
+
+
+static void system_report(FILE *fh)
+{
+  system_chip_t *chip;
+  char *p;
+
+  fprintf(fh, "#chip\tresult\tcycles\tpc\tuart_bytes\tuart_hash\t"
+    "overruns\tlost\tmessage\n");
+  for (int i = 0; i < system_chip_count; i++) {
+    chip = &system_chips[i];
+    p = strchr(chip->pic.panic_msg, '\n');
+    if (p != NULL) {
+      *p = '\0';
+    }
+    fprintf(fh, "%s\t%s\t%u\t%04x\t%u\t%016llx\t%u\t%u\t%s\n",
+      chip->name, chip->panic ? "panic" : "budget", chip->pic.cycle,
+      chip->pic.pc, chip->uart_bytes, (unsigned long long)chip->uart_hash,
+      chip->overruns, chip->lost, chip->panic ? chip->pic.panic_msg : "");
+  }
+}
+
+
+
+static void display_help(const char *progname)
+{
+  fprintf(stdout, "Usage: %s <options> <topology>\n", progname);
+  fprintf(stdout, "Options:\n"
+    "  -h                Display this help.\n"
+    "  -c CYCLES         Run every chip for CYCLES, default %u.\n"
+    "  -i CYCLES         Latency of I2C lines between chips, default %u.\n"
+    "  -q CYCLES         Synchronise chips every CYCLES, at most the\n"
+    "                    shortest UART byte time or I2C latency.\n"
+    "  -o FILE           Write the report to FILE instead of stdout.\n"
+    "\n", SYSTEM_DEFAULT_CYCLES, SYSTEM_DEFAULT_I2C_LATENCY);
+  fprintf(stdout,
+    "Topology lines are \"chip <name> <hex-file> [aegl]\",\n"
+    "\"uart <from> <to> [baud]\" and \"i2c <name> <name> ...\".\n"
+    "\n");
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  char *report_filename = NULL;
+  FILE *fh;
+  int c;
+
+  while ((c = getopt(argc, argv, "hc:i:q:o:")) != -1) {
+    switch (c) {
+    case 'h':
+      display_help(argv[0]);
+      return EXIT_SUCCESS;
+
+    case 'c':
+      system_budget = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'i':
+      system_i2c_latency = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'q':
+      system_quantum = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'o':
+      report_filename = optarg;
+      break;
+
+    case '?':
+    default:
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 1) {
+    display_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (system_topology_load(argv[optind]) != 0) {
+    return EXIT_FAILURE;
+  }
+  if (system_run() != 0) {
+    fprintf(stderr, "Unable to run system\n");
+    return EXIT_FAILURE;
+  }
+
+  if (report_filename != NULL) {
+    fh = fopen(report_filename, "w");
+    if (fh == NULL) {
+      fprintf(stderr, "Unable to write report: %s\n", report_filename);
+      return EXIT_FAILURE;
+    }
+    system_report(fh);
+    fclose(fh);
+  } else {
+    system_report(stdout);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+
@@ -0,0 +1,215 @@
+#include "trace.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Trace events are appended by the emulator to a single producer, single
+ * consumer ring without taking any locks. A writer thread drains the ring
+ * and either formats the events as text or stores them as is in a binary
+ * file, which "tracedump" turns back into text later.
+ *
+ * Binary file layout, all values in host (little) endian order:
+ *
+ *   "PIC16TRC" + uint32_t version
+ *   trace_event_t
+ *   trace_event_t
+ *   ...
+ */
+
+#define TRACE_RING_SIZE 65536 /* Must be a power of two. */
+#define TRACE_IDLE_NS 200000
+
+static trace_event_t trace_ring[TRACE_RING_SIZE];
+static _Atomic uint32_t trace_head = 0; /* Written by emulator only. */
+static _Atomic uint32_t trace_tail = 0; /* Written by writer only. */
+static _Atomic uint32_t trace_flushed = 0;
+static atomic_bool trace_done = false;
+
+static FILE *trace_fh = NULL;
+static bool trace_binary = false;
+static pthread_t trace_thread;
+
+
+
+void trace_format(FILE *fh, const trace_event_t *event)
+{
+  bool cs1, cs2, rw, type, reset, enable, scl, sda;
+
+  switch (event->source) {
+  case TRACE_SOURCE_LCD:
+    cs1    = event->field[0] & 0x08;
+    cs2    = event->field[0] & 0x20;
+    rw     = event->field[1] & 0x01;
+    type   = event->field[1] & 0x02;
+    reset  = event->field[1] & 0x04;
+    enable = event->field[1] & 0x20;
+    fprintf(fh, "LCD | %08x %s %s %s %s %s %s %02x\n",
+      event->cycle,
+      cs1    ? "-  "   : "CS1",
+      cs2    ? "-  "   : "CS2",
+      reset  ? "Rst"   : "-  ",
+      enable ? "En"    : "- ",
+      rw     ? "Read " : "Write",
+      type   ? "Data"  : "Cmd ",
+      event->field[2]);
+    break;
+
+  case TRACE_SOURCE_I2C:
+    scl = event->field[0] & 0x08;
+    sda = event->field[0] & 0x10;
+    fprintf(fh, "I2C | %08x %s %s\n",
+      event->cycle,
+      scl ? "SCL" : "-  ",
+      sda ? "SDA" : "-  ");
+    break;
+
+  case TRACE_SOURCE_TXREG:
+    fprintf(fh, "TXREG | 0x%02x\n", event->field[0]);
+    break;
+
+  default:
+    break;
+  }
+}
+
+
+
+static void trace_drain(void)
+{
+  uint32_t head = atomic_load_explicit(&trace_head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit(&trace_tail, memory_order_relaxed);
+  trace_event_t *event;
+
+  while (tail != head) {
+    event = &trace_ring[tail & (TRACE_RING_SIZE - 1)];
+    if (trace_binary) {
+      fwrite(event, sizeof(trace_event_t), 1, trace_fh);
+    } else {
+      trace_format(trace_fh, event);
+    }
+    tail++;
+    atomic_store_explicit(&trace_tail, tail, memory_order_release);
+  }
+}
+
+
+
+static void *trace_writer(void *arg)
+{
+  struct timespec idle = {0, TRACE_IDLE_NS};
+  uint32_t tail;
+  bool done;
+
+  (void)arg;
+
+  while (1) {
+    done = atomic_load(&trace_done);
+    trace_drain();
+
+    /* Only flush when caught up, so the output is written in large chunks. */
+    tail = atomic_load_explicit(&trace_tail, memory_order_relaxed);
+    if (tail != atomic_load(&trace_flushed)) {
+      fflush(trace_fh);
+      atomic_store(&trace_flushed, tail);
+    }
+
+    if (done) {
+      break;
+    }
+    nanosleep(&idle, NULL);
+  }
+
+  return NULL;
+}
+
+
+
+void trace_event(uint32_t cycle, uint8_t source, uint8_t a, uint8_t b,
+  uint8_t c)
+{
+  uint32_t head;
+  trace_event_t *event;
+
+  if (trace_fh == NULL) {
+    return;
+  }
+
+  head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&trace_tail, memory_order_acquire) >=
+    TRACE_RING_SIZE) {
+    sched_yield(); /* Ring full, let the writer catch up. */
+  }
+
+  event = &trace_ring[head & (TRACE_RING_SIZE - 1)];
+  event->cycle = cycle;
+  event->source = source;
+  event->field[0] = a;
+  event->field[1] = b;
+  event->field[2] = c;
+  atomic_store_explicit(&trace_head, head + 1, memory_order_release);
+}
+
+
+
+void trace_sync(void)
+{
+  uint32_t head;
+
+  if (trace_fh == NULL) {
+    return;
+  }
+
+  head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+  while (atomic_load(&trace_flushed) != head) {
+    sched_yield();
+  }
+}
+
+
+
+static void trace_close(void)
+{
+  atomic_store(&trace_done, true);
+  pthread_join(trace_thread, NULL);
+
+  if (trace_fh != stdout) {
+    fclose(trace_fh);
+  }
+  trace_fh = NULL;
+}
+
+
+
+int trace_open(const char *filename)
+{
+  uint32_t version = TRACE_VERSION;
+
+  if (filename == NULL) {
+    trace_fh = stdout;
+    trace_binary = false;
+  } else {
+    trace_fh = fopen(filename, "wb");
+    if (trace_fh == NULL) {
+      return -1;
+    }
+    trace_binary = true;
+    fwrite(TRACE_MAGIC, 1, 8, trace_fh);
+    fwrite(&version, sizeof(uint32_t), 1, trace_fh);
+  }
+
+  if (pthread_create(&trace_thread, NULL, trace_writer, NULL) != 0) {
+    if (trace_fh != stdout) {
+      fclose(trace_fh);
+    }
+    trace_fh = NULL;
+    return -1;
+  }
+
+  atexit(trace_close);
+  return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC "PIC16TRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 12
+
+#define TRACE_SOURCE_LCD   1 /* PORTA, PORTC, PORTB */
+#define TRACE_SOURCE_I2C   2 /* TRISC */
+#define TRACE_SOURCE_TXREG 3 /* TXREG */
+
+typedef struct trace_event_s {
+  uint32_t cycle;
+  uint8_t source;
+  uint8_t field[3];
+} trace_event_t;
+
+int trace_open(const char *filename);
+void trace_event(uint32_t cycle, uint8_t source, uint8_t a, uint8_t b,
+  uint8_t c);
+void trace_sync(void);
+void trace_format(FILE *fh, const trace_event_t *event);
+
+#endif /* _TRACE_H */
@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/* Decodes a binary trace file written with "--trace" into the same text
+ * format that is printed on stdout by default.
+ */
+
+int main(int argc, char *argv[])
+{
+  char magic[8];
+  uint32_t version;
+  trace_event_t event;
+  FILE *fh;
+
+  if (argc != 2) {
+    fprintf(stdout, "Usage: %s <trace-file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  fh = fopen(argv[1], "rb");
+  if (fh == NULL) {
+    fprintf(stderr, "Unable to open trace file: %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  if (fread(magic, 1, 8, fh) != 8 ||
+    fread(&version, sizeof(uint32_t), 1, fh) != 1 ||
+    memcmp(magic, TRACE_MAGIC, 8) != 0 || version != TRACE_VERSION) {
+    fprintf(stderr, "Not a trace file: %s\n", argv[1]);
+    fclose(fh);
+    return EXIT_FAILURE;
+  }
+
+  while (fread(&event, sizeof(trace_event_t), 1, fh) == 1) {
+    trace_format(stdout, &event);
+  }
+
+  fclose(fh);
+  return EXIT_SUCCESS;
+}
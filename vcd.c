@@ -0,0 +1,307 @@
+#include "vcd.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pic.h"
+
+/* The emulator only appends small binary change records to a buffer.
+ * When the buffer is full it is handed over to the writer thread, which
+ * formats the records as VCD text and writes them to disk, while the
+ * emulator continues with the other buffer.
+ */
+
+#define VCD_BUFFER_RECORDS 65536
+#define VCD_PORTS 5
+
+typedef struct vcd_record_s {
+  uint32_t cycle;
+  uint8_t port;
+  uint8_t pins;
+  uint8_t tris;
+} vcd_record_t;
+
+static FILE *vcd_fh = NULL;
+static pic_reg_write_notify_hook_t vcd_next_hook = NULL;
+static void *vcd_next_user = NULL;
+
+static vcd_record_t *vcd_buffer[2] = {NULL, NULL};
+static int vcd_active = 0;
+static size_t vcd_fill = 0;
+
+static pthread_t vcd_thread;
+static pthread_mutex_t vcd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vcd_cond = PTHREAD_COND_INITIALIZER;
+static vcd_record_t *vcd_pending = NULL;
+static size_t vcd_pending_fill = 0;
+static bool vcd_done = false;
+
+/* Last state as seen by the emulator side. */
+static uint8_t vcd_pins[VCD_PORTS];
+static uint8_t vcd_tris[VCD_PORTS];
+
+/* Last state as written to the file by the writer thread. */
+static uint8_t vcd_out_pins[VCD_PORTS];
+static uint8_t vcd_out_tris[VCD_PORTS];
+static uint32_t vcd_out_cycle = 0;
+static uint64_t vcd_out_time = 0;
+static bool vcd_out_first = true;
+
+
+
+static inline char vcd_pin_id(int port, int bit)
+{
+  return '!' + (port * 8) + bit;
+}
+
+
+
+static inline char vcd_tris_id(int port)
+{
+  return '!' + (VCD_PORTS * 8) + port;
+}
+
+
+
+static void vcd_write_tris(int port, uint8_t tris)
+{
+  char bits[9];
+
+  for (int i = 0; i < 8; i++) {
+    bits[i] = ((tris >> (7 - i)) & 1) ? '1' : '0';
+  }
+  bits[8] = '\0';
+  fprintf(vcd_fh, "b%s %c\n", bits, vcd_tris_id(port));
+}
+
+
+
+static void vcd_write_records(const vcd_record_t *records, size_t count)
+{
+  const vcd_record_t *r;
+  uint8_t changed;
+
+  for (size_t i = 0; i < count; i++) {
+    r = &records[i];
+
+    if (vcd_out_first || r->cycle != vcd_out_cycle) {
+      if (! vcd_out_first && r->cycle < vcd_out_cycle) {
+        vcd_out_time += 0x100000000; /* Cycle counter wrapped. */
+      }
+      vcd_out_time = (vcd_out_time & ~0xFFFFFFFFULL) | r->cycle;
+      vcd_out_cycle = r->cycle;
+      vcd_out_first = false;
+      fprintf(vcd_fh, "#%llu\n", (unsigned long long)vcd_out_time);
+    }
+
+    changed = r->pins ^ vcd_out_pins[r->port];
+    for (int bit = 0; bit < 8; bit++) {
+      if ((changed >> bit) & 1) {
+        fprintf(vcd_fh, "%d%c\n", (r->pins >> bit) & 1,
+          vcd_pin_id(r->port, bit));
+      }
+    }
+    if (r->tris != vcd_out_tris[r->port]) {
+      vcd_write_tris(r->port, r->tris);
+    }
+
+    vcd_out_pins[r->port] = r->pins;
+    vcd_out_tris[r->port] = r->tris;
+  }
+}
+
+
+
+static void *vcd_writer(void *arg)
+{
+  (void)arg;
+
+  pthread_mutex_lock(&vcd_mutex);
+  while (1) {
+    while (vcd_pending == NULL && ! vcd_done) {
+      pthread_cond_wait(&vcd_cond, &vcd_mutex);
+    }
+    if (vcd_pending == NULL && vcd_done) {
+      break;
+    }
+
+    pthread_mutex_unlock(&vcd_mutex);
+    vcd_write_records(vcd_pending, vcd_pending_fill);
+    pthread_mutex_lock(&vcd_mutex);
+
+    vcd_pending = NULL;
+    pthread_cond_broadcast(&vcd_cond);
+  }
+  pthread_mutex_unlock(&vcd_mutex);
+
+  fflush(vcd_fh);
+  return NULL;
+}
+
+
+
+static void vcd_handover(void)
+{
+  pthread_mutex_lock(&vcd_mutex);
+  while (vcd_pending != NULL) {
+    pthread_cond_wait(&vcd_cond, &vcd_mutex);
+  }
+  vcd_pending = vcd_buffer[vcd_active];
+  vcd_pending_fill = vcd_fill;
+  pthread_cond_broadcast(&vcd_cond);
+  pthread_mutex_unlock(&vcd_mutex);
+
+  vcd_active ^= 1;
+  vcd_fill = 0;
+}
+
+
+
+static void vcd_sample(pic_t *pic, int port)
+{
+  uint8_t pins = pic_port_pins(pic, port);
+  uint8_t tris = pic->r[PIC_REG_TRISA + port];
+  vcd_record_t *r;
+
+  if (pins == vcd_pins[port] && tris == vcd_tris[port]) {
+    return;
+  }
+  vcd_pins[port] = pins;
+  vcd_tris[port] = tris;
+
+  r = &vcd_buffer[vcd_active][vcd_fill];
+  r->cycle = pic->cycle;
+  r->port = port;
+  r->pins = pins;
+  r->tris = tris;
+
+  vcd_fill++;
+  if (vcd_fill >= VCD_BUFFER_RECORDS) {
+    vcd_handover();
+  }
+}
+
+
+
+static void vcd_reg_write(pic_t *pic, void *user, uint16_t f)
+{
+  (void)user;
+
+  switch (f) {
+  case PIC_REG_PORTA:
+  case PIC_REG_PORTB:
+  case PIC_REG_PORTC:
+  case PIC_REG_PORTD:
+  case PIC_REG_PORTE:
+    vcd_sample(pic, f - PIC_REG_PORTA);
+    break;
+  case PIC_REG_TRISA:
+  case PIC_REG_TRISB:
+  case PIC_REG_TRISC:
+  case PIC_REG_TRISD:
+  case PIC_REG_TRISE:
+    vcd_sample(pic, f - PIC_REG_TRISA);
+    break;
+  default:
+    break;
+  }
+
+  if (vcd_next_hook != NULL) {
+    (vcd_next_hook)(pic, vcd_next_user, f);
+  }
+}
+
+
+
+static void vcd_close(void)
+{
+  if (vcd_fill > 0) {
+    vcd_handover();
+  }
+
+  pthread_mutex_lock(&vcd_mutex);
+  vcd_done = true;
+  pthread_cond_broadcast(&vcd_cond);
+  pthread_mutex_unlock(&vcd_mutex);
+  pthread_join(vcd_thread, NULL);
+
+  fclose(vcd_fh);
+  vcd_fh = NULL;
+}
+
+
+
+static void vcd_header(pic_t *pic)
+{
+  int port;
+  int bit;
+
+  fprintf(vcd_fh, "$version pic16chu $end\n");
+  fprintf(vcd_fh, "$comment One time unit per instruction cycle. $end\n");
+  fprintf(vcd_fh, "$timescale 1us $end\n");
+  fprintf(vcd_fh, "$scope module pic $end\n");
+  for (port = 0; port < VCD_PORTS; port++) {
+    for (bit = 0; bit < 8; bit++) {
+      fprintf(vcd_fh, "$var wire 1 %c R%c%d $end\n",
+        vcd_pin_id(port, bit), 'A' + port, bit);
+    }
+  }
+  for (port = 0; port < VCD_PORTS; port++) {
+    fprintf(vcd_fh, "$var wire 8 %c TRIS%c $end\n",
+      vcd_tris_id(port), 'A' + port);
+  }
+  fprintf(vcd_fh, "$upscope $end\n");
+  fprintf(vcd_fh, "$enddefinitions $end\n");
+
+  vcd_out_time = pic->cycle;
+  vcd_out_cycle = pic->cycle;
+  vcd_out_first = false;
+  fprintf(vcd_fh, "#%u\n", pic->cycle);
+  fprintf(vcd_fh, "$dumpvars\n");
+  for (port = 0; port < VCD_PORTS; port++) {
+    vcd_pins[port] = vcd_out_pins[port] = pic_port_pins(pic, port);
+    vcd_tris[port] = vcd_out_tris[port] = pic->r[PIC_REG_TRISA + port];
+    for (bit = 0; bit < 8; bit++) {
+      fprintf(vcd_fh, "%d%c\n", (vcd_pins[port] >> bit) & 1,
+        vcd_pin_id(port, bit));
+    }
+    vcd_write_tris(port, vcd_tris[port]);
+  }
+  fprintf(vcd_fh, "$end\n");
+}
+
+
+
+int vcd_init(pic_t *pic, const char *filename)
+{
+  vcd_fh = fopen(filename, "w");
+  if (vcd_fh == NULL) {
+    return -1;
+  }
+
+  vcd_buffer[0] = malloc(VCD_BUFFER_RECORDS * sizeof(vcd_record_t));
+  vcd_buffer[1] = malloc(VCD_BUFFER_RECORDS * sizeof(vcd_record_t));
+  if (vcd_buffer[0] == NULL || vcd_buffer[1] == NULL) {
+    fclose(vcd_fh);
+    return -1;
+  }
+
+  vcd_header(pic);
+
+  if (pthread_create(&vcd_thread, NULL, vcd_writer, NULL) != 0) {
+    fclose(vcd_fh);
+    return -1;
+  }
+
+  vcd_next_hook = pic->reg_write_hook;
+  vcd_next_user = pic->reg_write_user;
+  pic->reg_write_hook = vcd_reg_write;
+  pic->reg_write_user = NULL;
+  atexit(vcd_close);
+  return 0;
+}
+
+
+
@@ -0,0 +1,8 @@
+#ifndef _VCD_H
+#define _VCD_H
+
+#include "pic.h"
+
+int vcd_init(pic_t *pic, const char *filename);
+
+#endif /* _VCD_H */